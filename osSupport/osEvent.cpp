@@ -31,6 +31,8 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#elif __linux__
+#include <time.h>
 #endif
 #include <stdio.h>
 #include <string.h>
@@ -38,7 +40,7 @@
 #include "osEvent.hpp"
 #include "osThread.hpp"
 
-osEvent* osEvent::InstanceList[osEvent::INSTANCE_MAX];
+osEvent* osEvent::InstanceHead = 0;
 osMutex  osEvent::ListMutex("Event List");
 
 osEvent::osEvent(const char* name)
@@ -47,38 +49,31 @@ osEvent::osEvent(const char* name)
     m_test(false)
     ,
 #endif
-    pending(NULL)
+    Name(name)
+    , pending(NULL)
 {
-    if (name)
-    {
-        strncpy(Name, name, NAME_LENGTH_MAX - 1);
-    }
 #ifdef _WIN32
-    Handle = CreateEvent(NULL, true, false, name);
+    // Unnamed, events with the same name would be one system wide event
+    Handle = CreateEvent(NULL, true, false, NULL);
 #elif __linux__
     pthread_mutex_init(&m_mutex, NULL);
     pthread_cond_init(&m_condition, NULL);
 #endif
     ListMutex.Take(__FILE__, __LINE__);
-    for (int i = 0; i < INSTANCE_MAX; i++)
-    {
-        if (InstanceList[i] == 0)
-        {
-            InstanceList[i] = this;
-            break;
-        }
-    }
+    NextInstance = InstanceHead;
+    InstanceHead = this;
     ListMutex.Give();
 }
 
 osEvent::~osEvent()
 {
     ListMutex.Take(__FILE__, __LINE__);
-    for (int i = 0; i < INSTANCE_MAX; i++)
+    for (osEvent** e = &InstanceHead; *e != 0; e = &(*e)->NextInstance)
     {
-        if (InstanceList[i] == this)
+        if (*e == this)
         {
-            InstanceList[i] = 0;
+            *e = NextInstance;
+            break;
         }
     }
 #ifdef WIN32
@@ -125,20 +120,40 @@ bool osEvent::Wait(const char* file, int line, int msTimeout)
         thread->SetState(osThread::PENDING_EVENT, file, line, this);
         pending = thread;
     }
+    struct timespec expire;
+    if (msTimeout != -1)
+    {
+        clock_gettime(CLOCK_REALTIME, &expire);
+        expire.tv_sec += msTimeout / 1000;
+        expire.tv_nsec += (msTimeout % 1000) * 1000000;
+        if (expire.tv_nsec >= 1000000000)
+        {
+            expire.tv_sec++;
+            expire.tv_nsec -= 1000000000;
+        }
+    }
     pthread_mutex_lock(&m_mutex);
     int rc = 0;
     while (m_test == false && rc == 0)
     {
-        rc = pthread_cond_wait(&m_condition, &m_mutex);
+        if (msTimeout == -1)
+        {
+            rc = pthread_cond_wait(&m_condition, &m_mutex);
+        }
+        else
+        {
+            rc = pthread_cond_timedwait(&m_condition, &m_mutex, &expire);
+        }
     }
-    m_test = false;
+    bool signaled = m_test;
+    m_test        = false;
     if (thread)
     {
         thread->ClearState();
         pending = NULL;
     }
     pthread_mutex_unlock(&m_mutex);
-    return true;
+    return signaled;
 #endif
 }
 
@@ -149,24 +164,20 @@ const char* osEvent::GetName()
 
 void osEvent::Show(osPrintfInterface* out)
 {
-    uint32_t i;
-
     out->Printf("Event                         |Thread Name         |State\n");
     out->Printf("------------------------------+--------------------+------------\n");
-    for (i = 0; i < INSTANCE_MAX; i++)
+    ListMutex.Take(__FILE__, __LINE__);
+    for (osEvent* e = InstanceHead; e != 0; e = e->NextInstance)
     {
-        osEvent* e = InstanceList[i];
-        if (e)
+        osThread* thread = e->pending;
+        if (thread)
         {
-            osThread* thread = e->pending;
-            if (thread)
-            {
-                out->Printf("%-30s|%-20s|%-10s\n", e->GetName(), thread->GetName(), "");
-            }
-            else
-            {
-                out->Printf("%-30s|%-20s|%-10s\n", e->GetName(), "", "");
-            }
+            out->Printf("%-30s|%-20s|%-10s\n", e->GetName(), thread->GetName(), "");
+        }
+        else
+        {
+            out->Printf("%-30s|%-20s|%-10s\n", e->GetName(), "", "");
         }
     }
+    ListMutex.Give();
 }
@@ -64,13 +64,13 @@ private:
     pthread_cond_t  m_condition;
     bool            m_test;
 #endif
-    static const int NAME_LENGTH_MAX = 80;
-    char             Name[NAME_LENGTH_MAX];
-    osThread*        pending;
+    const char* Name;
+    osThread*   pending;
 
-    static osMutex   ListMutex;
-    static const int INSTANCE_MAX = 20;
-    static osEvent*  InstanceList[];
+    // Every event is on the list for Show, however many there are
+    static osMutex  ListMutex;
+    static osEvent* InstanceHead;
+    osEvent*        NextInstance;
 };
 
 #endif
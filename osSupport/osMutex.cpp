@@ -37,11 +37,11 @@
 #include "osMutex.hpp"
 #include "osThread.hpp"
 
-osMutex* osMutex::MutexList[MAX_MUTEX];
+osMutex* osMutex::MutexHead = NULL;
 
 #ifdef __linux__
-// Can't use osMutex to lock the MutexList because you can't create an osMutex
-// without locking the MutexList, so make a private mutex
+// Can't use osMutex to lock the mutex list because you can't create an osMutex
+// without locking the mutex list, so make a private mutex
 pthread_mutex_t osMutex::MutexListMutex;
 #endif
 
@@ -51,7 +51,8 @@ osMutex::osMutex(const char* name)
     , OwnerThread(NULL)
 {
 #ifdef _WIN32
-    Handle = CreateMutex(NULL, false, name);
+    // Unnamed, mutexes with the same name would be one system wide mutex
+    Handle = CreateMutex(NULL, false, NULL);
 #elif __linux__
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
@@ -61,11 +62,21 @@ osMutex::osMutex(const char* name)
 
     StaticInit();
     LockListMutex();
-    for (int i = 0; i < MAX_MUTEX; i++)
+    NextMutex = MutexHead;
+    MutexHead = this;
+    UnlockListMutex();
+}
+
+// Only unlinks, the OS mutex is left alone because static mutexes like the
+// event list lock can still be taken by other static destructors at exit
+osMutex::~osMutex()
+{
+    LockListMutex();
+    for (osMutex** mutex = &MutexHead; *mutex != NULL; mutex = &(*mutex)->NextMutex)
     {
-        if (MutexList[i] == NULL)
+        if (*mutex == this)
         {
-            MutexList[i] = this;
+            *mutex = NextMutex;
             break;
         }
     }
@@ -124,6 +135,8 @@ bool osMutex::Take(const char* file, int line)
     }
     OwnerFile = file;
     OwnerLine = line;
+
+    return true;
 #endif
 }
 
@@ -133,6 +146,8 @@ bool osMutex::Take()
     return WaitForSingleObject(Handle, INFINITE) == 0;
 #elif __linux__
     pthread_mutex_lock(&m_mutex);
+
+    return true;
 #endif
 }
 
@@ -179,24 +194,20 @@ void osMutex::Show(osPrintfInterface* pfunc)
         "--------------------+-------+--------------------+------+--------------------\n");
 
     LockListMutex();
-    for (int i = 0; i < MAX_MUTEX; i++)
+    for (osMutex* mutex = MutexHead; mutex != NULL; mutex = mutex->NextMutex)
     {
-        osMutex* mutex = MutexList[i];
-        if (mutex != NULL)
+        if (mutex->OwnerFile)
+        {
+            pfunc->Printf("%-20s|%-7s|%-20s|%-6d|%s\n",
+                          mutex->Name,
+                          "",
+                          "",
+                          mutex->OwnerLine,
+                          mutex->OwnerFile);
+        }
+        else
         {
-            if (mutex->OwnerFile)
-            {
-                pfunc->Printf("%-20s|%-7s|%-20s|%-6d|%s\n",
-                              mutex->Name,
-                              "",
-                              "",
-                              mutex->OwnerLine,
-                              mutex->OwnerFile);
-            }
-            else
-            {
-                pfunc->Printf("%-20s|%-7s|%-20s|%-6s|%s\n", mutex->Name, "", "", "", "");
-            }
+            pfunc->Printf("%-20s|%-7s|%-20s|%-6s|%s\n", mutex->Name, "", "", "", "");
         }
     }
     UnlockListMutex();
@@ -41,8 +41,6 @@
 
 class osThread;
 
-#define MAX_MUTEX (16)
-
 class osMutex
 {
     friend class osThread;
@@ -50,6 +48,8 @@ class osMutex
 public:
     osMutex(const char* name);
 
+    ~osMutex();
+
     void Give();
 
     bool Take(const char* file, int line);
@@ -64,8 +64,8 @@ private:
 #elif __linux__
     pthread_mutex_t m_mutex;
 
-    // Can't use osMutex to lock the MutexList because you can't create an osMutex
-    // without locking the MutexList, so make a private mutex
+    // Can't use osMutex to lock the mutex list because you can't create an osMutex
+    // without locking the mutex list, so make a private mutex
     static pthread_mutex_t MutexListMutex;
 #endif
 
@@ -75,7 +75,8 @@ private:
 
     bool            Take();
     const char*     Name;
-    static osMutex* MutexList[];
+    static osMutex* MutexHead; // Every mutex is on the list for Show
+    osMutex*        NextMutex;
 
     const char* OwnerFile;
     int         OwnerLine;
@@ -0,0 +1,76 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#ifdef _WIN32
+#define _CRT_RAND_S
+#include <stdlib.h>
+#elif __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "osRandom.hpp"
+
+bool osRandom::GetBytes(uint8_t* data, size_t length)
+{
+    bool rc = true;
+
+#ifdef _WIN32
+    unsigned int value;
+
+    for (size_t i = 0; i < length && rc; i++)
+    {
+        rc      = rand_s(&value) == 0;
+        data[i] = (uint8_t)value;
+    }
+#elif __linux__
+    ssize_t count;
+    size_t  offset = 0;
+    int     fd     = open("/dev/urandom", O_RDONLY);
+
+    rc = fd >= 0;
+    while (rc && offset < length)
+    {
+        count = read(fd, data + offset, length - offset);
+        rc    = count > 0;
+        if (rc)
+        {
+            offset += count;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+
+    return rc;
+}
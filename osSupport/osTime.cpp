@@ -31,8 +31,12 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <intrin.h>
 #elif __linux__
 #include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 #endif
 #include <stdio.h>
 
@@ -60,6 +64,19 @@ uint64_t osTime::GetTime()
 #endif
 }
 
+uint64_t osTime::GetCycleCount()
+{
+#ifdef _WIN32
+    return __rdtsc();
+#elif defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 const char* osTime::GetTimestamp()
 {
     static char s[64];
@@ -40,6 +40,10 @@ public:
     static const char* GetTimestamp();
 
     static uint64_t GetTime();
+
+    /// GetCycleCount returns a free running counter for profiling short code
+    /// paths. Units are CPU cycles on x86 and nanoseconds elsewhere.
+    static uint64_t GetCycleCount();
 };
 
 #endif
@@ -36,8 +36,29 @@
 
 #define TCP_MAX_CONNECTIONS (5)
 #define TCP_RX_WINDOW_SIZE (256)
+// Receive buffers start at TCP_RX_WINDOW_SIZE and grow a page of that size
+// at a time, up to TCP_RX_BUFFER_MAX, from pages shared by all connections
+#define TCP_RX_BUFFER_MAX (2048)
+#define TCP_RX_PAGES_MAX (TCP_RX_BUFFER_MAX / TCP_RX_WINDOW_SIZE)
+#define TCP_RX_PAGE_COUNT (16)
+#define TCP_RX_POST_COUNT (4) // Application buffers a connection may have posted
+#define TCP_TX_BUFFER_SIZE (2048)
+#define TCP_TX_SEGMENT_COUNT (16)
+// Send and receive buffer sets shared by the connections. Listeners and
+// TIMED_WAIT connections hold none and a server always has a listener.
+#define TCP_BUFFER_COUNT (TCP_MAX_CONNECTIONS - 1)
+#define TCP_FAST_OPEN_CACHE_SIZE (4)
+#define TCP_FAST_OPEN_COOKIE_SIZE (8)
 
 #define TX_BUFFER_COUNT (20)
+#define TX_BATCH_SIZE (8) // Frames handed to the driver in one call
+#define TX_FLOW_COUNT (8) // Transmit scheduler queues
+// Queues served ahead of the round robin flows, in order: network control,
+// then expedited forwarding
+#define TX_FLOW_PRIORITY (2)
+#define TX_FLOW_QUANTUM (1514) // Bytes a flow may send in its round robin turn
+#define UDP_SHAPER_COUNT (2)    // UDP ports that may have a rate limit
+#define RX_BATCH_SIZE (8) // Frames a driver passes to ProcessRxBatch at most
 #define RX_BUFFER_COUNT (20)
 
 #define DATA_BUFFER_PAYLOAD_SIZE (512)
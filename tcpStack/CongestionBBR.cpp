@@ -0,0 +1,409 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "CongestionBBR.hpp"
+
+// Pacing gain for each phase of the PROBE_BW cycle
+static const uint16_t CycleGain[BBR_CYCLE_LENGTH] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+//============================================================================
+//
+//============================================================================
+
+void CongestionBBR::Initialize(uint16_t mss, uint32_t initialWindow, uint32_t time_us)
+{
+    int i;
+
+    State              = STARTUP;
+    MSS                = mss;
+    InitialWindow      = initialWindow;
+    CongestionWindow   = initialWindow;
+    PriorWindow        = 0;
+    PacingRate         = 0;
+    PacingGain         = BBR_STARTUP_GAIN;
+    WindowGain         = BBR_STARTUP_GAIN;
+    Bandwidth          = 0;
+    RoundCount         = 0;
+    NextRoundDelivered = 0;
+    RoundStart         = false;
+    FullBandwidth      = 0;
+    FullBandwidthCount = 0;
+    FilledPipe         = false;
+    CycleIndex         = 0;
+    CycleStamp_us      = time_us;
+    MinRTT_us          = 0;
+    MinRTTStamp_us     = time_us;
+    ProbeRTTDone_us    = 0;
+    ProbeRTTRoundDone  = false;
+    for (i = 0; i < BBR_BANDWIDTH_ROUNDS; i++)
+    {
+        BandwidthMax[i] = 0;
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void CongestionBBR::OnAck(const TCPRateSample& sample,
+                          uint32_t             acked,
+                          uint32_t             delivered,
+                          uint32_t             inFlight,
+                          uint32_t             time_us)
+{
+    UpdateRound(sample, delivered);
+    UpdateBandwidth(sample);
+    CheckFullPipe(sample);
+
+    if (State == STARTUP && FilledPipe)
+    {
+        State      = DRAIN;
+        PacingGain = BBR_DRAIN_GAIN;
+        WindowGain = BBR_STARTUP_GAIN;
+    }
+    if (State == DRAIN && inFlight <= Inflight(100))
+    {
+        EnterProbeBW(time_us);
+    }
+    if (State == PROBE_BW)
+    {
+        UpdateCycle(inFlight, time_us);
+    }
+    UpdateMinRTT(sample, delivered, inFlight, time_us);
+
+    if (Bandwidth != 0)
+    {
+        // Keep the startup rate until the pipe is known to be full
+        uint32_t rate = (uint32_t)(((uint64_t)Bandwidth * PacingGain) / 100);
+        if (FilledPipe || rate > PacingRate)
+        {
+            PacingRate = rate;
+        }
+    }
+    UpdateWindow(acked, delivered);
+}
+
+//============================================================================
+// Loss says little about the bottleneck, the model is kept and the window
+// grows back to it within a round trip
+//============================================================================
+
+void CongestionBBR::OnTimeout()
+{
+    CongestionWindow = BBR_MIN_WINDOW_SEGMENTS * MSS;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint32_t CongestionBBR::GetCongestionWindow()
+{
+    return CongestionWindow;
+}
+
+//============================================================================
+// 0 until the first delivery rate sample
+//============================================================================
+
+uint32_t CongestionBBR::GetPacingRate()
+{
+    return PacingRate;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint32_t CongestionBBR::GetBandwidth()
+{
+    return Bandwidth;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint32_t CongestionBBR::GetMinRTT()
+{
+    return MinRTT_us;
+}
+
+//============================================================================
+//
+//============================================================================
+
+const char* CongestionBBR::GetStateString()
+{
+    const char* rc;
+    switch (State)
+    {
+    case STARTUP: rc = "STARTUP"; break;
+    case DRAIN: rc = "DRAIN"; break;
+    case PROBE_BW: rc = "PROBE_BW"; break;
+    case PROBE_RTT: rc = "PROBE_RTT"; break;
+    default: rc = "unknown"; break;
+    }
+    return rc;
+}
+
+//============================================================================
+// A round trip ends when a segment sent after the previous round's end is
+// acknowledged
+//============================================================================
+
+void CongestionBBR::UpdateRound(const TCPRateSample& sample, uint32_t delivered)
+{
+    RoundStart = false;
+    if ((int32_t)(sample.PriorDelivered - NextRoundDelivered) >= 0)
+    {
+        NextRoundDelivered = delivered;
+        RoundCount++;
+        RoundStart = true;
+
+        // The slot being reused holds a sample from BBR_BANDWIDTH_ROUNDS ago
+        BandwidthMax[RoundCount % BBR_BANDWIDTH_ROUNDS] = 0;
+    }
+}
+
+//============================================================================
+// Bandwidth is the max delivery rate over the last BBR_BANDWIDTH_ROUNDS
+// rounds. App limited samples only count if they raise the estimate.
+//============================================================================
+
+void CongestionBBR::UpdateBandwidth(const TCPRateSample& sample)
+{
+    uint32_t rate;
+    int      i;
+
+    if (sample.Interval_us != 0)
+    {
+        rate = (uint32_t)(((uint64_t)sample.Delivered * 1000000) / sample.Interval_us);
+        if (!sample.AppLimited || rate >= Bandwidth)
+        {
+            if (rate > BandwidthMax[RoundCount % BBR_BANDWIDTH_ROUNDS])
+            {
+                BandwidthMax[RoundCount % BBR_BANDWIDTH_ROUNDS] = rate;
+            }
+        }
+    }
+
+    Bandwidth = 0;
+    for (i = 0; i < BBR_BANDWIDTH_ROUNDS; i++)
+    {
+        if (BandwidthMax[i] > Bandwidth)
+        {
+            Bandwidth = BandwidthMax[i];
+        }
+    }
+}
+
+//============================================================================
+// The pipe is full once three rounds in a row fail to grow the bandwidth
+// estimate by a quarter
+//============================================================================
+
+void CongestionBBR::CheckFullPipe(const TCPRateSample& sample)
+{
+    if (!FilledPipe && RoundStart && !sample.AppLimited)
+    {
+        if (Bandwidth >= (uint32_t)(((uint64_t)FullBandwidth * BBR_FULL_BANDWIDTH_GROWTH) / 100))
+        {
+            FullBandwidth      = Bandwidth;
+            FullBandwidthCount = 0;
+        }
+        else if (++FullBandwidthCount >= BBR_FULL_BANDWIDTH_ROUNDS)
+        {
+            FilledPipe = true;
+        }
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void CongestionBBR::EnterProbeBW(uint32_t time_us)
+{
+    State      = PROBE_BW;
+    WindowGain = BBR_CWND_GAIN;
+
+    // Start at a random phase other than the drain phase
+    CycleIndex = (uint8_t)((time_us >> 4) % BBR_CYCLE_LENGTH);
+    if (CycleIndex == 1)
+    {
+        CycleIndex = 2;
+    }
+    PacingGain    = CycleGain[CycleIndex];
+    CycleStamp_us = time_us;
+}
+
+//============================================================================
+// Each phase lasts about one min RTT. The probe phase runs until the extra
+// data is in flight, the drain phase ends early once the queue is gone.
+//============================================================================
+
+void CongestionBBR::UpdateCycle(uint32_t inFlight, uint32_t time_us)
+{
+    bool fullLength = (time_us - CycleStamp_us) > MinRTT_us;
+    bool advance;
+
+    if (PacingGain == 100)
+    {
+        advance = fullLength;
+    }
+    else if (PacingGain > 100)
+    {
+        advance = fullLength && inFlight >= Inflight(PacingGain);
+    }
+    else
+    {
+        advance = fullLength || inFlight <= Inflight(100);
+    }
+
+    if (advance)
+    {
+        CycleIndex    = (CycleIndex + 1) % BBR_CYCLE_LENGTH;
+        PacingGain    = CycleGain[CycleIndex];
+        CycleStamp_us = time_us;
+    }
+}
+
+//============================================================================
+// A min RTT older than BBR_MIN_RTT_WINDOW_US is refreshed by draining the
+// queue for BBR_PROBE_RTT_TIME_US and at least one round trip
+//============================================================================
+
+void CongestionBBR::UpdateMinRTT(const TCPRateSample& sample,
+                                 uint32_t             delivered,
+                                 uint32_t             inFlight,
+                                 uint32_t             time_us)
+{
+    bool expired = (time_us - MinRTTStamp_us) > BBR_MIN_RTT_WINDOW_US;
+
+    if (sample.RTT_us != 0 && (MinRTT_us == 0 || sample.RTT_us <= MinRTT_us || expired))
+    {
+        MinRTT_us      = sample.RTT_us;
+        MinRTTStamp_us = time_us;
+    }
+
+    if (expired && State != PROBE_RTT)
+    {
+        State           = PROBE_RTT;
+        PacingGain      = 100;
+        PriorWindow     = CongestionWindow;
+        ProbeRTTDone_us = 0;
+    }
+
+    if (State == PROBE_RTT)
+    {
+        if (ProbeRTTDone_us == 0 && inFlight <= BBR_MIN_WINDOW_SEGMENTS * MSS)
+        {
+            ProbeRTTDone_us    = (time_us + BBR_PROBE_RTT_TIME_US) | 1;
+            ProbeRTTRoundDone  = false;
+            NextRoundDelivered = delivered;
+        }
+        else if (ProbeRTTDone_us != 0)
+        {
+            if (RoundStart)
+            {
+                ProbeRTTRoundDone = true;
+            }
+            if (ProbeRTTRoundDone && (int32_t)(time_us - ProbeRTTDone_us) >= 0)
+            {
+                MinRTTStamp_us = time_us;
+                if (CongestionWindow < PriorWindow)
+                {
+                    CongestionWindow = PriorWindow;
+                }
+                if (FilledPipe)
+                {
+                    EnterProbeBW(time_us);
+                }
+                else
+                {
+                    State      = STARTUP;
+                    PacingGain = BBR_STARTUP_GAIN;
+                    WindowGain = BBR_STARTUP_GAIN;
+                }
+            }
+        }
+    }
+}
+
+//============================================================================
+// Window target is the estimated bandwidth delay product times the window
+// gain, approached by the bytes each ACK delivers
+//============================================================================
+
+void CongestionBBR::UpdateWindow(uint32_t acked, uint32_t delivered)
+{
+    uint32_t target = Inflight(WindowGain) + 3 * MSS;
+
+    if (FilledPipe)
+    {
+        CongestionWindow += acked;
+        if (CongestionWindow > target)
+        {
+            CongestionWindow = target;
+        }
+    }
+    else if (CongestionWindow < target || delivered < InitialWindow)
+    {
+        CongestionWindow += acked;
+    }
+
+    if (CongestionWindow < BBR_MIN_WINDOW_SEGMENTS * MSS)
+    {
+        CongestionWindow = BBR_MIN_WINDOW_SEGMENTS * MSS;
+    }
+    if (State == PROBE_RTT && CongestionWindow > BBR_MIN_WINDOW_SEGMENTS * MSS)
+    {
+        CongestionWindow = BBR_MIN_WINDOW_SEGMENTS * MSS;
+    }
+}
+
+//============================================================================
+// Bytes in flight the model allows at the given gain, the initial window
+// until there is an RTT sample
+//============================================================================
+
+uint32_t CongestionBBR::Inflight(uint32_t gain)
+{
+    uint64_t rc = InitialWindow;
+
+    if (MinRTT_us != 0 && Bandwidth != 0)
+    {
+        rc = ((uint64_t)Bandwidth * MinRTT_us) / 1000000;
+        rc = (rc * gain) / 100;
+    }
+    return (uint32_t)rc;
+}
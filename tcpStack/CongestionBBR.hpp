@@ -0,0 +1,119 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <inttypes.h>
+
+// Gains are in percent
+#define BBR_STARTUP_GAIN 289 // 2/ln(2), doubles the delivery rate each round
+#define BBR_DRAIN_GAIN 35    // Inverse of the startup gain
+#define BBR_CWND_GAIN 200
+#define BBR_BANDWIDTH_ROUNDS 10
+#define BBR_FULL_BANDWIDTH_GROWTH 125
+#define BBR_FULL_BANDWIDTH_ROUNDS 3
+#define BBR_MIN_RTT_WINDOW_US 10000000
+#define BBR_PROBE_RTT_TIME_US 200000
+#define BBR_MIN_WINDOW_SEGMENTS 4
+#define BBR_CYCLE_LENGTH 8
+
+// Delivery rate sample taken when a sent segment is acknowledged
+struct TCPRateSample
+{
+    uint32_t Delivered;      // Bytes delivered over Interval_us
+    uint32_t Interval_us;    // 0 if the sample is not usable
+    uint32_t PriorDelivered; // Connection delivered count when the segment was sent
+    uint32_t RTT_us;         // 0 if the segment was retransmitted
+    bool     AppLimited;
+};
+
+// Bottleneck bandwidth and round trip propagation time congestion control.
+// The connection feeds it rate samples and uses the congestion window and
+// pacing rate it models.
+class CongestionBBR
+{
+public:
+    void Initialize(uint16_t mss, uint32_t initialWindow, uint32_t time_us);
+    void OnAck(const TCPRateSample& sample,
+               uint32_t             acked,
+               uint32_t             delivered,
+               uint32_t             inFlight,
+               uint32_t             time_us);
+    void OnTimeout();
+
+    uint32_t GetCongestionWindow();
+    uint32_t GetPacingRate();
+    uint32_t GetBandwidth();
+    uint32_t GetMinRTT();
+    const char* GetStateString();
+
+private:
+    typedef enum { STARTUP, DRAIN, PROBE_BW, PROBE_RTT } States;
+
+    void     UpdateRound(const TCPRateSample&, uint32_t delivered);
+    void     UpdateBandwidth(const TCPRateSample&);
+    void     CheckFullPipe(const TCPRateSample&);
+    void     UpdateCycle(uint32_t inFlight, uint32_t time_us);
+    void     UpdateMinRTT(const TCPRateSample&,
+                          uint32_t delivered,
+                          uint32_t inFlight,
+                          uint32_t time_us);
+    void     UpdateWindow(uint32_t acked, uint32_t delivered);
+    void     EnterProbeBW(uint32_t time_us);
+    uint32_t Inflight(uint32_t gain);
+
+    States   State;
+    uint16_t MSS;
+    uint32_t InitialWindow;
+    uint32_t CongestionWindow;
+    uint32_t PriorWindow; // Window saved on entering PROBE_RTT
+    uint32_t PacingRate;
+    uint16_t PacingGain;
+    uint16_t WindowGain;
+
+    uint32_t BandwidthMax[BBR_BANDWIDTH_ROUNDS]; // Max delivery rate of recent rounds
+    uint32_t Bandwidth;
+    uint32_t RoundCount;
+    uint32_t NextRoundDelivered;
+    bool     RoundStart;
+
+    uint32_t FullBandwidth;
+    uint8_t  FullBandwidthCount;
+    bool     FilledPipe;
+
+    uint8_t  CycleIndex;
+    uint32_t CycleStamp_us;
+
+    uint32_t MinRTT_us;
+    uint32_t MinRTTStamp_us;
+    uint32_t ProbeRTTDone_us;
+    bool     ProbeRTTRoundDone;
+};
@@ -45,11 +45,15 @@ DataBuffer::DataBuffer()
 
 void DataBuffer::Initialize(InterfaceMAC* mac)
 {
-    Packet     = Data;
-    Length     = 0;
-    Remainder  = DATA_BUFFER_PAYLOAD_SIZE;
-    Disposable = true;
-    MAC        = mac;
+    Packet        = Data;
+    Length        = 0;
+    Remainder     = DATA_BUFFER_PAYLOAD_SIZE;
+    Disposable    = true;
+    ChecksumValid = false;
+    Segments      = 1;
+    Flow          = 0;
+    Shaper        = 0;
+    MAC           = mac;
 }
 
 //============================================================================
@@ -35,17 +35,22 @@
 #include "Config.hpp"
 #include "InterfaceMAC.hpp"
 
+class TokenBucket;
+
 class DataBuffer
 {
 public:
     DataBuffer();
 
     uint8_t*      Packet;
-    uint32_t      AcknowledgementNumber;
-    uint32_t      Time_us;
     uint16_t      Length;
     uint16_t      Remainder;
     bool          Disposable;
+    bool          ChecksumValid; // Checked already by receive coalescing
+    uint8_t       Segments;      // Received segments coalesced into this one
+    uint8_t       Flow;          // Transmit scheduler queue, 0 for control traffic
+    DataBuffer*   Next;          // Link in a transmit scheduler queue
+    TokenBucket*  Shaper;        // The MAC holds the frame until it conforms, 0 for none
     InterfaceMAC* MAC;
 
     void Initialize(InterfaceMAC*);
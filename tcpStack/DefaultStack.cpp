@@ -44,6 +44,8 @@ DefaultStack::DefaultStack()
     , TCP(IP)
     , UDP(IP, DHCP)
 {
+    // Frames held back by the MAC's shapers are released from Tick
+    MAC.SetTimerEvent(TCP.GetTimerEvent());
 }
 
 //============================================================================
@@ -59,6 +61,15 @@ void DefaultStack::RegisterDataTransmitHandler(InterfaceMAC::DataTransmitHandler
 //
 //============================================================================
 
+void DefaultStack::RegisterDataTransmitBatchHandler(InterfaceMAC::DataTransmitBatchHandler handler)
+{
+    MAC.RegisterDataTransmitBatchHandler(handler);
+}
+
+//============================================================================
+//
+//============================================================================
+
 void DefaultStack::SetMACAddress(uint8_t* addr)
 {
     MAC.SetUnicastAddress(addr);
@@ -79,6 +90,7 @@ void DefaultStack::StartDHCP()
 
 void DefaultStack::Tick()
 {
+    MAC.Tick();
     TCP.Tick();
 }
 
@@ -86,6 +98,15 @@ void DefaultStack::Tick()
 //
 //============================================================================
 
+void DefaultStack::WaitForTick()
+{
+    TCP.WaitForTimer(MAC.GetReleaseDelay());
+}
+
+//============================================================================
+//
+//============================================================================
+
 void DefaultStack::ProcessRx(uint8_t* data, size_t length)
 {
     MAC.ProcessRx(data, length);
@@ -94,3 +115,12 @@ void DefaultStack::ProcessRx(uint8_t* data, size_t length)
 //============================================================================
 //
 //============================================================================
+
+void DefaultStack::ProcessRxBatch(uint8_t** data, size_t* length, int count)
+{
+    MAC.ProcessRxBatch(data, length, count);
+}
+
+//============================================================================
+//
+//============================================================================
@@ -45,11 +45,14 @@ class DefaultStack
 public:
     DefaultStack();
     void RegisterDataTransmitHandler(InterfaceMAC::DataTransmitHandler);
+    void RegisterDataTransmitBatchHandler(InterfaceMAC::DataTransmitBatchHandler);
     void SetMACAddress(uint8_t* addr);
     void StartDHCP();
     void Tick();
+    void WaitForTick();
 
     void ProcessRx(uint8_t* data, size_t length);
+    void ProcessRxBatch(uint8_t** data, size_t* length, int count);
 
     ProtocolMACEthernet MAC;
     ProtocolIPv4        IP;
@@ -40,15 +40,18 @@ class InterfaceMAC
 {
 public:
     typedef void (*DataTransmitHandler)(void* data, size_t length);
+    typedef void (*DataTransmitBatchHandler)(void** data, size_t* length, int count);
 
     virtual void           RegisterDataTransmitHandler(DataTransmitHandler) = 0;
     virtual size_t         AddressSize()                                    = 0;
     virtual size_t         HeaderSize()                                     = 0;
     virtual const uint8_t* GetUnicastAddress()                              = 0;
     virtual const uint8_t* GetBroadcastAddress()                            = 0;
-    virtual DataBuffer*    GetTxBuffer()                                    = 0;
+    virtual DataBuffer*    GetTxBuffer(bool wait = true)                    = 0;
     virtual void           FreeTxBuffer(DataBuffer*)                        = 0;
     virtual void           FreeRxBuffer(DataBuffer*)                        = 0;
     virtual void Transmit(DataBuffer*, const uint8_t* targetMAC, uint16_t type) = 0;
+    virtual void
+        TransmitBatch(DataBuffer**, int count, const uint8_t* targetMAC, uint16_t type) = 0;
     virtual void Retransmit(DataBuffer* buffer) = 0;
 };
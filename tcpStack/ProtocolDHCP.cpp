@@ -260,7 +260,7 @@ void ProtocolDHCP::Discover()
 
         uint8_t sourceIP[] = {0, 0, 0, 0};
         uint8_t targetIP[] = {255, 255, 255, 255};
-        UDP.Transmit(buffer, targetIP, 67, sourceIP, 68);
+        UDP.Transmit(buffer, targetIP, 67, sourceIP, 68, IP_DSCP_CONTROL);
     }
 }
 
@@ -346,7 +346,7 @@ void ProtocolDHCP::SendRequest(uint8_t        messageType,
 
         uint8_t sourceIP[] = {0, 0, 0, 0};
         uint8_t targetIP[] = {255, 255, 255, 255};
-        UDP.Transmit(buffer, targetIP, 67, sourceIP, 68);
+        UDP.Transmit(buffer, targetIP, 67, sourceIP, 68, IP_DSCP_CONTROL);
     }
 }
 
@@ -78,7 +78,11 @@ void ProtocolICMP::ProcessRx(DataBuffer* buffer, const uint8_t* remoteIP, const
             i = FCS::Checksum(txBuffer->Packet, buffer->Length);
             Pack16(txBuffer->Packet, 2, i); // set the checksum
             txBuffer->Length = buffer->Length;
-            IP.Transmit(txBuffer, 0x01, remoteIP, IP.GetUnicastAddress());
+            IP.Transmit(txBuffer,
+                        0x01,
+                        remoteIP,
+                        IP.GetUnicastAddress(),
+                        IP_DSCP_CONTROL << IP_DSCP_SHIFT);
         }
         break;
     default: break;
@@ -125,7 +125,7 @@ void ProtocolIPv4::ProcessRx(DataBuffer* buffer)
         case 0x02: // IGMP
             break;
         case 0x06: // TCP
-            TCP.ProcessRx(buffer, sourceIP, targetIP);
+            TCP.ProcessRx(buffer, sourceIP, targetIP, packet[1] & IP_ECN_MASK);
             break;
         case 0x11: // UDP
             UDP.ProcessRx(buffer, sourceIP, targetIP);
@@ -135,15 +135,59 @@ void ProtocolIPv4::ProcessRx(DataBuffer* buffer)
     }
 }
 
+//============================================================================
+// Receive coalescing. Merges the TCP payload in 'buffer' into the datagram
+// in 'held' when both have plain headers, are not fragmented and belong to
+// the same flow, TCP decides whether the segments themselves fit together.
+//============================================================================
+
+bool ProtocolIPv4::Coalesce(DataBuffer* held, DataBuffer* buffer)
+{
+    uint8_t* first       = held->Packet;
+    uint8_t* next        = buffer->Packet;
+    uint16_t firstLength = Unpack16(first, 2);
+    uint16_t nextLength  = Unpack16(next, 2);
+    uint16_t length      = 0;
+
+    if (first[0] == 0x45 && next[0] == 0x45 && first[9] == 0x06 && next[9] == 0x06 &&
+        first[1] == next[1] && (Unpack16(first, 6) & 0x3FFF) == 0 &&
+        (Unpack16(next, 6) & 0x3FFF) == 0 && AddressCompare(&first[12], &next[12], 8) &&
+        firstLength > IP_HEADER_SIZE && firstLength <= held->Length &&
+        nextLength > IP_HEADER_SIZE && nextLength <= buffer->Length)
+    {
+        length = TCP.Coalesce(&first[IP_HEADER_SIZE],
+                              firstLength - IP_HEADER_SIZE,
+                              held->Remainder - firstLength,
+                              held->ChecksumValid,
+                              &next[IP_HEADER_SIZE],
+                              nextLength - IP_HEADER_SIZE,
+                              &first[12],
+                              &first[16]);
+    }
+
+    if (length > 0)
+    {
+        firstLength += length;
+        Pack16(first, 2, firstLength);
+        Pack16(first, 10, 0);
+        Pack16(first, 10, FCS::Checksum(first, IP_HEADER_SIZE));
+        held->Length        = firstLength;
+        held->ChecksumValid = true;
+        held->Segments += buffer->Segments;
+    }
+
+    return length > 0;
+}
+
 //============================================================================
 //
 //============================================================================
 
-DataBuffer* ProtocolIPv4::GetTxBuffer(InterfaceMAC* mac)
+DataBuffer* ProtocolIPv4::GetTxBuffer(InterfaceMAC* mac, bool wait)
 {
     DataBuffer* buffer;
 
-    buffer = mac->GetTxBuffer();
+    buffer = mac->GetTxBuffer(wait);
     if (buffer != 0)
     {
         buffer->Packet += IP_HEADER_SIZE;
@@ -160,7 +204,8 @@ DataBuffer* ProtocolIPv4::GetTxBuffer(InterfaceMAC* mac)
 void ProtocolIPv4::Transmit(DataBuffer*    buffer,
                             uint8_t        protocol,
                             const uint8_t* targetIP,
-                            const uint8_t* sourceIP)
+                            const uint8_t* sourceIP,
+                            uint8_t        tos)
 {
     uint16_t       checksum;
     const uint8_t* targetMAC;
@@ -171,7 +216,7 @@ void ProtocolIPv4::Transmit(DataBuffer*    buffer,
     packet = buffer->Packet;
 
     packet[0] = 0x45; // Version and HeaderSize
-    packet[1] = 0;    // ToS
+    packet[1] = tos;  // ToS
     Pack16(packet, 2, buffer->Length);
 
     PacketID++;
@@ -188,6 +233,8 @@ void ProtocolIPv4::Transmit(DataBuffer*    buffer,
     checksum = FCS::Checksum(packet, 20);
     Pack16(packet, 10, checksum);
 
+    buffer->Flow = ClassifyFlow(tos, buffer->Flow);
+
     targetMAC = ARP.Protocol2Hardware(targetIP);
     if (targetMAC != 0)
     {
@@ -200,6 +247,96 @@ void ProtocolIPv4::Transmit(DataBuffer*    buffer,
     }
 }
 
+//============================================================================
+// Transmits up to TX_BATCH_SIZE buffers to one destination. The header is
+// built and summed once, each buffer only adds its length and packet ID.
+//============================================================================
+
+void ProtocolIPv4::TransmitBatch(DataBuffer**   buffers,
+                                 uint8_t        count,
+                                 uint8_t        protocol,
+                                 const uint8_t* targetIP,
+                                 const uint8_t* sourceIP,
+                                 uint8_t        tos)
+{
+    uint8_t        header[IP_HEADER_SIZE];
+    uint32_t       sum;
+    const uint8_t* targetMAC;
+    uint8_t*       packet;
+    DataBuffer*    buffer;
+    uint8_t        i;
+
+    header[0] = 0x45; // Version and HeaderSize
+    header[1] = tos;  // ToS
+    Pack16(header, 2, 0);
+    Pack16(header, 4, 0);
+    header[6] = 0;  // Flags & FragmentOffset
+    header[7] = 0;  // rest of FragmentOffset
+    header[8] = 32; // TTL
+    header[9] = protocol;
+    Pack16(header, 10, 0); // checksum placeholder
+    PackBytes(header, 12, sourceIP, 4);
+    PackBytes(header, 16, targetIP, 4);
+    sum = FCS::ChecksumAdd(header, IP_HEADER_SIZE, 0);
+
+    for (i = 0; i < count; i++)
+    {
+        buffer = buffers[i];
+        buffer->Packet -= IP_HEADER_SIZE;
+        buffer->Length += IP_HEADER_SIZE;
+        packet = buffer->Packet;
+
+        PackBytes(packet, 0, header, IP_HEADER_SIZE);
+        Pack16(packet, 2, buffer->Length);
+        PacketID++;
+        Pack16(packet, 4, PacketID);
+        Pack16(packet, 10, FCS::ChecksumComplete(FCS::ChecksumAdd(&packet[2], 4, sum)));
+        buffer->Flow = ClassifyFlow(tos, buffer->Flow);
+    }
+
+    targetMAC = ARP.Protocol2Hardware(targetIP);
+    if (targetMAC != 0)
+    {
+        MAC.TransmitBatch(buffers, count, targetMAC, 0x0800);
+    }
+    else
+    {
+        // Could not find MAC address, ARP for it
+        for (i = 0; i < count; i++)
+        {
+            UnresolvedQueue.Put(buffers[i]);
+        }
+    }
+}
+
+//============================================================================
+// Maps a packet's DSCP to the MAC transmit flow it queues in. Network
+// control classes and expedited forwarding go ahead of the round robin,
+// everything else shares it in the flow its sender picked, or the first
+// round robin flow if the sender left it on a priority queue.
+//============================================================================
+
+uint8_t ProtocolIPv4::ClassifyFlow(uint8_t tos, uint8_t flow)
+{
+    uint8_t dscp = tos >> IP_DSCP_SHIFT;
+    uint8_t rc   = flow;
+
+    if (dscp >= IP_DSCP_CS6)
+    {
+        rc = TX_FLOW_CONTROL;
+    }
+    else if (dscp == IP_DSCP_EF)
+    {
+        rc = TX_FLOW_EXPEDITED;
+    }
+    else if (flow < TX_FLOW_PRIORITY)
+    {
+        rc = TX_FLOW_PRIORITY;
+    }
+
+    return rc;
+}
+
 //============================================================================
 //
 //============================================================================
@@ -39,6 +39,30 @@
 
 #define IP_HEADER_SIZE (20)
 
+// ECN field, the low two bits of the ToS byte
+#define IP_ECN_MASK (0x03)
+#define IP_ECN_NOT_ECT (0x00)
+#define IP_ECN_ECT1 (0x01)
+#define IP_ECN_ECT0 (0x02)
+#define IP_ECN_CE (0x03)
+
+// DSCP, the high six bits of the ToS byte
+#define IP_DSCP_SHIFT (2)
+#define IP_DSCP_DEFAULT (0)
+#define IP_DSCP_AF41 (34)
+#define IP_DSCP_EF (46)  // Expedited forwarding
+#define IP_DSCP_CS6 (48) // Network control
+#define IP_DSCP_CS7 (56)
+// Marking of the stack's own control traffic: ICMP replies, DHCP and resets
+#define IP_DSCP_CONTROL (IP_DSCP_CS6)
+
+// Transmit flows the MAC serves ahead of the round robin
+#define TX_FLOW_CONTROL (0)
+#define TX_FLOW_EXPEDITED (1)
+#if TX_FLOW_PRIORITY != 2 || TX_FLOW_COUNT <= TX_FLOW_PRIORITY
+#error Tx flows must be the control and expedited queues plus at least one round robin flow
+#endif
+
 class ProtocolARP;
 class ProtocolICMP;
 class ProtocolTCP;
@@ -48,6 +72,7 @@ class ProtocolIPv4
 {
 private:
     friend class TCPConnection;
+    friend class ProtocolTCP;
     static const int ADDRESS_SIZE = 4;
 
 public:
@@ -68,8 +93,19 @@ public:
     void Initialize();
 
     void ProcessRx(DataBuffer*);
-
-    void Transmit(DataBuffer*, uint8_t protocol, const uint8_t* targetIP, const uint8_t* sourceIP);
+    bool Coalesce(DataBuffer* held, DataBuffer* buffer);
+
+    void Transmit(DataBuffer*,
+                  uint8_t        protocol,
+                  const uint8_t* targetIP,
+                  const uint8_t* sourceIP,
+                  uint8_t        tos = 0);
+    void TransmitBatch(DataBuffer**   buffers,
+                       uint8_t        count,
+                       uint8_t        protocol,
+                       const uint8_t* targetIP,
+                       const uint8_t* sourceIP,
+                       uint8_t        tos = 0);
     void Retransmit(DataBuffer*);
 
     void Retry();
@@ -81,14 +117,15 @@ public:
     const uint8_t* GetSubnetMask();
     void SetAddressInfo(const AddressInfo& info);
 
-    DataBuffer* GetTxBuffer(InterfaceMAC*);
+    DataBuffer* GetTxBuffer(InterfaceMAC*, bool wait = true);
     void        FreeTxBuffer(DataBuffer*);
     void        FreeRxBuffer(DataBuffer*);
 
     void Show(osPrintfInterface* out);
 
 private:
-    bool IsLocal(const uint8_t* addr);
+    bool           IsLocal(const uint8_t* addr);
+    static uint8_t ClassifyFlow(uint8_t tos, uint8_t flow);
 
     uint16_t PacketID;
     void*    TxBuffer[TX_BUFFER_COUNT];
@@ -35,6 +35,7 @@
 #include "ProtocolIPv4.hpp"
 #include "ProtocolMACEthernet.hpp"
 #include "Utility.hpp"
+#include "osTime.hpp"
 
 // Destination - 6 bytes
 // Source - 6 bytes
@@ -49,6 +50,14 @@ ProtocolMACEthernet::ProtocolMACEthernet(ProtocolARP& arp, ProtocolIPv4& ipv4)
     , RxBufferQueue("Rx", RX_BUFFER_COUNT, RxBufferBuffer)
     , QueueEmptyEvent("MACEthernet")
     , TxHandler(0)
+    , TxBatchHandler(0)
+    , TxFlowNext(TX_FLOW_PRIORITY)
+    , TxBacklog(0)
+    , TxRunning(false)
+    , TxHeld(false)
+    , TxLock("MAC tx")
+    , DriverLock("MAC driver")
+    , TimerEvent(0)
     , ARP(arp)
     , IPv4(ipv4)
 {
@@ -69,6 +78,13 @@ ProtocolMACEthernet::ProtocolMACEthernet(ProtocolARP& arp, ProtocolIPv4& ipv4)
     {
         RxBufferQueue.Put(&RxBuffer[i]);
     }
+    for (i = 0; i < TX_FLOW_COUNT; i++)
+    {
+        TxFlows[i].Head    = 0;
+        TxFlows[i].Tail    = 0;
+        TxFlows[i].Deficit = 0;
+        TxFlows[i].Frames  = 0;
+    }
 }
 
 //============================================================================
@@ -80,6 +96,17 @@ void ProtocolMACEthernet::RegisterDataTransmitHandler(DataTransmitHandler handle
     TxHandler = handler;
 }
 
+//============================================================================
+// Optional, drivers that can queue several frames at once register this and
+// get each batch in one call. Without it batches go frame by frame to the
+// DataTransmitHandler.
+//============================================================================
+
+void ProtocolMACEthernet::RegisterDataTransmitBatchHandler(DataTransmitBatchHandler handler)
+{
+    TxBatchHandler = handler;
+}
+
 //============================================================================
 //
 //============================================================================
@@ -93,9 +120,69 @@ bool ProtocolMACEthernet::IsLocalAddress(const uint8_t* addr)
 //
 //============================================================================
 
-void ProtocolMACEthernet::ProcessRx(uint8_t* buffer, int actualLength)
+void ProtocolMACEthernet::ProcessRx(uint8_t* buffer, int length)
+{
+    DataBuffer* packet;
+    uint16_t    type;
+
+    packet = ReceiveFrame(buffer, length, type);
+    if (packet != 0)
+    {
+        Dispatch(packet, type);
+    }
+}
+
+//============================================================================
+// Receives up to RX_BATCH_SIZE frames the driver read together. Each IP
+// frame is held until the next one arrives so consecutive TCP segments of a
+// flow can be coalesced into one before IP and TCP see them.
+//============================================================================
+
+void ProtocolMACEthernet::ProcessRxBatch(uint8_t** buffers, size_t* lengths, int count)
 {
+    DataBuffer* held     = 0;
+    uint16_t    heldType = 0;
+    DataBuffer* packet;
     uint16_t    type;
+    int         i;
+
+    for (i = 0; i < count; i++)
+    {
+        packet = ReceiveFrame(buffers[i], (int)lengths[i], type);
+        if (packet == 0)
+        {
+            // Not for us
+        }
+        else if (held != 0 && heldType == 0x0800 && type == 0x0800 &&
+                 IPv4.Coalesce(held, packet))
+        {
+            RxBufferQueue.Put(packet);
+        }
+        else
+        {
+            if (held != 0)
+            {
+                Dispatch(held, heldType);
+            }
+            held     = packet;
+            heldType = type;
+        }
+    }
+
+    if (held != 0)
+    {
+        Dispatch(held, heldType);
+    }
+}
+
+//============================================================================
+// Copies a frame into a receive buffer. Returns the buffer positioned after
+// the MAC header with the frame type in 'type', or 0 if the frame is not for
+// this interface or does not fit.
+//============================================================================
+
+DataBuffer* ProtocolMACEthernet::ReceiveFrame(uint8_t* buffer, int actualLength, uint16_t& type)
+{
     DataBuffer* packet = (DataBuffer*)RxBufferQueue.Get();
     int         i;
     int         length =
@@ -104,14 +191,14 @@ void ProtocolMACEthernet::ProcessRx(uint8_t* buffer, int actualLength)
     if (packet == 0)
     {
         printf("ProtocolMACEthernet::ProcessRx Out of receive buffers\n");
-        return;
+        return 0;
     }
 
     if (length > DATA_BUFFER_PAYLOAD_SIZE)
     {
         //printf( "ProtocolMACEthernet::ProcessRx Rx data overrun %d, %d\n", length, DATA_BUFFER_PAYLOAD_SIZE );
         RxBufferQueue.Put(packet);
-        return;
+        return 0;
     }
 
     packet->Initialize(this);
@@ -125,32 +212,38 @@ void ProtocolMACEthernet::ProcessRx(uint8_t* buffer, int actualLength)
     type = Unpack16(packet->Packet, 12);
 
     // Check if the MAC Address is destined for me
-    if (IsLocalAddress(packet->Packet))
+    if (!IsLocalAddress(packet->Packet) || actualLength > length)
     {
-        //DumpData( buffer, length, printf );
-        if (actualLength > length)
-        {
-            //printf( "ProtocolMACEthernet::ProcessRx Rx data overrun %d, %d\n", length, DATA_BUFFER_PAYLOAD_SIZE );
-            //printf( "Unicast type 0x%04X\n", type );
-            RxBufferQueue.Put(packet);
-            return;
-        }
-        // Unicast
-        packet->Packet += MAC_HEADER_SIZE;
-        packet->Length -= MAC_HEADER_SIZE;
+        //printf( "ProtocolMACEthernet::ProcessRx Rx data overrun %d, %d\n", length, DATA_BUFFER_PAYLOAD_SIZE );
+        RxBufferQueue.Put(packet);
+        return 0;
+    }
 
-        switch (type)
-        {
-        case 0x0800: // IP
-            IPv4.ProcessRx(packet);
-            break;
-        case 0x0806: // ARP
-            ARP.ProcessRx(packet);
-            break;
-        default:
-            //printf( "Unsupported Unicast type 0x%04X\n", type );
-            break;
-        }
+    //DumpData( buffer, length, printf );
+    packet->Packet += MAC_HEADER_SIZE;
+    packet->Length -= MAC_HEADER_SIZE;
+    packet->Remainder -= MAC_HEADER_SIZE;
+
+    return packet;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolMACEthernet::Dispatch(DataBuffer* packet, uint16_t type)
+{
+    switch (type)
+    {
+    case 0x0800: // IP
+        IPv4.ProcessRx(packet);
+        break;
+    case 0x0806: // ARP
+        ARP.ProcessRx(packet);
+        break;
+    default:
+        //printf( "Unsupported Unicast type 0x%04X\n", type );
+        break;
     }
 
     if (packet->Disposable)
@@ -163,11 +256,11 @@ void ProtocolMACEthernet::ProcessRx(uint8_t* buffer, int actualLength)
 //
 //============================================================================
 
-DataBuffer* ProtocolMACEthernet::GetTxBuffer()
+DataBuffer* ProtocolMACEthernet::GetTxBuffer(bool wait)
 {
     DataBuffer* buffer;
 
-    while ((buffer = (DataBuffer*)TxBufferQueue.Get()) == 0)
+    while ((buffer = (DataBuffer*)TxBufferQueue.Get()) == 0 && wait)
     {
         QueueEmptyEvent.Wait(__FILE__, __LINE__);
     }
@@ -222,15 +315,50 @@ void ProtocolMACEthernet::Transmit(DataBuffer* buffer, const uint8_t* targetMAC,
         buffer->Packet[buffer->Length++] = 0;
     }
 
-    if (TxHandler)
+    if (buffer->Disposable)
+    {
+        Enqueue(buffer);
+        RunScheduler();
+    }
+    else
     {
-        TxHandler(buffer->Packet, buffer->Length);
+        // The caller reuses the buffer as soon as this returns
+        SendOwned(buffer);
     }
+}
 
-    if (buffer->Disposable)
+//============================================================================
+// Transmits up to TX_BATCH_SIZE frames to one destination, the header is
+// built once and copied to each frame
+//============================================================================
+
+void ProtocolMACEthernet::TransmitBatch(DataBuffer**   buffers,
+                                        int            count,
+                                        const uint8_t* targetMAC,
+                                        uint16_t       type)
+{
+    uint8_t     header[MAC_HEADER_SIZE];
+    DataBuffer* buffer;
+    int         i;
+
+    PackBytes(header, 0, targetMAC, 6);
+    PackBytes(header, 6, UnicastAddress, 6);
+    Pack16(header, 12, type);
+
+    for (i = 0; i < count; i++)
     {
-        TxBufferQueue.Put(buffer);
+        buffer = buffers[i];
+        buffer->Packet -= MAC_HEADER_SIZE;
+        buffer->Length += MAC_HEADER_SIZE;
+        PackBytes(buffer->Packet, 0, header, MAC_HEADER_SIZE);
+        while (buffer->Length < 60)
+        {
+            buffer->Packet[buffer->Length++] = 0;
+        }
+        Enqueue(buffer);
     }
+
+    RunScheduler();
 }
 
 //============================================================================
@@ -239,14 +367,297 @@ void ProtocolMACEthernet::Transmit(DataBuffer* buffer, const uint8_t* targetMAC,
 
 void ProtocolMACEthernet::Retransmit(DataBuffer* buffer)
 {
-    if (TxHandler)
+    if (buffer->Disposable)
+    {
+        Enqueue(buffer);
+        RunScheduler();
+    }
+    else
     {
-        TxHandler(buffer->Packet, buffer->Length);
+        SendOwned(buffer);
     }
+}
 
-    if (buffer->Disposable)
+//============================================================================
+// Sends a frame the caller still owns without queueing it. It cannot wait
+// for the interface shaper, but is counted against it so queued frames make
+// up for it.
+//============================================================================
+
+void ProtocolMACEthernet::SendOwned(DataBuffer* buffer)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Shaper.Consume(buffer->Length, (uint32_t)osTime::GetTime());
+    TxLock.Give();
+    SendToDriver(&buffer, 1);
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolMACEthernet::Enqueue(DataBuffer* buffer)
+{
+    TxFlow* flow;
+
+    if (buffer->Flow >= TX_FLOW_COUNT)
     {
-        TxBufferQueue.Put(buffer);
+        buffer->Flow = 0;
+    }
+    flow         = &TxFlows[buffer->Flow];
+    buffer->Next = 0;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (flow->Head == 0)
+    {
+        flow->Head = buffer;
+    }
+    else
+    {
+        flow->Tail->Next = buffer;
+    }
+    flow->Tail = buffer;
+    if (buffer->Flow >= TX_FLOW_PRIORITY)
+    {
+        TxBacklog++;
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Picks the next frame to send, called with TxLock held. The priority flows
+// are served first and in order. Each round robin flow's turn adds
+// TX_FLOW_QUANTUM to its deficit and lasts while the deficit covers the frame
+// at its head, so a bulk flow sends about a quantum per round however many
+// frames it has queued. A flow whose head frame is over its shaper's rate
+// loses its turn, when the interface shaper is over its rate nothing goes.
+// Returns 0 when nothing may be sent now.
+//============================================================================
+
+DataBuffer* ProtocolMACEthernet::Dequeue(uint32_t time_us)
+{
+    TxFlow*     flow = 0;
+    DataBuffer* rc   = 0;
+    DataBuffer* head;
+    int         visits;
+    int         i;
+
+    for (i = 0; rc == 0 && i < TX_FLOW_PRIORITY; i++)
+    {
+        flow = &TxFlows[i];
+        head = flow->Head;
+        if (head != 0 && (head->Shaper == 0 || head->Shaper->Conforms(head->Length, time_us)))
+        {
+            rc = head;
+        }
+    }
+
+    // Every flow able to send has had a quantum within two rounds
+    for (visits = 0; rc == 0 && TxBacklog > 0 && visits < 2 * TX_FLOW_COUNT; visits++)
+    {
+        flow = &TxFlows[TxFlowNext];
+        head = flow->Head;
+        if (head != 0 && flow->Deficit >= head->Length &&
+            (head->Shaper == 0 || head->Shaper->Conforms(head->Length, time_us)))
+        {
+            rc = head;
+        }
+        else
+        {
+            TxFlowNext = (TxFlowNext + 1 < TX_FLOW_COUNT ? TxFlowNext + 1 : TX_FLOW_PRIORITY);
+            head       = TxFlows[TxFlowNext].Head;
+            if (head != 0 && TxFlows[TxFlowNext].Deficit < head->Length)
+            {
+                // A flow held back by its shaper gains no more credit
+                TxFlows[TxFlowNext].Deficit += TX_FLOW_QUANTUM;
+            }
+        }
+    }
+
+    if (rc != 0 && !Shaper.Conforms(rc->Length, time_us))
+    {
+        rc = 0;
+    }
+
+    if (rc != 0)
+    {
+        flow->Head = rc->Next;
+        if (flow >= &TxFlows[TX_FLOW_PRIORITY])
+        {
+            flow->Deficit -= rc->Length;
+            TxBacklog--;
+        }
+        if (flow->Head == 0)
+        {
+            // An idle flow keeps no credit for later
+            flow->Tail    = 0;
+            flow->Deficit = 0;
+        }
+        flow->Frames++;
+        Shaper.Consume(rc->Length, time_us);
+        if (rc->Shaper != 0)
+        {
+            rc->Shaper->Consume(rc->Length, time_us);
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// Hands queued frames to the driver, up to TX_BATCH_SIZE per call, until the
+// queues are empty or the rest is held back by shapers. If another thread is
+// already doing so it sends the frames just queued as well.
+//============================================================================
+
+void ProtocolMACEthernet::RunScheduler()
+{
+    DataBuffer* batch[TX_BATCH_SIZE];
+    int         count;
+    bool        wake = false;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (!TxRunning)
+    {
+        TxRunning = true;
+        while (1)
+        {
+            count = 0;
+            while (count < TX_BATCH_SIZE &&
+                   (batch[count] = Dequeue((uint32_t)osTime::GetTime())) != 0)
+            {
+                count++;
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            TxLock.Give();
+            SendToDriver(batch, count);
+            TxLock.Take(__FILE__, __LINE__);
+        }
+        TxRunning = false;
+        wake      = !TxHeld;
+        TxHeld    = TxBacklog > 0;
+        for (int i = 0; i < TX_FLOW_PRIORITY; i++)
+        {
+            TxHeld = TxHeld || TxFlows[i].Head != 0;
+        }
+        wake = wake && TxHeld;
+    }
+    TxLock.Give();
+
+    if (wake && TimerEvent != 0)
+    {
+        // Frames started waiting on a shaper, have the timer thread work
+        // out when to call Tick
+        TimerEvent->Notify();
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolMACEthernet::Tick()
+{
+    RunScheduler();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolMACEthernet::SetShaper(uint32_t rate, uint32_t burst)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Shaper.Configure(rate, burst);
+    TxLock.Give();
+    RunScheduler();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolMACEthernet::SetTimerEvent(osEvent* event)
+{
+    TimerEvent = event;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint32_t ProtocolMACEthernet::GetReleaseDelay()
+{
+    uint32_t    time_us = (uint32_t)osTime::GetTime();
+    uint32_t    rc      = 0;
+    uint32_t    delay;
+    uint32_t    frameDelay;
+    DataBuffer* head;
+    int         i;
+
+    TxLock.Take(__FILE__, __LINE__);
+    for (i = 0; i < TX_FLOW_COUNT; i++)
+    {
+        head = TxFlows[i].Head;
+        if (head != 0)
+        {
+            delay = Shaper.Delay(head->Length, time_us);
+            if (head->Shaper != 0)
+            {
+                frameDelay = head->Shaper->Delay(head->Length, time_us);
+                delay      = (frameDelay > delay ? frameDelay : delay);
+            }
+            if (delay != 0 && (rc == 0 || delay < rc))
+            {
+                rc = delay;
+            }
+        }
+    }
+    TxLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+// Hands frames to the driver. The scheduler and callers sending frames they
+// still own both come here, DriverLock keeps the driver to one at a time.
+//============================================================================
+
+void ProtocolMACEthernet::SendToDriver(DataBuffer** buffers, int count)
+{
+    void*  data[TX_BATCH_SIZE];
+    size_t length[TX_BATCH_SIZE];
+    int    i;
+
+    for (i = 0; i < count; i++)
+    {
+        data[i]   = buffers[i]->Packet;
+        length[i] = buffers[i]->Length;
+    }
+
+    DriverLock.Take(__FILE__, __LINE__);
+    if (TxBatchHandler)
+    {
+        TxBatchHandler(data, length, count);
+    }
+    else if (TxHandler)
+    {
+        for (i = 0; i < count; i++)
+        {
+            TxHandler(data[i], length[i]);
+        }
+    }
+    DriverLock.Give();
+
+    for (i = 0; i < count; i++)
+    {
+        if (buffers[i]->Disposable)
+        {
+            FreeTxBuffer(buffers[i]);
+        }
     }
 }
 
@@ -295,6 +706,12 @@ void ProtocolMACEthernet::Show(osPrintfInterface* out)
     out->Printf("MAC Configuration\n");
     out->Printf("   Ethernet Unicast MAC Address: %s\n", macaddrtoa(GetUnicastAddress()));
     out->Printf("   Ethernet Broadcast MAC Address: %s\n", macaddrtoa(GetBroadcastAddress()));
+    out->Printf("   Transmit flows:");
+    for (int i = 0; i < TX_FLOW_COUNT; i++)
+    {
+        out->Printf(" %u", TxFlows[i].Frames);
+    }
+    out->Printf(" frames\n");
 }
 
 //============================================================================
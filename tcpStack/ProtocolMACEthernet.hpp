@@ -36,7 +36,9 @@
 #include "DataBuffer.hpp"
 #include "InterfaceMAC.hpp"
 #include "osEvent.hpp"
+#include "osMutex.hpp"
 #include "osQueue.hpp"
+#include "TokenBucket.hpp"
 
 #define MAC_HEADER_SIZE (14)
 
@@ -48,13 +50,31 @@ class ProtocolMACEthernet : public InterfaceMAC
 public:
     ProtocolMACEthernet(ProtocolARP&, ProtocolIPv4&);
     void RegisterDataTransmitHandler(DataTransmitHandler);
+    void RegisterDataTransmitBatchHandler(DataTransmitBatchHandler);
 
     void ProcessRx(uint8_t* buffer, int length);
+    void ProcessRxBatch(uint8_t** buffers, size_t* lengths, int count);
 
     void Transmit(DataBuffer*, const uint8_t* targetMAC, uint16_t type);
+    void TransmitBatch(DataBuffer**, int count, const uint8_t* targetMAC, uint16_t type);
     void Retransmit(DataBuffer* buffer);
 
-    DataBuffer* GetTxBuffer();
+    /// SetShaper caps the rate of everything the interface sends, in bytes
+    /// per second with bursts of up to 'burst' bytes. A rate of 0 removes
+    /// the cap. Frames over the rate wait in the transmit queues and Tick
+    /// sends them when the bucket allows. Frames the sender still owns, such
+    /// as ARP requests, go out at once but are counted, so the queued frames
+    /// after them wait longer.
+    void SetShaper(uint32_t rate, uint32_t burst);
+    /// SetTimerEvent gives the event the stack's timer thread waits on, it is
+    /// notified when frames are held back so the wait can be shortened
+    void SetTimerEvent(osEvent*);
+    /// GetReleaseDelay returns the microseconds until a held back frame may
+    /// go, 0 if none is held
+    uint32_t GetReleaseDelay();
+    void     Tick();
+
+    DataBuffer* GetTxBuffer(bool wait = true);
     void        FreeTxBuffer(DataBuffer*);
     void        FreeRxBuffer(DataBuffer*);
 
@@ -84,11 +104,43 @@ private:
     void* TxBufferBuffer[TX_BUFFER_COUNT];
     void* RxBufferBuffer[RX_BUFFER_COUNT];
 
-    DataTransmitHandler TxHandler;
-    ProtocolARP&        ARP;
-    ProtocolIPv4&       IPv4;
-
-    bool IsLocalAddress(const uint8_t* addr);
+    DataTransmitHandler      TxHandler;
+    DataTransmitBatchHandler TxBatchHandler;
+
+    // Transmit scheduler. Frames wait in a queue per flow, the first
+    // TX_FLOW_PRIORITY flows go in strict priority order and the others share
+    // the driver by deficit round robin. One thread at a time hands frames to
+    // the driver, the others queue theirs and return. Frames the caller still
+    // owns skip the queues, DriverLock keeps them from entering the driver
+    // alongside a batch.
+    struct TxFlow
+    {
+        DataBuffer* Head;
+        DataBuffer* Tail;
+        int32_t     Deficit; // Bytes the flow may still send this turn
+        uint32_t    Frames;
+    };
+    TxFlow      TxFlows[TX_FLOW_COUNT];
+    uint8_t     TxFlowNext; // Round robin flow whose turn it is
+    uint16_t    TxBacklog;  // Frames queued in the round robin flows
+    bool        TxRunning;  // A thread is handing frames to the driver
+    bool        TxHeld;     // Shapers held frames back when the queues were last run
+    osMutex     TxLock;
+    osMutex     DriverLock;
+    TokenBucket Shaper;
+    osEvent*    TimerEvent;
+
+    void        Enqueue(DataBuffer*);
+    DataBuffer* Dequeue(uint32_t time_us);
+    void        RunScheduler();
+    void        SendOwned(DataBuffer*);
+    void        SendToDriver(DataBuffer** buffers, int count);
+    ProtocolARP&             ARP;
+    ProtocolIPv4&            IPv4;
+
+    bool        IsLocalAddress(const uint8_t* addr);
+    DataBuffer* ReceiveFrame(uint8_t* buffer, int length, uint16_t& type);
+    void        Dispatch(DataBuffer*, uint16_t type);
 
     ProtocolMACEthernet(ProtocolMACEthernet&);
     ProtocolMACEthernet();
@@ -40,6 +40,7 @@
 #include "ProtocolTCP.hpp"
 #include "Utility.hpp"
 #include "osMutex.hpp"
+#include "osRandom.hpp"
 #include "osTime.hpp"
 
 //============================================================================
@@ -47,236 +48,174 @@
 //============================================================================
 
 ProtocolTCP::ProtocolTCP(ProtocolIPv4& ip)
-    : IP(ip)
+    : TimerHead(0)
+    , TimerTail(0)
+    , TimerLock("TCP timers")
+    , TimerEvent("TCP timers")
+    , LastTick_us(0)
+    , FastAckProfile()
+    , FastDataProfile()
+    , SlowPathProfile()
+    , ConnectionLock("TCP connections")
+    , FreeBuffers(0)
+    , RxPageLock("TCP rx pages")
+    , FreeRxPageCount(0)
+    , RxPagesReclaimed(0)
+    , Evictions(0)
+    , IP(ip)
 {
+    uint64_t seed;
+
     for (int i = 0; i < TCP_MAX_CONNECTIONS; i++)
     {
         ConnectionList[i].Initialize(ip, *this);
     }
+    for (int i = 0; i < TCP_BUFFER_COUNT; i++)
+    {
+        BufferList[i].Next = FreeBuffers;
+        FreeBuffers        = &BufferList[i];
+    }
+    for (int i = 0; i < TCP_RX_PAGE_COUNT; i++)
+    {
+        FreeRxPages[FreeRxPageCount++] = RxPageList[i];
+    }
+
+    // Fast open cookies and initial sequence numbers must be unguessable to
+    // other hosts. Cookies issued before a restart are refused and clients
+    // fall back to a normal handshake.
+    if (!osRandom::GetBytes(FastOpenKey, sizeof(FastOpenKey)) ||
+        !osRandom::GetBytes(SequenceKey, sizeof(SequenceKey)))
+    {
+        printf("No random source, TCP keys derived from the clock\n");
+        seed = osTime::GetTime();
+        Pack32(FastOpenKey, 0, (uint32_t)seed);
+        Pack32(FastOpenKey, 4, (uint32_t)(seed >> 32));
+        seed = osTime::GetCycleCount();
+        Pack32(FastOpenKey, 8, (uint32_t)seed);
+        Pack32(FastOpenKey, 12, (uint32_t)(seed >> 32));
+        seed = SipHash(FastOpenKey, FastOpenKey, sizeof(FastOpenKey));
+        Pack32(SequenceKey, 0, (uint32_t)seed);
+        Pack32(SequenceKey, 4, (uint32_t)(seed >> 32));
+        seed = SipHash(FastOpenKey, SequenceKey, 8);
+        Pack32(SequenceKey, 8, (uint32_t)seed);
+        Pack32(SequenceKey, 12, (uint32_t)(seed >> 32));
+    }
+    for (int i = 0; i < TCP_FAST_OPEN_CACHE_SIZE; i++)
+    {
+        FastOpenCache[i].Valid = false;
+    }
+    FastOpenNext = 0;
 }
 
 //============================================================================
 //
 //============================================================================
 
-void ProtocolTCP::ProcessRx(DataBuffer* rxBuffer, const uint8_t* sourceIP, const uint8_t* targetIP)
+void ProtocolTCP::ProcessRx(DataBuffer*    rxBuffer,
+                            const uint8_t* sourceIP,
+                            const uint8_t* targetIP,
+                            uint8_t        ecn)
 {
     TCPConnection* connection;
     uint16_t       checksum;
     uint16_t       localPort;
     uint16_t       remotePort;
     uint8_t        headerLength;
-    uint8_t*       data;
+    uint8_t*       options;
+    uint8_t        optionLength;
     uint16_t       dataLength;
-    int            count;
-    DataBuffer*    buffer;
-    uint8_t        flags  = 0;
     uint8_t*       packet = rxBuffer->Packet;
     uint16_t       length = rxBuffer->Length;
     uint16_t       remoteWindowSize;
     uint32_t       time_us;
+    uint64_t       startCycles;
+    RxProfile*     profile;
+    RxSegment      segment;
 
     uint32_t SequenceNumber;
     uint32_t AcknowledgementNumber;
 
-    checksum = ComputeChecksum(packet, length, sourceIP, targetIP);
+    checksum = (rxBuffer->ChecksumValid ? 0 : ComputeChecksum(packet, length, sourceIP, targetIP));
 
     if (checksum == 0)
     {
         // pass
+        startCycles           = osTime::GetCycleCount();
         remotePort            = Unpack16(packet, 0);
         localPort             = Unpack16(packet, 2);
         SequenceNumber        = Unpack32(packet, 4);
         AcknowledgementNumber = Unpack32(packet, 8);
         headerLength          = (Unpack8(packet, 12) >> 4) * 4;
         remoteWindowSize      = Unpack16(packet, 14);
+        options               = packet + TCP_HEADER_SIZE;
+        optionLength          = headerLength > TCP_HEADER_SIZE ? headerLength - TCP_HEADER_SIZE : 0;
 
         rxBuffer->Packet += headerLength;
         rxBuffer->Length -= headerLength;
+        dataLength = rxBuffer->Length;
 
         connection = LocateConnection(remotePort, sourceIP, localPort);
         if (connection == 0)
         {
             // No connection found
             printf("Connection port %d not found\n", localPort);
+            return;
+        }
+
+        time_us = (uint32_t)osTime::GetTime();
+        profile = &SlowPathProfile;
+        connection->Stats.SegmentsIn += rxBuffer->Segments;
+        connection->Stats.BytesIn += dataLength;
+        connection->LastReceive_us = time_us;
+
+        // Header prediction, the common ESTABLISHED cases skip the state machine
+        if (TCP_HEADER_PREDICTION && connection->State == TCPConnection::ESTABLISHED &&
+            optionLength == 0 && ecn != IP_ECN_CE && (packet[13] & ~FLAG_PSH) == FLAG_ACK &&
+            SequenceNumber == connection->AcknowledgementNumber &&
+            connection->OutOfOrderStart == connection->OutOfOrderEnd &&
+            ProcessRxFast(connection,
+                          rxBuffer,
+                          AcknowledgementNumber,
+                          remoteWindowSize,
+                          (packet[13] & FLAG_PSH) != 0,
+                          time_us))
+        {
+            profile = dataLength == 0 ? &FastAckProfile : &FastDataProfile;
         }
         else
         {
-            // Existing connection, process the state machine
-            switch (connection->State)
+            segment.Buffer          = rxBuffer;
+            segment.SourceIP        = sourceIP;
+            segment.LocalPort       = localPort;
+            segment.RemotePort      = remotePort;
+            segment.Sequence        = SequenceNumber;
+            segment.Acknowledgement = AcknowledgementNumber;
+            segment.Window          = remoteWindowSize;
+            segment.Flags           = packet[13];
+            segment.Ecn             = ecn;
+            segment.Options         = options;
+            segment.OptionLength    = optionLength;
+            segment.Time_us         = time_us;
+            segment.ReceiveNext     = connection->AcknowledgementNumber;
+
+            if ((segment.Flags & FLAG_RST) && connection->State >= TCPConnection::ESTABLISHED &&
+                connection->State != TCPConnection::TIMED_WAIT)
             {
-            case TCPConnection::CLOSED:
-                // Do nothing
-                Reset(rxBuffer->MAC, localPort, remotePort, sourceIP);
-                break;
-            case TCPConnection::LISTEN:
-                if (SYN)
-                {
-                    // Need a closed connection to work with
-                    TCPConnection* tmp = NewClient(rxBuffer->MAC, sourceIP, remotePort, localPort);
-                    if (tmp != 0)
-                    {
-                        tmp->Parent                       = connection;
-                        connection                        = tmp;
-                        connection->State                 = TCPConnection::SYN_RECEIVED;
-                        connection->AcknowledgementNumber = SequenceNumber;
-                        connection->LastAck               = connection->AcknowledgementNumber;
-                        connection->AcknowledgementNumber++; // SYN flag consumes a sequence number
-                        connection->SendFlags(FLAG_SYN | FLAG_ACK);
-                        connection->SequenceNumber++; // Our SYN costs too
-                    }
-                    else
-                    {
-                        printf("Failed to get connection for SYN\n");
-                    }
-                }
-                break;
-            case TCPConnection::SYN_SENT:
-                if (SYN)
-                {
-                    connection->AcknowledgementNumber = SequenceNumber;
-                    connection->LastAck               = connection->AcknowledgementNumber;
-                    if (ACK)
-                    {
-                        connection->State = TCPConnection::ESTABLISHED;
-                        connection->SendFlags(FLAG_ACK);
-                    }
-                    else
-                    {
-                        // Simultaneous open
-                        connection->State = TCPConnection::SYN_RECEIVED;
-                        connection->AcknowledgementNumber++; // SYN flag consumes a sequence number
-                        connection->SendFlags(FLAG_SYN | FLAG_ACK);
-                    }
-                }
-                break;
-            case TCPConnection::SYN_RECEIVED:
-                if (ACK)
-                {
-                    connection->State = TCPConnection::ESTABLISHED;
-
-                    if (connection->Parent->NewConnection == 0)
-                    {
-                        connection->MaxSequenceTx = AcknowledgementNumber + remoteWindowSize;
-                        connection->Parent->NewConnection = connection;
-                        connection->Parent->Event.Notify();
-                    }
-                }
-                break;
-            case TCPConnection::ESTABLISHED:
-                if (FIN)
-                {
-                    connection->State = TCPConnection::CLOSE_WAIT;
-                    connection->AcknowledgementNumber++; // FIN consumes sequence number
-                    connection->SendFlags(FLAG_ACK);
-                }
-                break;
-            case TCPConnection::FIN_WAIT_1:
-                if (FIN)
-                {
-                    if (ACK)
-                    {
-                        connection->State = TCPConnection::TIMED_WAIT;
-                        // Start TimedWait timer
-                    }
-                    else
-                    {
-                        connection->State = TCPConnection::CLOSING;
-                    }
-                    connection->AcknowledgementNumber++; // FIN consumes sequence number
-                    connection->SendFlags(FLAG_ACK);
-                }
-                else if (ACK)
-                {
-                    connection->State = TCPConnection::FIN_WAIT_2;
-                }
-                break;
-            case TCPConnection::FIN_WAIT_2:
-                if (FIN)
-                {
-                    connection->State = TCPConnection::TIMED_WAIT;
-                    // Start TimedWait timer
-                    connection->AcknowledgementNumber++; // FIN consumes sequence number
-                    connection->Time_us = (int32_t)osTime::GetTime();
-                    connection->SendFlags(FLAG_ACK);
-                }
-                break;
-            case TCPConnection::CLOSE_WAIT: break;
-            case TCPConnection::CLOSING: break;
-            case TCPConnection::LAST_ACK:
-                if (ACK)
-                {
-                    connection->State = TCPConnection::CLOSED;
-                }
-                break;
-            case TCPConnection::TIMED_WAIT: break;
-            default: break;
+                ReceiveReset(connection, segment);
             }
-
-            // Handle any data received
-            if (connection && connection->State == TCPConnection::ESTABLISHED ||
-                connection->State == TCPConnection::FIN_WAIT_1 ||
-                connection->State == TCPConnection::FIN_WAIT_2 ||
-                connection->State == TCPConnection::CLOSE_WAIT)
+            else
             {
-                data       = rxBuffer->Packet;
-                dataLength = rxBuffer->Length;
-
-                connection->MaxSequenceTx = AcknowledgementNumber + remoteWindowSize;
-                connection->Event.Notify();
-
-                // Handle any ACKed data
-                if (ACK)
-                {
-                    connection->HoldingQueueLock.Take(__FILE__, __LINE__);
-                    count   = connection->HoldingQueue.GetCount();
-                    time_us = (uint32_t)osTime::GetTime();
-                    for (int i = 0; i < count; i++)
-                    {
-                        buffer = (DataBuffer*)connection->HoldingQueue.Get();
-                        if ((int32_t)(AcknowledgementNumber - buffer->AcknowledgementNumber) >= 0)
-                        {
-                            connection->CalculateRTT((int32_t)(time_us - buffer->Time_us));
-                            IP.FreeTxBuffer(buffer);
-                        }
-                        else
-                        {
-                            connection->HoldingQueue.Put(buffer);
-                        }
-                    }
-                    connection->HoldingQueueLock.Give();
-                }
-
-                if (FIN)
-                {
-                    if (connection->State == TCPConnection::FIN_WAIT_1)
-                    {
-                        flags |= FLAG_ACK;
-                        connection->State = TCPConnection::CLOSE_WAIT;
-                    }
-                    else if (connection->State == TCPConnection::ESTABLISHED)
-                    {
-                        connection->State = TCPConnection::CLOSE_WAIT;
-                        flags |= FLAG_ACK;
-                    }
-                }
-
-                // ACK the receipt of the data
-                if (dataLength > 0)
+                // Existing connection, process the state machine
+                connection = (this->*StateTable[connection->State].Handler)(connection, segment);
+                if (StateTable[connection->State].ReceivesData)
                 {
-                    // Copy it to the application
-                    rxBuffer->Disposable = false;
-                    connection->StoreRxData(rxBuffer);
-                    IP.FreeRxBuffer(rxBuffer);
-                    connection->Event.Notify();
-                }
-
-                if (flags != 0)
-                {
-                    connection->SendFlags(flags);
+                    ReceiveData(connection, segment);
                 }
             }
         }
+
+        profile->Segments++;
+        profile->Cycles += osTime::GetCycleCount() - startCycles;
     }
     else
     {
@@ -285,244 +224,1351 @@ void ProtocolTCP::ProcessRx(DataBuffer* rxBuffer, const uint8_t* sourceIP, const
 }
 
 //============================================================================
-//
+// Van Jacobson header prediction. The caller has checked the connection is
+// ESTABLISHED, only ACK (and maybe PSH) is set and the segment is the next one
+// expected. Handles a pure ACK of outstanding data or in order data that
+// acknowledges nothing new, returns false for anything else.
 //============================================================================
 
-void ProtocolTCP::Reset(InterfaceMAC*  mac,
-                        uint16_t       localPort,
-                        uint16_t       remotePort,
-                        const uint8_t* remoteAddress)
+bool ProtocolTCP::ProcessRxFast(TCPConnection* connection,
+                                DataBuffer*    rxBuffer,
+                                uint32_t       acknowledgementNumber,
+                                uint16_t       remoteWindowSize,
+                                bool           push,
+                                uint32_t       time_us)
 {
-    uint8_t* packet;
-    uint16_t checksum;
-    uint16_t length;
-
-    DataBuffer* buffer = IP.GetTxBuffer(mac);
+    bool rc = false;
 
-    if (buffer == 0)
+    if (rxBuffer->Length == 0)
     {
-        return;
+        if ((int32_t)(acknowledgementNumber - connection->UnacknowledgedSequence) > 0 &&
+            (int32_t)(acknowledgementNumber - connection->SequenceNumber) <= 0)
+        {
+            connection->UpdateSendWindow(acknowledgementNumber, remoteWindowSize);
+            connection->AcknowledgeData(acknowledgementNumber, 0, 0, time_us);
+            connection->Output();
+            rc = true;
+        }
+    }
+    else if (acknowledgementNumber == connection->UnacknowledgedSequence &&
+             rxBuffer->Length <= connection->CurrentWindow)
+    {
+        connection->UpdateSendWindow(acknowledgementNumber, remoteWindowSize);
+        rxBuffer->Disposable = false;
+        connection->StoreRxData(rxBuffer, push);
+        connection->ReceivedSegment(time_us, rxBuffer->Segments);
+        IP.FreeRxBuffer(rxBuffer);
+        connection->RxEvent.Notify();
+        if (connection->AckRequired())
+        {
+            connection->SendFlags(FLAG_ACK);
+        }
+        connection->Output(); // The peer window may have opened
+        rc = true;
     }
 
-    buffer->Packet += TCP_HEADER_SIZE;
-    buffer->Remainder -= TCP_HEADER_SIZE;
+    return rc;
+}
 
-    buffer->Packet -= TCP_HEADER_SIZE;
-    packet = buffer->Packet;
-    length = buffer->Length;
-    if (packet != 0)
-    {
-        Pack16(packet, 0, localPort);
-        Pack16(packet, 2, remotePort);
-        Pack32(packet, 4, 0);    // Sequence
-        Pack32(packet, 8, 0);    // AckSequence
-        Pack8(packet, 12, 0x50); // Header length and reserved
-        Pack8(packet, 13, FLAG_RST);
-        Pack16(packet, 14, 0); // window size
-        Pack16(packet, 16, 0); // clear checksum
-        Pack16(packet, 18, 0); // 2 bytes of UrgentPointer
+//============================================================================
+// Segment handling for each connection state. A handler makes the state
+// transition for the segment and returns the connection it now belongs to,
+// the states marked ReceivesData then take its acknowledgement and data.
+//============================================================================
 
-        checksum = ProtocolTCP::ComputeChecksum(
-            packet, TCP_HEADER_SIZE, IP.GetUnicastAddress(), remoteAddress);
+const ProtocolTCP::StateEntry ProtocolTCP::StateTable[TCPConnection::TTCP_PERSIST + 1] = {
+    {&ProtocolTCP::RxClosed, false},      // CLOSED
+    {&ProtocolTCP::RxListen, false},      // LISTEN
+    {&ProtocolTCP::RxSynSent, false},     // SYN_SENT
+    {&ProtocolTCP::RxSynReceived, false}, // SYN_RECEIVED
+    {&ProtocolTCP::RxIgnore, true},       // ESTABLISHED
+    {&ProtocolTCP::RxFinWait1, true},     // FIN_WAIT_1
+    {&ProtocolTCP::RxIgnore, true},       // FIN_WAIT_2
+    {&ProtocolTCP::RxIgnore, true},       // CLOSE_WAIT
+    {&ProtocolTCP::RxClosing, false},     // CLOSING
+    {&ProtocolTCP::RxLastAck, false},     // LAST_ACK
+    {&ProtocolTCP::RxIgnore, false},      // TIMED_WAIT
+    {&ProtocolTCP::RxIgnore, false},      // TTCP_PERSIST
+};
 
-        Pack16(packet, 16, checksum); // checksum
+//============================================================================
+//
+//============================================================================
 
-        buffer->Length += TCP_HEADER_SIZE;
-        buffer->Remainder -= buffer->Length;
+TCPConnection* ProtocolTCP::RxIgnore(TCPConnection* connection, RxSegment&)
+{
+    return connection;
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::RxClosed(TCPConnection* connection, RxSegment& segment)
+{
+    Reset(segment);
+    return connection;
+}
 
-        IP.Transmit(buffer, 0x06, remoteAddress, IP.GetUnicastAddress());
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::RxListen(TCPConnection* connection, RxSegment& segment)
+{
+    TCPConnection* tmp;
+    DataBuffer*    rxBuffer = segment.Buffer;
+    bool           handOver = false;
+
+    if (segment.Flags & FLAG_SYN)
+    {
+        // Need a closed connection to work with
+        tmp = NewClient(rxBuffer->MAC, segment.SourceIP, segment.RemotePort, segment.LocalPort);
+        if (tmp != 0)
+        {
+            tmp->CopyOptions(*connection);
+            tmp->StartKeepAlive();
+            tmp->ReceiveSynOptions(segment.Flags, segment.Options, segment.OptionLength);
+            tmp->Parent                       = connection;
+            connection                        = tmp;
+            connection->State                 = TCPConnection::SYN_RECEIVED;
+            connection->AcknowledgementNumber = segment.Sequence;
+            connection->LastAck               = connection->AcknowledgementNumber;
+            connection->AcknowledgementNumber++; // SYN flag consumes a sequence number
+            if (ReceiveFastOpen(connection, segment.Options, segment.OptionLength) &&
+                rxBuffer->Length > 0 && connection->Parent->NewConnection == 0)
+            {
+                // Valid cookie, take the data on the SYN and hand the
+                // connection over without waiting for the handshake
+                rxBuffer->Disposable = false;
+                if (connection->StoreRxData(rxBuffer, (segment.Flags & FLAG_PSH) != 0))
+                {
+                    connection->UpdateSendWindow(connection->SequenceNumber + 1, segment.Window);
+                    handOver = true;
+                }
+                IP.FreeRxBuffer(rxBuffer);
+            }
+
+            // The SYN takes the initial sequence number before the
+            // application may write anything
+            connection->SendFlags(FLAG_SYN | FLAG_ACK);
+            if (handOver)
+            {
+                HandOver(connection);
+            }
+        }
+        else
+        {
+            printf("Failed to get connection for SYN\n");
+        }
     }
+
+    return connection;
 }
 
 //============================================================================
 //
 //============================================================================
 
-uint16_t ProtocolTCP::ComputeChecksum(uint8_t*       packet,
-                                      uint16_t       length,
-                                      const uint8_t* sourceIP,
-                                      const uint8_t* targetIP)
+TCPConnection* ProtocolTCP::RxSynSent(TCPConnection* connection, RxSegment& segment)
 {
-    uint32_t checksum;
-    uint16_t tmp;
+    bool acceptable = (segment.Flags & FLAG_ACK) != 0 &&
+                      (int32_t)(segment.Acknowledgement - connection->UnacknowledgedSequence) > 0 &&
+                      (int32_t)(segment.Acknowledgement - connection->SequenceNumber) <= 0;
 
-    // A whole lot o' hokum just to compute the checksum
-    checksum = FCS::ChecksumAdd(sourceIP, 4, 0);
-    checksum = FCS::ChecksumAdd(targetIP, 4, checksum);
-    checksum += 0x06; // protocol
-    checksum += length;
-    if ((length & 0x0001) != 0)
+    if (connection->SequenceNumber == connection->UnacknowledgedSequence)
     {
-        // length is odd
-        tmp            = length + 1;
-        packet[length] = 0;
+        // Reserved by NewClient, Connect has not sent the SYN yet
     }
-    else
+    else if ((segment.Flags & FLAG_ACK) && !acceptable)
     {
-        tmp = length;
+        // Not an answer to our SYN, an old duplicate perhaps (RFC 793 p.66)
+        Reset(segment);
+    }
+    else if (segment.Flags & FLAG_RST)
+    {
+        // Connection refused, wakes Connect. A RST without an ACK may not
+        // be from the peer, it is dropped.
+        if (acceptable)
+        {
+            connection->Terminate();
+        }
+    }
+    else if (segment.Flags & FLAG_SYN)
+    {
+        // Either way the peer is there now
+        connection->StartKeepAlive();
+        connection->ReceiveSynOptions(segment.Flags, segment.Options, segment.OptionLength);
+        connection->AcknowledgementNumber = segment.Sequence;
+        connection->LastAck               = connection->AcknowledgementNumber;
+        if (segment.Flags & FLAG_ACK)
+        {
+            connection->ReceiveSynAck(
+                segment.Acknowledgement, segment.Options, segment.OptionLength);
+            connection->State = TCPConnection::ESTABLISHED;
+            connection->AcknowledgementNumber++; // SYN flag consumes a sequence number
+            connection->SendFlags(FLAG_ACK);
+        }
+        else
+        {
+            // Simultaneous open
+            connection->State = TCPConnection::SYN_RECEIVED;
+            connection->AcknowledgementNumber++; // SYN flag consumes a sequence number
+            connection->SendFlags(FLAG_SYN | FLAG_ACK);
+        }
     }
-    checksum = FCS::ChecksumAdd(packet, tmp, checksum);
 
-    return FCS::ChecksumComplete(checksum);
+    return connection;
 }
 
 //============================================================================
 //
 //============================================================================
 
-TCPConnection* ProtocolTCP::LocateConnection(uint16_t       remotePort,
-                                             const uint8_t* remoteAddress,
-                                             uint16_t       localPort)
+TCPConnection* ProtocolTCP::RxSynReceived(TCPConnection* connection, RxSegment& segment)
 {
-    int i;
-
-    // Must do two passes:
-    // First pass to look for established connections
-    // Second pass to look for listening connections
-
-    // Pass 1
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    if (segment.Flags & FLAG_RST)
     {
-        //printf( "%s %d: connection port %d, state %s\n", FindFileName( __FILE__ ), __LINE__, ConnectionList[ i ].LocalPort, ConnectionList[ i ].GetStateString() );
-        if (ConnectionList[i].LocalPort == localPort &&
-            ConnectionList[i].RemotePort == remotePort &&
-            AddressCompare(ConnectionList[i].RemoteAddress, remoteAddress, IP.AddressSize()))
+        // The peer gave up on the handshake. A passive open goes back to
+        // listening, which for the connection cloned from the listener means
+        // closing it, an active one fails Connect.
+        if (segment.Sequence == connection->AcknowledgementNumber)
         {
-            return &ConnectionList[i];
+            connection->Terminate();
         }
     }
-
-    // Pass 2
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    else if ((segment.Flags & FLAG_ACK) &&
+             ((int32_t)(segment.Acknowledgement - connection->UnacknowledgedSequence) <= 0 ||
+              (int32_t)(segment.Acknowledgement - connection->SequenceNumber) > 0))
     {
-        if (ConnectionList[i].LocalPort == localPort &&
-            ConnectionList[i].State == TCPConnection::LISTEN)
+        // Does not acknowledge our SYN (RFC 793 p.72)
+        Reset(segment);
+    }
+    else if (segment.Flags & FLAG_ACK)
+    {
+        connection->UpdateSendWindow(segment.Acknowledgement, segment.Window);
+        connection->State = TCPConnection::ESTABLISHED;
+
+        // Fast open connections were handed over on the SYN
+        if (connection->Parent != 0)
         {
-            return &ConnectionList[i];
+            HandOver(connection);
         }
     }
 
-    return 0;
+    return connection;
 }
 
 //============================================================================
-//
+// The peer's FIN is taken in ReceiveData, after any data before it
 //============================================================================
 
-uint16_t ProtocolTCP::NewPort()
+TCPConnection* ProtocolTCP::RxFinWait1(TCPConnection* connection, RxSegment& segment)
 {
-    int i;
+    if ((segment.Flags & FLAG_ACK) && connection->FinAcknowledged(segment.Acknowledgement))
+    {
+        connection->State = TCPConnection::FIN_WAIT_2;
+    }
 
-    if (NextPort <= 1024)
+    return connection;
+}
+
+//============================================================================
+// Both sides sent a FIN at once, waiting for the peer to ACK ours
+//============================================================================
+
+TCPConnection* ProtocolTCP::RxClosing(TCPConnection* connection, RxSegment& segment)
+{
+    if ((segment.Flags & FLAG_ACK) && connection->FinAcknowledged(segment.Acknowledgement))
     {
-        NextPort = 1024;
+        connection->State   = TCPConnection::TIMED_WAIT;
+        connection->Time_us = segment.Time_us;
     }
 
-    NextPort++;
+    return connection;
+}
 
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::RxLastAck(TCPConnection* connection, RxSegment& segment)
+{
+    if (segment.Flags & FLAG_ACK)
     {
-        if (ConnectionList[i].LocalPort == NextPort)
+        connection->AcknowledgeData(
+            segment.Acknowledgement, segment.Options, segment.OptionLength, segment.Time_us);
+        if (connection->FinAcknowledged(segment.Acknowledgement))
         {
-            NextPort++;
-            i = -1;
+            connection->State = TCPConnection::CLOSED;
+        }
+        else
+        {
+            // Data written before Close is still going out
+            connection->Output();
         }
     }
 
-    return NextPort;
+    return connection;
 }
 
 //============================================================================
-//
+// A RST on a synchronized connection only counts when it carries the next
+// sequence expected, one elsewhere in the window is answered with an ACK so
+// a genuine peer resends it at that sequence (RFC 5961 3.2). This keeps a
+// blind attacker from resetting the connection with a guessed sequence.
 //============================================================================
 
-TCPConnection* ProtocolTCP::NewClient(InterfaceMAC*  mac,
-                                      const uint8_t* remoteAddress,
-                                      uint16_t       remotePort,
-                                      uint16_t       localPort)
+void ProtocolTCP::ReceiveReset(TCPConnection* connection, RxSegment& segment)
 {
-    int i;
-    int j;
+    uint32_t offset = segment.Sequence - connection->AcknowledgementNumber;
 
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    if (offset == 0)
     {
-        TCPConnection& connection = ConnectionList[i];
-        if (connection.State == TCPConnection::CLOSED)
+        connection->Terminate();
+    }
+    else if (offset < connection->CurrentWindow)
+    {
+        connection->SendFlags(FLAG_ACK);
+    }
+}
+
+//============================================================================
+// Acknowledgement, ECN and data of a segment on a synchronized connection
+//============================================================================
+
+void ProtocolTCP::ReceiveData(TCPConnection* connection, RxSegment& segment)
+{
+    DataBuffer* rxBuffer   = segment.Buffer;
+    uint16_t    length     = rxBuffer->Length;
+    uint8_t     flags      = 0;
+    bool        holeFilled = false;
+
+    connection->RxEvent.Notify();
+
+    // Handle any ACKed data
+    if (segment.Flags & FLAG_ACK)
+    {
+        connection->UpdateSendWindow(segment.Acknowledgement, segment.Window);
+        connection->AcknowledgeData(
+            segment.Acknowledgement, segment.Options, segment.OptionLength, segment.Time_us);
+        if ((segment.Flags & (FLAG_ECE | FLAG_SYN)) == FLAG_ECE)
+        {
+            connection->EcnEcho();
+        }
+        connection->Output();
+    }
+
+    if (connection->ReceiveEcn(segment.Flags, segment.Ecn))
+    {
+        // First CE mark, echo it without waiting for a delayed ACK
+        flags |= FLAG_ACK;
+    }
+
+    // ACK the receipt of the data
+    if (length > 0)
+    {
+        if (segment.Sequence != segment.ReceiveNext)
         {
-            connection.LocalPort      = localPort;
-            connection.SequenceNumber = 1;
-            connection.MaxSequenceTx  = connection.SequenceNumber + 1024;
-            for (j = 0; j < IP.AddressSize(); j++)
+            // Duplicate or out of order, ACK now so the sender
+            // learns what we expect next. Data past a hole is held
+            // until the hole is filled.
+            flags |= FLAG_ACK;
+            connection->Stats.OutOfOrder++;
+            connection->StoreOutOfOrder(rxBuffer, segment.Sequence);
+        }
+        else
+        {
+            // Copy it to the application, filling a hole is ACKed at once
+            holeFilled           = connection->OutOfOrderStart != connection->OutOfOrderEnd;
+            rxBuffer->Disposable = false;
+            if (connection->StoreRxData(rxBuffer, (segment.Flags & (FLAG_PSH | FLAG_FIN)) != 0))
+            {
+                connection->ReceivedSegment(segment.Time_us, rxBuffer->Segments);
+                if ((segment.Flags & FLAG_FIN) || holeFilled || connection->AckRequired())
+                {
+                    flags |= FLAG_ACK;
+                }
+            }
+            else
             {
-                connection.RemoteAddress[j] = remoteAddress[j];
+                flags |= FLAG_ACK;
             }
-            connection.RemotePort = remotePort;
-            connection.MAC        = mac;
+            IP.FreeRxBuffer(rxBuffer);
+            connection->RxEvent.Notify();
+        }
+    }
 
-            return &connection;
+    if (segment.Flags & FLAG_FIN)
+    {
+        // The FIN follows the segment's data, it counts once everything up
+        // to it is in. The same ACK covers the data and the FIN.
+        if (segment.Sequence + length == connection->AcknowledgementNumber)
+        {
+            ReceiveFin(connection, segment.Time_us);
         }
+        flags |= FLAG_ACK;
     }
 
-    return 0;
+    if (flags != 0)
+    {
+        connection->SendFlags(flags);
+    }
 }
 
 //============================================================================
-//
+// Consumes the peer's FIN and moves to the state that follows it
 //============================================================================
 
-TCPConnection* ProtocolTCP::NewServer(InterfaceMAC* mac, uint16_t port)
+void ProtocolTCP::ReceiveFin(TCPConnection* connection, uint32_t time_us)
 {
-    int i;
-
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    connection->AcknowledgementNumber++; // FIN consumes sequence number
+    switch (connection->State)
     {
-        TCPConnection& connection = ConnectionList[i];
-        if (connection.State == TCPConnection::CLOSED)
-        {
-            connection.State     = TCPConnection::LISTEN;
-            connection.LocalPort = port;
-            connection.MAC       = mac;
-            return &connection;
-        }
+    case TCPConnection::ESTABLISHED: connection->State = TCPConnection::CLOSE_WAIT; break;
+    case TCPConnection::FIN_WAIT_1:
+        // Our FIN is not acknowledged yet, RxFinWait1 took any ACK of it
+        connection->State = TCPConnection::CLOSING;
+        break;
+    case TCPConnection::FIN_WAIT_2:
+        connection->State   = TCPConnection::TIMED_WAIT;
+        connection->Time_us = time_us;
+        break;
+    default: break;
     }
-
-    return 0;
+    connection->RxEvent.Notify();
 }
 
 //============================================================================
-//
+// Receive coalescing. 'segment' continues 'held' when both are segments of
+// the same flow carrying data with only ACK set, or ACK and PSH on the later
+// one, the later starts where the held one ends and both acknowledge the same
+// data with the same window. Either both have no options or both have only
+// the usual NOP, NOP, timestamp layout with the later timestamp not older,
+// the merged segment keeps the later timestamp. PSH ends a run. The merged
+// segment must fit the held buffer, with DATA_BUFFER_PAYLOAD_SIZE buffers
+// that leaves out full sized segments. Checksums are checked here since the
+// merged segment's no longer matches, 'verified' says the held segment was
+// checked before.
 //============================================================================
 
-void ProtocolTCP::Tick()
+uint16_t ProtocolTCP::Coalesce(uint8_t*       held,
+                               uint16_t       heldLength,
+                               uint16_t       room,
+                               bool           verified,
+                               const uint8_t* segment,
+                               uint16_t       length,
+                               const uint8_t* sourceIP,
+                               const uint8_t* targetIP)
 {
-    int i;
+    uint8_t  headerLength = (segment[12] >> 4) * 4;
+    uint16_t dataLength   = length - headerLength;
+    uint16_t rc           = 0;
+    uint16_t i;
+    bool     options = false;
 
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    if (headerLength == TCP_HEADER_SIZE + TCP_TIMESTAMP_OPTIONS_SIZE &&
+        length >= TCP_HEADER_SIZE + TCP_TIMESTAMP_OPTIONS_SIZE &&
+        heldLength >= TCP_HEADER_SIZE + TCP_TIMESTAMP_OPTIONS_SIZE)
+    {
+        // Aligned timestamps, the later one may not go backwards
+        options = Unpack32(segment, TCP_HEADER_SIZE) == Unpack32(held, TCP_HEADER_SIZE) &&
+                  segment[TCP_HEADER_SIZE] == TCP_OPTION_NOP &&
+                  segment[TCP_HEADER_SIZE + 1] == TCP_OPTION_NOP &&
+                  segment[TCP_HEADER_SIZE + 2] == TCP_OPTION_TIMESTAMP &&
+                  segment[TCP_HEADER_SIZE + 3] == 10 &&
+                  (int32_t)(Unpack32(segment, TCP_HEADER_SIZE + 4) -
+                            Unpack32(held, TCP_HEADER_SIZE + 4)) >= 0;
+    }
+
+    if ((headerLength == TCP_HEADER_SIZE || options) && heldLength > headerLength &&
+        length > headerLength && dataLength <= room && (held[12] & 0xF0) == (segment[12] & 0xF0) &&
+        held[13] == FLAG_ACK && (segment[13] & ~FLAG_PSH) == FLAG_ACK &&
+        Unpack32(segment, 0) == Unpack32(held, 0) &&
+        Unpack32(segment, 4) == Unpack32(held, 4) + heldLength - headerLength &&
+        Unpack32(segment, 8) == Unpack32(held, 8) && Unpack16(segment, 14) == Unpack16(held, 14) &&
+        (verified || ComputeChecksum(held, heldLength, sourceIP, targetIP) == 0) &&
+        ComputeChecksum((uint8_t*)segment, length, sourceIP, targetIP) == 0)
     {
-        if (ConnectionList[i].State == TCPConnection::ESTABLISHED ||
-            ConnectionList[i].State == TCPConnection::TIMED_WAIT)
+        for (i = 0; i < dataLength; i++)
+        {
+            held[heldLength + i] = segment[headerLength + i];
+        }
+        for (i = TCP_HEADER_SIZE; i < headerLength; i++)
         {
-            ConnectionList[i].Tick();
+            held[i] = segment[i];
         }
+        held[13] |= segment[13] & FLAG_PSH;
+        rc = dataLength;
     }
+
+    return rc;
 }
 
 //============================================================================
-//
+// Answers a segment that belongs to no connection, or one whose ACK does not
+// fit the connection, with a RST the peer will accept (RFC 793 p.36). A RST
+// takes the sequence of the segment's ACK, without an ACK it acknowledges
+// the segment instead. RSTs are never answered.
 //============================================================================
 
-void ProtocolTCP::Show(osPrintfInterface* out)
+void ProtocolTCP::Reset(const RxSegment& segment)
 {
-    out->Printf("TCP Information\n");
-    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    uint8_t*    packet;
+    uint16_t    checksum;
+    uint32_t    sequence        = 0;
+    uint32_t    acknowledgement = 0;
+    uint8_t     flags           = FLAG_RST;
+    DataBuffer* buffer;
+
+    if (segment.Flags & FLAG_RST)
     {
-        out->Printf("connection %s   ", ConnectionList[i].GetStateString());
-        switch (ConnectionList[i].State)
-        {
-        case TCPConnection::LISTEN:
-            out->Printf("     local=%d  ", ConnectionList[i].LocalPort);
-            break;
-        case TCPConnection::ESTABLISHED:
+        return;
+    }
+    if (segment.Flags & FLAG_ACK)
+    {
+        sequence = segment.Acknowledgement;
+    }
+    else
+    {
+        // SYN and FIN take a sequence number each
+        acknowledgement = segment.Sequence + segment.Buffer->Length;
+        acknowledgement += (segment.Flags & FLAG_SYN) ? 1 : 0;
+        acknowledgement += (segment.Flags & FLAG_FIN) ? 1 : 0;
+        flags |= FLAG_ACK;
+    }
+
+    buffer = IP.GetTxBuffer(segment.Buffer->MAC);
+    if (buffer == 0)
+    {
+        return;
+    }
+
+    packet = buffer->Packet;
+    if (packet != 0)
+    {
+        Pack16(packet, 0, segment.LocalPort);
+        Pack16(packet, 2, segment.RemotePort);
+        Pack32(packet, 4, sequence);
+        Pack32(packet, 8, acknowledgement);
+        Pack8(packet, 12, 0x50); // Header length and reserved
+        Pack8(packet, 13, flags);
+        Pack16(packet, 14, 0); // window size
+        Pack16(packet, 16, 0); // clear checksum
+        Pack16(packet, 18, 0); // 2 bytes of UrgentPointer
+
+        checksum = ProtocolTCP::ComputeChecksum(
+            packet, TCP_HEADER_SIZE, IP.GetUnicastAddress(), segment.SourceIP);
+
+        Pack16(packet, 16, checksum); // checksum
+
+        buffer->Length += TCP_HEADER_SIZE;
+        buffer->Remainder -= buffer->Length;
+
+        IP.Transmit(buffer,
+                    0x06,
+                    segment.SourceIP,
+                    IP.GetUnicastAddress(),
+                    IP_DSCP_CONTROL << IP_DSCP_SHIFT);
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint16_t ProtocolTCP::ComputeChecksum(uint8_t*       packet,
+                                      uint16_t       length,
+                                      const uint8_t* sourceIP,
+                                      const uint8_t* targetIP)
+{
+    uint32_t checksum;
+    uint16_t tmp;
+
+    // A whole lot o' hokum just to compute the checksum
+    checksum = FCS::ChecksumAdd(sourceIP, 4, 0);
+    checksum = FCS::ChecksumAdd(targetIP, 4, checksum);
+    checksum += 0x06; // protocol
+    checksum += length;
+    if ((length & 0x0001) != 0)
+    {
+        // length is odd
+        tmp            = length + 1;
+        packet[length] = 0;
+    }
+    else
+    {
+        tmp = length;
+    }
+    checksum = FCS::ChecksumAdd(packet, tmp, checksum);
+
+    return FCS::ChecksumComplete(checksum);
+}
+
+//============================================================================
+// Server side of a fast open SYN. Returns true if the SYN carries a valid
+// cookie for the client. A client that asked for a cookie, or sent one that
+// is no longer valid, is given the current one on the SYN-ACK.
+//============================================================================
+
+bool ProtocolTCP::ReceiveFastOpen(TCPConnection* connection, const uint8_t* options, uint8_t length)
+{
+    const uint8_t* option;
+    uint8_t        cookie[TCP_FAST_OPEN_COOKIE_SIZE];
+    bool           rc = false;
+
+    if (connection->FastOpenEnabled)
+    {
+        option = FindOption(options, length, TCP_OPTION_FAST_OPEN);
+        if (option != 0)
+        {
+            MakeFastOpenCookie(connection->RemoteAddress, cookie);
+            if (option[1] == 2 + TCP_FAST_OPEN_COOKIE_SIZE &&
+                AddressCompare(option + 2, cookie, TCP_FAST_OPEN_COOKIE_SIZE))
+            {
+                rc = true;
+            }
+            else
+            {
+                connection->FastOpenOption       = true;
+                connection->FastOpenCookieLength = TCP_FAST_OPEN_COOKIE_SIZE;
+                PackBytes(connection->FastOpenCookie, 0, cookie, TCP_FAST_OPEN_COOKIE_SIZE);
+            }
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// A client's cookie is a keyed hash of its address
+//============================================================================
+
+void ProtocolTCP::MakeFastOpenCookie(const uint8_t* address, uint8_t* cookie)
+{
+    uint64_t digest = SipHash(FastOpenKey, address, IP.AddressSize());
+
+    for (int i = 0; i < TCP_FAST_OPEN_COOKIE_SIZE; i++)
+    {
+        cookie[i] = (uint8_t)(digest >> (8 * i));
+    }
+}
+
+//============================================================================
+// RFC 6528 initial sequence number, a 4 us clock plus a keyed hash of the
+// connection's addresses and ports. A new connection between the same ports
+// starts past the old one's sequence numbers, and other hosts cannot tell
+// where a connection they do not see starts.
+//============================================================================
+
+uint32_t ProtocolTCP::InitialSequence(uint16_t       localPort,
+                                      const uint8_t* remoteAddress,
+                                      uint16_t       remotePort)
+{
+    uint8_t tuple[2 * ProtocolIPv4::ADDRESS_SIZE + 4];
+    size_t  offset = 0;
+
+    offset = PackBytes(tuple, offset, IP.GetUnicastAddress(), IP.AddressSize());
+    offset = Pack16(tuple, offset, localPort);
+    offset = PackBytes(tuple, offset, remoteAddress, IP.AddressSize());
+    offset = Pack16(tuple, offset, remotePort);
+
+    return (uint32_t)(osTime::GetTime() / 4) + (uint32_t)SipHash(SequenceKey, tuple, offset);
+}
+
+//============================================================================
+// Client cookie cache, returns false if there is no cookie for the server
+//============================================================================
+
+bool ProtocolTCP::FindFastOpenCookie(const uint8_t* address, uint8_t* cookie)
+{
+    bool rc = false;
+
+    for (int i = 0; i < TCP_FAST_OPEN_CACHE_SIZE && !rc; i++)
+    {
+        FastOpenEntry& entry = FastOpenCache[i];
+        if (entry.Valid && AddressCompare(entry.Address, address, IP.AddressSize()))
+        {
+            PackBytes(cookie, 0, entry.Cookie, TCP_FAST_OPEN_COOKIE_SIZE);
+            rc = true;
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// Stores the cookie a server gave, replacing the oldest entry when the cache
+// is full. A cookie of 0 forgets the server's cookie.
+//============================================================================
+
+void ProtocolTCP::SaveFastOpenCookie(const uint8_t* address, const uint8_t* cookie)
+{
+    FastOpenEntry* entry = 0;
+
+    for (int i = 0; i < TCP_FAST_OPEN_CACHE_SIZE && entry == 0; i++)
+    {
+        if (FastOpenCache[i].Valid &&
+            AddressCompare(FastOpenCache[i].Address, address, IP.AddressSize()))
+        {
+            entry = &FastOpenCache[i];
+        }
+    }
+    if (entry == 0 && cookie != 0)
+    {
+        entry        = &FastOpenCache[FastOpenNext];
+        FastOpenNext = (FastOpenNext + 1) % TCP_FAST_OPEN_CACHE_SIZE;
+        PackBytes(entry->Address, 0, address, IP.AddressSize());
+    }
+
+    if (entry != 0)
+    {
+        entry->Valid = (cookie != 0);
+        if (cookie != 0)
+        {
+            PackBytes(entry->Cookie, 0, cookie, TCP_FAST_OPEN_COOKIE_SIZE);
+        }
+    }
+}
+
+//============================================================================
+// Returns the option of the given kind from a TCP header's options, or 0 if
+// it is not there or the options are malformed
+//============================================================================
+
+const uint8_t* ProtocolTCP::FindOption(const uint8_t* options, uint8_t length, uint8_t kind)
+{
+    const uint8_t* rc   = 0;
+    uint8_t        i    = 0;
+    bool           done = false;
+
+    while (!done && i < length)
+    {
+        if (options[i] == TCP_OPTION_END)
+        {
+            done = true;
+        }
+        else if (options[i] == TCP_OPTION_NOP)
+        {
+            i++;
+        }
+        else if (i + 1 >= length || options[i + 1] < 2 || i + options[i + 1] > length)
+        {
+            done = true;
+        }
+        else if (options[i] == kind)
+        {
+            rc   = &options[i];
+            done = true;
+        }
+        else
+        {
+            i += options[i + 1];
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::LocateConnection(uint16_t       remotePort,
+                                             const uint8_t* remoteAddress,
+                                             uint16_t       localPort)
+{
+    TCPConnection* listeners[TCP_MAX_CONNECTIONS];
+    int            count = 0;
+    int            first;
+    uint32_t       hash;
+    int            i;
+    size_t         j;
+
+    // Must do two passes:
+    // First pass to look for established connections
+    // Second pass to look for listening connections
+
+    // Pass 1
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        //printf( "%s %d: connection port %d, state %s\n", FindFileName( __FILE__ ), __LINE__, ConnectionList[ i ].LocalPort, ConnectionList[ i ].GetStateString() );
+        if (ConnectionList[i].LocalPort == localPort &&
+            ConnectionList[i].RemotePort == remotePort &&
+            AddressCompare(ConnectionList[i].RemoteAddress, remoteAddress, IP.AddressSize()))
+        {
+            return &ConnectionList[i];
+        }
+    }
+
+    // Pass 2
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        if (ConnectionList[i].LocalPort == localPort &&
+            ConnectionList[i].State == TCPConnection::LISTEN)
+        {
+            listeners[count++] = &ConnectionList[i];
+        }
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // Listeners sharing a port split new connections by a hash of the remote
+    // address and port. One still holding a connection its thread has not
+    // accepted is passed over while another is free.
+    hash = remotePort;
+    for (j = 0; j < IP.AddressSize(); j++)
+    {
+        hash = hash * 31 + remoteAddress[j];
+    }
+    first = hash % count;
+    for (i = 0; i < count; i++)
+    {
+        if (listeners[(first + i) % count]->NewConnection == 0)
+        {
+            return listeners[(first + i) % count];
+        }
+    }
+
+    return listeners[first];
+}
+
+//============================================================================
+// Gives a new connection to its listener. While the listener still holds one
+// its thread has not taken, the connection keeps Parent set and Accept hands
+// it over later.
+//============================================================================
+
+void ProtocolTCP::HandOver(TCPConnection* connection)
+{
+    TCPConnection* listener;
+
+    ConnectionLock.Take(__FILE__, __LINE__);
+    listener = connection->Parent;
+    if (listener != 0 && listener->NewConnection == 0)
+    {
+        listener->NewConnection = connection;
+        connection->Parent      = 0;
+        listener->RxEvent.Notify();
+    }
+    ConnectionLock.Give();
+}
+
+//============================================================================
+// Takes the listener's new connection, if any, and hands over the next one
+// that finished its handshake while the listener was busy
+//============================================================================
+
+TCPConnection* ProtocolTCP::Accept(TCPConnection* listener)
+{
+    TCPConnection* rc;
+    int            i;
+
+    ConnectionLock.Take(__FILE__, __LINE__);
+    rc                      = listener->NewConnection;
+    listener->NewConnection = 0;
+    for (i = 0; i < TCP_MAX_CONNECTIONS && listener->NewConnection == 0; i++)
+    {
+        TCPConnection& connection = ConnectionList[i];
+        if (connection.Parent == listener && (connection.State == TCPConnection::ESTABLISHED ||
+                                              connection.State == TCPConnection::CLOSE_WAIT))
+        {
+            listener->NewConnection = &connection;
+            connection.Parent       = 0;
+        }
+    }
+    ConnectionLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint16_t ProtocolTCP::NewPort()
+{
+    int i;
+
+    if (NextPort <= 1024)
+    {
+        NextPort = 1024;
+    }
+
+    NextPort++;
+
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        if (ConnectionList[i].LocalPort == NextPort)
+        {
+            NextPort++;
+            i = -1;
+        }
+    }
+
+    return NextPort;
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::NewClient(InterfaceMAC*  mac,
+                                      const uint8_t* remoteAddress,
+                                      uint16_t       remotePort,
+                                      uint16_t       localPort)
+{
+    TCPConnection*          connection = 0;
+    TCPConnection::Buffers* buffers;
+    int                     i;
+    int                     j;
+
+    ConnectionLock.Take(__FILE__, __LINE__);
+    for (i = 0; i < TCP_MAX_CONNECTIONS && connection == 0; i++)
+    {
+        if (ConnectionList[i].State == TCPConnection::CLOSED)
+        {
+            connection = &ConnectionList[i];
+        }
+    }
+    if (connection == 0)
+    {
+        connection = EvictConnection();
+    }
+    if (connection != 0 && connection->Storage != 0)
+    {
+        // Start over with one receive page, not what the slot's last
+        // connection grew to or left unread
+        connection->AttachBuffers(connection->DetachBuffers());
+    }
+    else if (connection != 0)
+    {
+        buffers = GetBuffers();
+        if (buffers != 0)
+        {
+            connection->AttachBuffers(buffers);
+        }
+        else
+        {
+            printf("No buffers for a new connection\n");
+            connection = 0;
+        }
+    }
+
+    if (connection != 0)
+    {
+        connection->SetDefaultOptions();
+        connection->UnackedSegments = 0;
+        connection->LocalPort       = localPort;
+        for (j = 0; j < IP.AddressSize(); j++)
+        {
+            connection->RemoteAddress[j] = remoteAddress[j];
+        }
+        connection->RemotePort     = remotePort;
+        connection->MAC            = mac;
+        connection->LastReceive_us = (uint32_t)osTime::GetTime(); // Idle age for eviction
+        connection->Parent         = 0;
+        connection->InitializeTx(InitialSequence(localPort, remoteAddress, remotePort));
+        connection->MaxSequenceTx = connection->SequenceNumber + 1024;
+
+        // No longer CLOSED, so nothing else claims the slot or its buffers
+        // before the caller makes it SYN_RECEIVED or Connect sends the SYN
+        connection->State = TCPConnection::SYN_SENT;
+    }
+    ConnectionLock.Give();
+
+    return connection;
+}
+
+//============================================================================
+// Takes a buffer set from the pool. When the pool is empty one is taken back
+// from a connection that no longer carries data, TIMED_WAIT first, then
+// CLOSED. Returns 0 if every set is in use. Called with ConnectionLock held.
+//============================================================================
+
+TCPConnection::Buffers* ProtocolTCP::GetBuffers()
+{
+    TCPConnection::Buffers* rc    = FreeBuffers;
+    TCPConnection*          owner = 0;
+    int                     i;
+
+    if (rc != 0)
+    {
+        FreeBuffers = rc->Next;
+    }
+    else
+    {
+        for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        {
+            TCPConnection& connection = ConnectionList[i];
+            if (connection.Storage != 0 &&
+                (connection.State == TCPConnection::TIMED_WAIT ||
+                 (connection.State == TCPConnection::CLOSED && owner == 0)))
+            {
+                owner = &connection;
+            }
+        }
+        if (owner != 0)
+        {
+            rc = owner->DetachBuffers();
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// Takes a page for a growing receive buffer. When the pool is empty the
+// pages of the largest empty receive buffer whose connection has received
+// nothing for TCP_RX_RECLAIM_IDLE_US are taken back first. Returns 0 if no
+// page is to be had. The caller holds no TxLock. The scan only picks a
+// candidate, ReleaseRxPages checks it again under the owner's TxLock.
+//============================================================================
+
+uint8_t* ProtocolTCP::GetRxPage(TCPConnection* requester, uint32_t time_us)
+{
+    TCPConnection* owner    = 0;
+    uint8_t*       rc       = 0;
+    uint16_t       released = 0;
+    int            i;
+
+    if (FreeRxPageCount == 0)
+    {
+        for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        {
+            TCPConnection& connection = ConnectionList[i];
+            if (&connection != requester && connection.Storage != 0 &&
+                connection.RxBufferEmpty && connection.RxSize > TCP_RX_WINDOW_SIZE &&
+                time_us - connection.LastReceive_us >= TCP_RX_RECLAIM_IDLE_US &&
+                (owner == 0 || connection.RxSize > owner->RxSize))
+            {
+                owner = &connection;
+            }
+        }
+        if (owner != 0)
+        {
+            released = owner->ReleaseRxPages();
+        }
+    }
+
+    RxPageLock.Take(__FILE__, __LINE__);
+    RxPagesReclaimed += released;
+    if (FreeRxPageCount > 0)
+    {
+        rc = FreeRxPages[--FreeRxPageCount];
+    }
+    RxPageLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::FreeRxPage(uint8_t* page)
+{
+    RxPageLock.Take(__FILE__, __LINE__);
+    FreeRxPages[FreeRxPageCount++] = page;
+    RxPageLock.Give();
+}
+
+//============================================================================
+// Frees a slot when the connection table is full. Only slots no application
+// holds a pointer to are taken, TIMED_WAIT first, then those the application
+// closed that wait on the peer to finish closing, then connections not yet
+// handed to a listener. Within a class the one idle longest goes. Returns the
+// freed connection, now CLOSED, or 0 if nothing may be evicted. Called with
+// ConnectionLock held.
+//============================================================================
+
+TCPConnection* ProtocolTCP::EvictConnection()
+{
+    TCPConnection* victim     = 0;
+    int            victimRank = 0;
+    uint32_t       victimIdle = 0;
+    uint32_t       time_us    = (uint32_t)osTime::GetTime();
+    uint32_t       idle;
+    int            rank;
+    int            i;
+
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        TCPConnection& connection = ConnectionList[i];
+        idle                      = time_us - connection.LastReceive_us;
+        switch (connection.State)
+        {
+        case TCPConnection::TIMED_WAIT: rank = 1; break;
+        case TCPConnection::FIN_WAIT_2:
+        case TCPConnection::CLOSING:
+        case TCPConnection::LAST_ACK: rank = 2; break;
+        default:
+            // Half open connections and those waiting for their listener to
+            // take them, no application has seen them yet
+            rank = (connection.Parent != 0 ? 3 : 0);
+            break;
+        }
+        if (rank != 0 &&
+            (victim == 0 || rank < victimRank || (rank == victimRank && idle > victimIdle)))
+        {
+            victim     = &connection;
+            victimRank = rank;
+            victimIdle = idle;
+        }
+    }
+
+    if (victim != 0)
+    {
+        printf("Connection table full, evicting %s connection\n", victim->GetStateString());
+        if (victim->State == TCPConnection::TIMED_WAIT)
+        {
+            victim->TxLock.Take(__FILE__, __LINE__);
+            victim->State = TCPConnection::CLOSED;
+            victim->StopTimers();
+            victim->TxLock.Give();
+        }
+        else
+        {
+            // The peer may still be there, reset it and wake the application
+            victim->Abort();
+        }
+        Evictions++;
+    }
+
+    return victim;
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* ProtocolTCP::NewServer(InterfaceMAC* mac, uint16_t port)
+{
+    TCPConnection::Buffers* buffers;
+    TCPConnection*          rc = 0;
+    int                     i;
+
+    ConnectionLock.Take(__FILE__, __LINE__);
+    for (i = 0; i < TCP_MAX_CONNECTIONS && rc == 0; i++)
+    {
+        TCPConnection& connection = ConnectionList[i];
+        if (connection.State == TCPConnection::CLOSED)
+        {
+            // Listeners never carry data
+            buffers = connection.DetachBuffers();
+            if (buffers != 0)
+            {
+                buffers->Next = FreeBuffers;
+                FreeBuffers   = buffers;
+            }
+            connection.SetDefaultOptions();
+            connection.State         = TCPConnection::LISTEN;
+            connection.LocalPort     = port;
+            connection.MAC           = mac;
+            connection.Parent        = 0;
+            connection.NewConnection = 0;
+            connection.InitializeTx(1);
+            rc = &connection;
+        }
+    }
+    ConnectionLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::Tick()
+{
+    int      i;
+    uint32_t currentTime_us = (uint32_t)osTime::GetTime();
+
+    ProcessTimers(currentTime_us);
+
+    if (currentTime_us - LastTick_us >= TCP_TICK_INTERVAL_US)
+    {
+        LastTick_us = currentTime_us;
+        for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        {
+            if (ConnectionList[i].State != TCPConnection::CLOSED &&
+                ConnectionList[i].State != TCPConnection::LISTEN)
+            {
+                ConnectionList[i].Tick();
+            }
+        }
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::WaitForTimer(uint32_t limit_us)
+{
+    uint32_t currentTime_us = (uint32_t)osTime::GetTime();
+    int32_t  wait_us        = TCP_TICK_INTERVAL_US - (currentTime_us - LastTick_us);
+
+    if (limit_us != 0 && (int32_t)limit_us < wait_us)
+    {
+        wait_us = limit_us;
+    }
+
+    TimerLock.Take(__FILE__, __LINE__);
+    if (TimerHead != 0 && (int32_t)(TimerHead->Expire_us - currentTime_us) < wait_us)
+    {
+        wait_us = TimerHead->Expire_us - currentTime_us;
+    }
+    TimerLock.Give();
+
+    if (wait_us > 0)
+    {
+        // Woken early when a timer is started ahead of the current head
+        TimerEvent.Wait(__FILE__, __LINE__, (wait_us + 999) / 1000);
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+osEvent* ProtocolTCP::GetTimerEvent()
+{
+    return &TimerEvent;
+}
+
+//============================================================================
+// Timers are usually started later than those already running so the
+// insertion point is searched from the tail
+//============================================================================
+
+void ProtocolTCP::StartTimer(TCPConnection::Timer& timer, uint32_t expire_us)
+{
+    TCPConnection::Timer* prev;
+    bool                  first;
+
+    TimerLock.Take(__FILE__, __LINE__);
+    if (timer.Active)
+    {
+        StopTimer(timer);
+    }
+
+    timer.Expire_us = expire_us;
+    timer.Active    = true;
+    prev            = TimerTail;
+    while (prev != 0 && (int32_t)(prev->Expire_us - expire_us) > 0)
+    {
+        prev = prev->Prev;
+    }
+
+    timer.Prev = prev;
+    if (prev != 0)
+    {
+        timer.Next = prev->Next;
+        prev->Next = &timer;
+    }
+    else
+    {
+        timer.Next = TimerHead;
+        TimerHead  = &timer;
+    }
+    if (timer.Next != 0)
+    {
+        timer.Next->Prev = &timer;
+    }
+    else
+    {
+        TimerTail = &timer;
+    }
+    first = (TimerHead == &timer);
+    TimerLock.Give();
+
+    if (first)
+    {
+        TimerEvent.Notify();
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::StopTimer(TCPConnection::Timer& timer)
+{
+    TimerLock.Take(__FILE__, __LINE__);
+    if (timer.Active)
+    {
+        if (timer.Prev != 0)
+        {
+            timer.Prev->Next = timer.Next;
+        }
+        else
+        {
+            TimerHead = timer.Next;
+        }
+        if (timer.Next != 0)
+        {
+            timer.Next->Prev = timer.Prev;
+        }
+        else
+        {
+            TimerTail = timer.Prev;
+        }
+        timer.Active = false;
+    }
+    TimerLock.Give();
+}
+
+//============================================================================
+// Handlers are called without TimerLock held so they may restart their timer
+//============================================================================
+
+void ProtocolTCP::ProcessTimers(uint32_t currentTime_us)
+{
+    TCPConnection::Timer* timer;
+
+    while (1)
+    {
+        TimerLock.Take(__FILE__, __LINE__);
+        timer = TimerHead;
+        if (timer != 0 && (int32_t)(currentTime_us - timer->Expire_us) >= 0)
+        {
+            StopTimer(*timer);
+        }
+        else
+        {
+            timer = 0;
+        }
+        TimerLock.Give();
+
+        if (timer == 0)
+        {
+            break;
+        }
+        (timer->Connection->*timer->Handler)();
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::Show(osPrintfInterface* out)
+{
+    out->Printf("TCP Information\n");
+    for (int i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        out->Printf("connection %s   ", ConnectionList[i].GetStateString());
+        switch (ConnectionList[i].State)
+        {
+        case TCPConnection::LISTEN:
+            out->Printf("     local=%d  ", ConnectionList[i].LocalPort);
+            break;
+        case TCPConnection::CLOSED: break;
+        default:
             out->Printf("local=%d  remote=%d.%d.%d.%d:%d",
                         ConnectionList[i].LocalPort,
                         ConnectionList[i].RemoteAddress[0],
@@ -531,8 +1577,36 @@ void ProtocolTCP::Show(osPrintfInterface* out)
                         ConnectionList[i].RemoteAddress[3],
                         ConnectionList[i].RemotePort);
             break;
-        default: break;
         }
         out->Printf("\n");
+        if (ConnectionList[i].State != TCPConnection::CLOSED &&
+            ConnectionList[i].State != TCPConnection::LISTEN)
+        {
+            ConnectionList[i].ShowStatistics(out);
+        }
+    }
+
+    ShowRxProfile(out, "fast path ACK", FastAckProfile);
+    ShowRxProfile(out, "fast path data", FastDataProfile);
+    ShowRxProfile(out, "slow path", SlowPathProfile);
+    out->Printf("%u connections evicted\n", Evictions);
+    out->Printf("%u of %u receive pages free, %u reclaimed\n",
+                FreeRxPageCount,
+                TCP_RX_PAGE_COUNT,
+                RxPagesReclaimed);
+}
+
+//============================================================================
+//
+//============================================================================
+
+void ProtocolTCP::ShowRxProfile(osPrintfInterface* out, const char* name, const RxProfile& profile)
+{
+    uint32_t average = 0;
+
+    if (profile.Segments > 0)
+    {
+        average = (uint32_t)(profile.Cycles / profile.Segments);
     }
+    out->Printf("rx %-15s %10u segments %8u cycles/segment\n", name, profile.Segments, average);
 }
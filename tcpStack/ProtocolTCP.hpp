@@ -59,9 +59,66 @@
     (DATA_BUFFER_PAYLOAD_SIZE - TCP_HEADER_SIZE - IP_HEADER_SIZE - MAC_HEADER_SIZE)
 #error Rx window size must be smaller than data payload
 #endif
+#if TCP_RX_BUFFER_MAX > 65535 || TCP_RX_BUFFER_MAX % TCP_RX_WINDOW_SIZE != 0
+#error Rx buffer max must be a multiple of the rx window size that fits the window field
+#endif
+#define TCP_TICK_INTERVAL_US 100000
 #define TCP_RETRANSMIT_TIMEOUT_US 100000
 #define TCP_TIMED_WAIT_TIMEOUT_US 1000000
+#define TCP_PERSIST_MIN_US 200000
+#define TCP_PERSIST_MAX_US 60000000
+#define TCP_CONNECT_TIMEOUT_US 5000000
+// Worst case delayed ACK the tail loss probe allows for when a single
+// segment is in flight
+#define TCP_LOSS_PROBE_ACK_DELAY_US 40000
+// Shortest interval receive buffer autotuning measures over when the RTT is
+// shorter or not yet known
+#define TCP_RX_TUNE_MIN_US 10000
+// How long a connection must go without receiving before the pages of its
+// empty receive buffer may be taken for a connection that needs them
+#define TCP_RX_RECLAIM_IDLE_US 1000000
+// Header prediction lets the common ESTABLISHED segments skip the state
+// machine. Turned off every segment takes the slow path, which is how the
+// two are compared with testApp -profile.
+#define TCP_HEADER_PREDICTION true
+
+// Per connection defaults, changed with the TCPConnection option methods
+#define TCP_DELAYED_ACK_TIMEOUT_US 40000
+#define TCP_DELAYED_ACK_SEGMENTS 2
+#define TCP_NAGLE_ENABLED false
+#define TCP_PACING_ENABLED false
+#define TCP_CONGESTION_CONTROL CONGESTION_RENO
+#define TCP_KEEPALIVE_IDLE_US 60000000 // 0 disables keepalive
+#define TCP_KEEPALIVE_INTERVAL_US 10000000
+#define TCP_KEEPALIVE_PROBES 5
+#define TCP_ECN_ENABLED true
+#define TCP_FAST_OPEN_ENABLED false
+#define TCP_DSCP IP_DSCP_DEFAULT
+
+// Pacing gain in percent while in slow start and congestion avoidance
+#define TCP_PACING_SS_GAIN 200
+#define TCP_PACING_CA_GAIN 120
+// How far a segment may leave ahead of the pacing schedule, this covers the
+// millisecond resolution of the timer wait
+#define TCP_PACING_SLACK_US 1000
+
+#define TCP_INITIAL_WINDOW_SEGMENTS 4
 
+#define TCP_OPTION_END (0)
+#define TCP_OPTION_NOP (1)
+#define TCP_OPTION_MSS (2)
+#define TCP_OPTION_SACK_PERMITTED (4)
+#define TCP_OPTION_SACK (5)
+#define TCP_OPTION_TIMESTAMP (8)
+#define TCP_OPTION_FAST_OPEN (34)
+// Timestamps as most stacks send them, two NOPs then the 10 byte option
+#define TCP_TIMESTAMP_OPTIONS_SIZE (12)
+// Largest set of options a SYN carries, MSS, SACK permitted and a fast open
+// cookie, each padded to 4 bytes
+#define TCP_SYN_OPTIONS_SIZE (20)
+
+#define FLAG_CWR (0x80)
+#define FLAG_ECE (0x40)
 #define FLAG_URG (0x20)
 #define FLAG_ACK (0x10)
 #define FLAG_PSH (0x08)
@@ -69,6 +126,8 @@
 #define FLAG_SYN (0x02)
 #define FLAG_FIN (0x01)
 
+#define CWR (packet[13] & FLAG_CWR)
+#define ECE (packet[13] & FLAG_ECE)
 #define URG (packet[13] & FLAG_URG)
 #define ACK (packet[13] & FLAG_ACK)
 #define PSH (packet[13] & FLAG_PSH)
@@ -85,7 +144,16 @@ public:
 
     ProtocolTCP(ProtocolIPv4&);
     void Tick();
+    /// WaitForTimer blocks until a connection timer is due, the next tick
+    /// interval is up or, when not 0, limit_us has passed. The caller then
+    /// calls Tick.
+    void WaitForTimer(uint32_t limit_us = 0);
+    /// GetTimerEvent returns the event WaitForTimer waits on, notifying it
+    /// ends the wait early
+    osEvent* GetTimerEvent();
 
+    /// NewClient reserves a connection to the peer for Connect, Close
+    /// gives it back unused
     TCPConnection* NewClient(InterfaceMAC*,
                              const uint8_t* remoteAddress,
                              uint16_t       remotePort,
@@ -93,22 +161,142 @@ public:
     TCPConnection* NewServer(InterfaceMAC*, uint16_t port);
     uint16_t NewPort();
 
-    void ProcessRx(DataBuffer*, const uint8_t* sourceIP, const uint8_t* targetIP);
+    /// ecn is the ECN field of the IP header the segment arrived in
+    void ProcessRx(DataBuffer*, const uint8_t* sourceIP, const uint8_t* targetIP, uint8_t ecn);
+    /// Appends 'segment' to the 'held' segment if it continues it, returns
+    /// the number of bytes appended
+    uint16_t Coalesce(uint8_t*       held,
+                      uint16_t       heldLength,
+                      uint16_t       room,
+                      bool           verified,
+                      const uint8_t* segment,
+                      uint16_t       length,
+                      const uint8_t* sourceIP,
+                      const uint8_t* targetIP);
     void Show(osPrintfInterface* out);
 
 private:
     TCPConnection*
         LocateConnection(uint16_t remotePort, const uint8_t* remoteAddress, uint16_t localPort);
+    TCPConnection*  EvictConnection();
+    void            HandOver(TCPConnection*);
+    TCPConnection*  Accept(TCPConnection* listener);
     static uint16_t ComputeChecksum(uint8_t*       packet,
                                     uint16_t       length,
                                     const uint8_t* sourceIP,
                                     const uint8_t* targetIP);
-    void
-        Reset(InterfaceMAC*, uint16_t localPort, uint16_t remotePort, const uint8_t* remoteAddress);
+    static const uint8_t* FindOption(const uint8_t* options, uint8_t length, uint8_t kind);
+    bool ProcessRxFast(TCPConnection* connection,
+                       DataBuffer*    rxBuffer,
+                       uint32_t       acknowledgementNumber,
+                       uint16_t       remoteWindowSize,
+                       bool           push,
+                       uint32_t       time_us);
+
+    // A received segment as the state handlers see it
+    struct RxSegment
+    {
+        DataBuffer*    Buffer;
+        const uint8_t* SourceIP;
+        uint16_t       LocalPort;
+        uint16_t       RemotePort;
+        uint32_t       Sequence;
+        uint32_t       Acknowledgement;
+        uint16_t       Window;
+        uint8_t        Flags;
+        uint8_t        Ecn;
+        uint8_t*       Options;
+        uint8_t        OptionLength;
+        uint32_t       Time_us;
+        uint32_t       ReceiveNext; // Receive sequence before the segment
+    };
+    void Reset(const RxSegment& segment);
+
+    // Transition table indexed by connection state
+    typedef TCPConnection* (ProtocolTCP::*StateHandler)(TCPConnection*, RxSegment&);
+    struct StateEntry
+    {
+        StateHandler Handler;
+        bool         ReceivesData; // Segment ACK and data go to ReceiveData
+    };
+    static const StateEntry StateTable[TCPConnection::TTCP_PERSIST + 1];
+
+    TCPConnection* RxIgnore(TCPConnection*, RxSegment&);
+    TCPConnection* RxClosed(TCPConnection*, RxSegment&);
+    TCPConnection* RxListen(TCPConnection*, RxSegment&);
+    TCPConnection* RxSynSent(TCPConnection*, RxSegment&);
+    TCPConnection* RxSynReceived(TCPConnection*, RxSegment&);
+    TCPConnection* RxFinWait1(TCPConnection*, RxSegment&);
+    TCPConnection* RxClosing(TCPConnection*, RxSegment&);
+    TCPConnection* RxLastAck(TCPConnection*, RxSegment&);
+    void           ReceiveReset(TCPConnection*, RxSegment&);
+    void           ReceiveData(TCPConnection*, RxSegment&);
+    void           ReceiveFin(TCPConnection*, uint32_t time_us);
+
+    // Per segment cost of each receive path, measured with osTime::GetCycleCount
+    struct RxProfile
+    {
+        uint32_t Segments;
+        uint64_t Cycles;
+    };
+    void ShowRxProfile(osPrintfInterface* out, const char* name, const RxProfile&);
+
+    // TCP Fast Open. The server derives a client's cookie from its address
+    // under a random key chosen at startup, the client caches the cookie
+    // each server gave it.
+    struct FastOpenEntry
+    {
+        uint8_t Address[ProtocolIPv4::ADDRESS_SIZE];
+        uint8_t Cookie[TCP_FAST_OPEN_COOKIE_SIZE];
+        bool    Valid;
+    };
+    void MakeFastOpenCookie(const uint8_t* address, uint8_t* cookie);
+    bool ReceiveFastOpen(TCPConnection*, const uint8_t* options, uint8_t length);
+    bool FindFastOpenCookie(const uint8_t* address, uint8_t* cookie);
+    void SaveFastOpenCookie(const uint8_t* address, const uint8_t* cookie);
+
+    uint8_t       FastOpenKey[16];
+    FastOpenEntry FastOpenCache[TCP_FAST_OPEN_CACHE_SIZE];
+    uint8_t       FastOpenNext; // Cache entry replaced next
+
+    uint32_t InitialSequence(uint16_t localPort, const uint8_t* remoteAddress, uint16_t remotePort);
+    uint8_t  SequenceKey[16];
+
+    // Connection timers sorted by expiry time
+    void StartTimer(TCPConnection::Timer&, uint32_t expire_us);
+    void StopTimer(TCPConnection::Timer&);
+    void ProcessTimers(uint32_t currentTime_us);
+
+    TCPConnection::Timer* TimerHead;
+    TCPConnection::Timer* TimerTail;
+    osMutex               TimerLock;
+    osEvent               TimerEvent;
+    uint32_t              LastTick_us;
+
+    RxProfile FastAckProfile;
+    RxProfile FastDataProfile;
+    RxProfile SlowPathProfile;
+
+    // Connections borrow buffers from the pool as they open, receive buffers
+    // add pages from the page pool as they grow. ConnectionLock is held
+    // while a slot is claimed and its buffers change hands. RxPageLock only
+    // guards the free page list and is taken last, under at most one TxLock.
+    TCPConnection::Buffers* GetBuffers();
+    uint8_t*                GetRxPage(TCPConnection* requester, uint32_t time_us);
+    void                    FreeRxPage(uint8_t* page);
 
-    TCPConnection ConnectionList[TCP_MAX_CONNECTIONS];
-    void*         ConnectionHoldingBuffer[TX_BUFFER_COUNT];
-    uint16_t      NextPort;
+    osMutex                 ConnectionLock;
+    TCPConnection           ConnectionList[TCP_MAX_CONNECTIONS];
+    TCPConnection::Buffers  BufferList[TCP_BUFFER_COUNT];
+    TCPConnection::Buffers* FreeBuffers;
+    osMutex                 RxPageLock;
+    uint8_t                 RxPageList[TCP_RX_PAGE_COUNT][TCP_RX_WINDOW_SIZE];
+    uint8_t*                FreeRxPages[TCP_RX_PAGE_COUNT];
+    uint16_t                FreeRxPageCount;
+    uint32_t                RxPagesReclaimed;
+    void*                   ConnectionHoldingBuffer[TX_BUFFER_COUNT];
+    uint16_t                NextPort;
+    uint32_t                Evictions;
 
     ProtocolIPv4& IP;
 
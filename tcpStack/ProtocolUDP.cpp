@@ -44,6 +44,10 @@ ProtocolUDP::ProtocolUDP(ProtocolIPv4& ip, ProtocolDHCP& dhcp)
     : IP(ip)
     , DHCP(dhcp)
 {
+    for (int i = 0; i < UDP_SHAPER_COUNT; i++)
+    {
+        Shapers[i].Port = 0;
+    }
 }
 
 //============================================================================
@@ -95,7 +99,8 @@ void ProtocolUDP::Transmit(DataBuffer*    buffer,
                            const uint8_t* targetIP,
                            uint16_t       targetPort,
                            const uint8_t* sourceIP,
-                           uint16_t       sourcePort)
+                           uint16_t       sourcePort,
+                           uint8_t        dscp)
 {
     buffer->Packet -= UDP_HEADER_SIZE;
     buffer->Remainder += UDP_HEADER_SIZE;
@@ -116,5 +121,41 @@ void ProtocolUDP::Transmit(DataBuffer*    buffer,
     acc = FCS::ChecksumAdd(buffer->Packet, buffer->Length, acc);
     Pack16(buffer->Packet, 6, FCS::ChecksumComplete(acc));
 
-    IP.Transmit(buffer, 0x11, targetIP, sourceIP);
+    for (int i = 0; i < UDP_SHAPER_COUNT; i++)
+    {
+        if (Shapers[i].Port == sourcePort && Shapers[i].Bucket.IsEnabled())
+        {
+            // Shaped datagrams queue in a round robin flow of their own so
+            // they do not hold up control traffic while they wait
+            buffer->Shaper = &Shapers[i].Bucket;
+            buffer->Flow   = TX_FLOW_PRIORITY + sourcePort % (TX_FLOW_COUNT - TX_FLOW_PRIORITY);
+        }
+    }
+
+    IP.Transmit(buffer, 0x11, targetIP, sourceIP, dscp << IP_DSCP_SHIFT);
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool ProtocolUDP::SetShaper(uint16_t sourcePort, uint32_t rate, uint32_t burst)
+{
+    PortShaper* entry = 0;
+    int         i;
+
+    for (i = 0; i < UDP_SHAPER_COUNT; i++)
+    {
+        if (Shapers[i].Port == sourcePort || (Shapers[i].Port == 0 && entry == 0))
+        {
+            entry = &Shapers[i];
+        }
+    }
+    if (entry != 0)
+    {
+        entry->Port = (rate != 0 ? sourcePort : 0);
+        entry->Bucket.Configure(rate, burst);
+    }
+
+    return entry != 0;
 }
@@ -34,6 +34,7 @@
 
 #include <inttypes.h>
 #include "DataBuffer.hpp"
+#include "TokenBucket.hpp"
 
 #define UDP_HEADER_SIZE (8)
 
@@ -49,11 +50,25 @@ public:
                   const uint8_t* targetIP,
                   uint16_t       targetPort,
                   const uint8_t* sourceIP,
-                  uint16_t       sourcePort);
+                  uint16_t       sourcePort,
+                  uint8_t        dscp = 0);
 
     DataBuffer* GetTxBuffer(InterfaceMAC*);
 
+    /// SetShaper caps the rate datagrams from sourcePort are sent at, in
+    /// bytes per second with bursts of up to 'burst' bytes. Datagrams over
+    /// the rate wait in the MAC's transmit queues. A rate of 0 removes the
+    /// cap. Returns false if UDP_SHAPER_COUNT ports are already shaped.
+    bool SetShaper(uint16_t sourcePort, uint32_t rate, uint32_t burst);
+
 private:
+    struct PortShaper
+    {
+        uint16_t    Port; // 0 if the entry is free
+        TokenBucket Bucket;
+    };
+    PortShaper Shapers[UDP_SHAPER_COUNT];
+
     ProtocolIPv4& IP;
     ProtocolDHCP& DHCP;
 };
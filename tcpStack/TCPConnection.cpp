@@ -29,6 +29,7 @@
 // POSSIBILITY OF SUCH DAMAGE.
 //----------------------------------------------------------------------------
 
+#include <string.h>
 #include "TCPConnection.hpp"
 #include "ProtocolIPv4.hpp"
 #include "ProtocolTCP.hpp"
@@ -40,16 +41,170 @@
 //============================================================================
 
 TCPConnection::TCPConnection()
-    : TxBuffer(0)
-    , NewConnection(0)
+    : RxInOffset(0)
+    , CurrentWindow(TCP_RX_WINDOW_SIZE)
+    , RxSize(TCP_RX_WINDOW_SIZE)
     , RxBufferEmpty(true)
-    , RxInOffset(0)
+    , OutOfOrderStart(0)
+    , OutOfOrderEnd(0)
+    , FreeSegments(0)
+    , RetransmitHead(0)
+    , RetransmitTail(0)
+    , Storage(0)
+    , TxLock("TxLock")
     , RxOutOffset(0)
-    , CurrentWindow(TCP_RX_WINDOW_SIZE)
-    , Event("tcp connection")
-    , HoldingQueue("TCPHolding", TX_BUFFER_COUNT, ConnectionHoldingBuffer)
-    , HoldingQueueLock("HoldingQueueLock")
+    , RxSpaceTime_us(0)
+    , RxSpaceBytes(0)
+    , RxShrinking(false)
+    , PostIn(0)
+    , PostFill(0)
+    , PostOut(0)
+    , NewConnection(0)
+    , RxEvent("tcp rx")
+    , TxEvent("tcp tx")
+{
+    SetDefaultOptions();
+    TxPushPending   = false;
+    FinPending      = false;
+    FinSent         = false;
+    WritableWanted  = false;
+    TxCount         = 0;
+    UnackedSegments = 0;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetDefaultOptions()
+{
+    NagleEnabled         = TCP_NAGLE_ENABLED;
+    Corked               = false;
+    DelayedAckTimeout_us = TCP_DELAYED_ACK_TIMEOUT_US;
+    DelayedAckSegments   = TCP_DELAYED_ACK_SEGMENTS;
+    PacingEnabled        = TCP_PACING_ENABLED;
+    PacingRate           = 0;
+    CongestionControl    = TCP_CONGESTION_CONTROL;
+    KeepAliveIdle_us     = TCP_KEEPALIVE_IDLE_US;
+    KeepAliveInterval_us = TCP_KEEPALIVE_INTERVAL_US;
+    KeepAliveProbes      = TCP_KEEPALIVE_PROBES;
+    EcnEnabled           = TCP_ECN_ENABLED;
+    FastOpenEnabled      = TCP_FAST_OPEN_ENABLED;
+    Dscp                 = TCP_DSCP;
+    Writable             = 0;
+    Shaper.Configure(0, 0);
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::CopyOptions(const TCPConnection& source)
+{
+    NagleEnabled         = source.NagleEnabled;
+    Corked               = source.Corked;
+    DelayedAckTimeout_us = source.DelayedAckTimeout_us;
+    DelayedAckSegments   = source.DelayedAckSegments;
+    PacingEnabled        = source.PacingEnabled;
+    PacingRate           = source.PacingRate;
+    CongestionControl    = source.CongestionControl;
+    KeepAliveIdle_us     = source.KeepAliveIdle_us;
+    KeepAliveInterval_us = source.KeepAliveInterval_us;
+    KeepAliveProbes      = source.KeepAliveProbes;
+    EcnEnabled           = source.EcnEnabled;
+    FastOpenEnabled      = source.FastOpenEnabled;
+    Dscp                 = source.Dscp;
+    Writable             = source.Writable;
+    Shaper               = source.Shaper;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetNagle(bool enable)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    NagleEnabled = enable;
+    Output();
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetCork(bool enable)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Corked = enable;
+    if (!Corked)
+    {
+        // Uncorking sends whatever has been written so far
+        TxPushPending = true;
+        Output();
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetDelayedAckTimeout(uint32_t timeout_us)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    DelayedAckTimeout_us = timeout_us;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetAckFrequency(uint8_t segments)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    DelayedAckSegments = segments;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetPacing(bool enable)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    PacingEnabled = enable;
+    Output();
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetPacingRate(uint32_t bytesPerSecond)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    PacingRate = bytesPerSecond;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetCongestionControl(CongestionAlgorithm algorithm)
 {
+    TxLock.Take(__FILE__, __LINE__);
+    if (algorithm != CongestionControl)
+    {
+        CongestionControl = algorithm;
+        BBR.Initialize(MaximumSegmentSize, CongestionWindow, (uint32_t)osTime::GetTime());
+    }
+    TxLock.Give();
 }
 
 //============================================================================
@@ -61,6 +216,23 @@ void TCPConnection::Initialize(ProtocolIPv4& ip, ProtocolTCP& tcp)
     MAC = 0;
     IP  = &ip;
     TCP = &tcp;
+
+    PaceTimer.Connection    = this;
+    PaceTimer.Handler       = &TCPConnection::Output;
+    PaceTimer.Active        = false;
+    PersistTimer.Connection = this;
+    PersistTimer.Handler    = &TCPConnection::PersistTimeout;
+    PersistTimer.Active     = false;
+
+    KeepAliveTimer.Connection = this;
+    KeepAliveTimer.Handler    = &TCPConnection::KeepAliveTimeout;
+    KeepAliveTimer.Active     = false;
+    ReorderTimer.Connection   = this;
+    ReorderTimer.Handler      = &TCPConnection::ReorderTimeout;
+    ReorderTimer.Active       = false;
+    ProbeTimer.Connection     = this;
+    ProbeTimer.Handler        = &TCPConnection::ProbeTimeout;
+    ProbeTimer.Active         = false;
 }
 
 //============================================================================
@@ -81,30 +253,73 @@ void TCPConnection::SetMAC(InterfaceMAC* mac)
 }
 
 //============================================================================
-//
+// Sends a segment without data. SYN and FIN consume a sequence number so they
+// are queued for retransmission like data.
 //============================================================================
 
 void TCPConnection::SendFlags(uint8_t flags)
 {
-    DataBuffer* buffer = GetTxBuffer();
-
-    if (buffer)
+    TxLock.Take(__FILE__, __LINE__);
+    if ((flags & (FLAG_SYN | FLAG_FIN)) == 0)
+    {
+        SendSegment(SequenceNumber, 0, flags);
+    }
+    else if (AddSegment(0, flags, (uint32_t)osTime::GetTime()) != 0)
     {
-        BuildPacket(buffer, flags);
+        // If no tx buffer is available the retransmit timer sends it later
+        SendSegment(SequenceNumber, 0, flags);
+        SequenceNumber++;
     }
+    TxLock.Give();
 }
 
 //============================================================================
-//
+// Fills in the TCP header in front of the payload in buffer, returns the IP
+// ToS the segment goes out with
 //============================================================================
 
-void TCPConnection::BuildPacket(DataBuffer* buffer, uint8_t flags)
+uint8_t TCPConnection::BuildHeader(DataBuffer* buffer,
+                                   uint32_t    sequence,
+                                   uint8_t     flags,
+                                   uint8_t     optionLength)
 {
     uint8_t* packet;
     uint16_t checksum;
     uint16_t length;
+    uint8_t  tos = Dscp << IP_DSCP_SHIFT | IP_ECN_NOT_ECT;
 
-    flags |= FLAG_ACK;
+    if (State != SYN_SENT)
+    {
+        // Everything but the opening SYN acknowledges
+        flags |= FLAG_ACK;
+    }
+    if ((flags & FLAG_SYN) != 0)
+    {
+        if (EcnEnabled)
+        {
+            // ECN setup, a SYN offers it with ECE and CWR, the SYN-ACK accepts
+            // with ECE alone
+            flags |= (State == SYN_SENT ? FLAG_ECE | FLAG_CWR : FLAG_ECE);
+        }
+    }
+    else if (EcnEnabled)
+    {
+        if (buffer->Length != 0 && sequence == SequenceNumber)
+        {
+            // Only new data is ECN capable, retransmissions, probes and pure
+            // ACKs are not
+            tos |= IP_ECN_ECT0;
+            if (CwrPending)
+            {
+                flags |= FLAG_CWR;
+                CwrPending = false;
+            }
+        }
+        if (EcnEchoPending)
+        {
+            flags |= FLAG_ECE;
+        }
+    }
 
     buffer->Packet -= TCP_HEADER_SIZE;
     packet = buffer->Packet;
@@ -113,28 +328,20 @@ void TCPConnection::BuildPacket(DataBuffer* buffer, uint8_t flags)
     {
         Pack16(packet, 0, LocalPort);
         Pack16(packet, 2, RemotePort);
-        Pack32(packet, 4, SequenceNumber);
+        Pack32(packet, 4, sequence);
         if ((int32_t)(AcknowledgementNumber - LastAck) > 0)
         {
             // Only advance LastAck if Ack > LastAck
             LastAck = AcknowledgementNumber;
         }
+        UnackedSegments = 0;
         Pack32(packet, 8, AcknowledgementNumber);
-        packet[12] = 0x50; // Header length and reserved
+        packet[12] = ((TCP_HEADER_SIZE + optionLength) / 4) << 4; // Header length and reserved
         packet[13] = flags;
-        Pack16(packet, 14, CurrentWindow);
+        Pack16(packet, 14, ReceiveWindow());
         Pack16(packet, 16, 0); // checksum placeholder
         Pack16(packet, 18, 0); // urgent pointer
 
-        SequenceNumber += length;
-        buffer->AcknowledgementNumber = SequenceNumber;
-
-        while ((int32_t)(MaxSequenceTx - SequenceNumber) < 0)
-        {
-            printf("tx window full\n");
-            Event.Wait(__FILE__, __LINE__);
-        }
-
         checksum = ProtocolTCP::ComputeChecksum(
             packet, length + TCP_HEADER_SIZE, IP->GetUnicastAddress(), RemoteAddress);
 
@@ -142,321 +349,2270 @@ void TCPConnection::BuildPacket(DataBuffer* buffer, uint8_t flags)
 
         buffer->Length += TCP_HEADER_SIZE;
 
-        if (length > 0 || (flags & (FLAG_SYN | FLAG_FIN)))
-        {
-            buffer->Disposable = false;
-            buffer->Time_us    = (uint32_t)osTime::GetTime();
-            HoldingQueueLock.Take(__FILE__, __LINE__);
-            HoldingQueue.Put(buffer);
-            HoldingQueueLock.Give();
-        }
-
-        IP->Transmit(buffer, 0x06, RemoteAddress, IP->GetUnicastAddress());
+        Stats.SegmentsOut++;
+        Stats.BytesOut += length - optionLength;
     }
+
+    return tos;
 }
 
 //============================================================================
-//
+// Builds and transmits a segment carrying 'length' bytes of the send buffer
+// starting at 'sequence'. Returns false if no tx buffer is free.
 //============================================================================
 
-DataBuffer* TCPConnection::GetTxBuffer()
+bool TCPConnection::SendSegment(uint32_t sequence, uint16_t length, uint8_t flags)
 {
-    DataBuffer* rc;
+    DataBuffer* buffer;
+    uint8_t     tos;
 
-    rc = IP->GetTxBuffer(MAC);
-    if (rc)
+    buffer = BuildSegment(sequence, length, flags, tos);
+    if (buffer != 0)
     {
-        rc->Packet += TCP_HEADER_SIZE;
-        rc->Remainder -= TCP_HEADER_SIZE;
+        IP->Transmit(buffer, 0x06, RemoteAddress, IP->GetUnicastAddress(), tos);
     }
 
-    return rc;
+    return buffer != 0;
 }
 
 //============================================================================
-//
+// Builds a segment carrying 'length' bytes of the send buffer starting at
+// 'sequence' ready for IP. A SYN's options go ahead of any data, which then
+// starts one past the SYN's sequence number. Returns 0 if no tx buffer is
+// free.
 //============================================================================
 
-void TCPConnection::Write(const uint8_t* data, uint16_t length)
+DataBuffer* TCPConnection::BuildSegment(uint32_t sequence,
+                                        uint16_t length,
+                                        uint8_t  flags,
+                                        uint8_t& tos)
 {
-    uint16_t i;
+    DataBuffer* buffer       = GetTxBuffer();
+    uint32_t    dataSequence = sequence;
+    uint8_t     optionLength = 0;
+    uint16_t    offset;
+    uint16_t    i;
 
-    while (length > 0)
+    if (buffer == 0)
     {
-        if (!TxBuffer)
-        {
-            TxBuffer = GetTxBuffer();
-            TxOffset = 0;
-        }
+        return 0;
+    }
 
-        if (TxBuffer)
-        {
-            if (TxBuffer->Remainder > length)
-            {
-                for (i = 0; i < length; i++)
-                {
-                    TxBuffer->Packet[TxOffset++] = data[i];
-                }
-                TxBuffer->Length += length;
-                TxBuffer->Remainder -= length;
-                break;
-            }
-            else if (TxBuffer->Remainder <= length)
-            {
-                for (i = 0; i < TxBuffer->Remainder; i++)
-                {
-                    TxBuffer->Packet[TxOffset++] = data[i];
-                }
-                TxBuffer->Length += TxBuffer->Remainder;
-                length -= TxBuffer->Remainder;
-                data += TxBuffer->Remainder;
-                TxBuffer->Remainder = 0;
-                Flush();
-            }
-        }
-        else
+    if ((flags & FLAG_SYN) != 0)
+    {
+        optionLength = BuildSynOptions(buffer->Packet);
+        dataSequence++;
+    }
+    offset = TxOutOffset + (uint16_t)(dataSequence - TxSequence);
+    if (offset >= TCP_TX_BUFFER_SIZE)
+    {
+        offset -= TCP_TX_BUFFER_SIZE;
+    }
+    for (i = 0; i < length; i++)
+    {
+        buffer->Packet[optionLength + i] = Storage->Tx[offset++];
+        if (offset >= TCP_TX_BUFFER_SIZE)
         {
-            printf("Out of tx buffers\n");
+            offset = 0;
         }
     }
+    buffer->Length = optionLength + length;
+
+    tos = BuildHeader(buffer, sequence, flags, optionLength);
+    return buffer;
 }
 
 //============================================================================
-//
+// Hands segments built by Output to IP together, so the route, ARP lookup
+// and driver call are paid once for the batch
 //============================================================================
 
-void TCPConnection::Flush()
+void TCPConnection::SendBatch(DataBuffer** batch, uint8_t count, uint8_t tos)
 {
-    if (TxBuffer != 0)
+    if (count == 1)
     {
-        BuildPacket(TxBuffer, FLAG_PSH);
-        TxBuffer = 0;
+        IP->Transmit(batch[0], 0x06, RemoteAddress, IP->GetUnicastAddress(), tos);
+    }
+    else if (count > 1)
+    {
+        IP->TransmitBatch(batch, count, 0x06, RemoteAddress, IP->GetUnicastAddress(), tos);
     }
 }
 
 //============================================================================
-//
+// Sends a queued segment again. Its send time moves to now so RACK judges it
+// by the new transmission.
 //============================================================================
 
-void TCPConnection::Close()
+void TCPConnection::RetransmitSegment(Segment* segment, uint32_t time_us)
 {
-    switch (State)
+    if (SendSegment(segment->Sequence, segment->Length, segment->Flags))
     {
-    case LISTEN:
-    case SYN_SENT: State = CLOSED; break;
-    case SYN_RECEIVED:
-    case ESTABLISHED:
-        SendFlags(FLAG_FIN);
-        State = FIN_WAIT_1;
-        SequenceNumber++; // FIN consumes a sequence number
-        break;
-    case CLOSE_WAIT:
-        SendFlags(FLAG_FIN);
-        SequenceNumber++; // FIN consumes a sequence number
-        State = LAST_ACK;
-        break;
-    default: break;
+        Shaper.Consume(segment->Length + TCP_HEADER_SIZE + IP_HEADER_SIZE, time_us);
+        segment->Retransmitted = true;
+        segment->Time_us       = time_us;
+        Stats.Retransmits++;
+        Stats.BytesRetransmitted += segment->Length;
     }
 }
 
 //============================================================================
-//
+// Queues a record for a segment about to be sent at SequenceNumber.
+// Returns 0 if all records are in use.
 //============================================================================
 
-TCPConnection* TCPConnection::Listen()
+TCPConnection::Segment* TCPConnection::AddSegment(uint16_t length, uint8_t flags, uint32_t time_us)
 {
-    TCPConnection* connection;
+    Segment* segment = FreeSegments;
 
-    while (NewConnection == 0)
+    if (segment != 0)
     {
-        Event.Wait(__FILE__, __LINE__);
+        FreeSegments           = segment->Next;
+        segment->Next          = 0;
+        segment->Sequence      = SequenceNumber;
+        segment->EndSequence   = SequenceNumber + length;
+        segment->Time_us       = time_us;
+        segment->Length        = length;
+        segment->Flags         = flags & (FLAG_SYN | FLAG_FIN);
+        segment->Retransmitted = false;
+        segment->Sacked        = false;
+        if (RetransmitHead == 0)
+        {
+            // Nothing in flight, delivery rate intervals restart here
+            FirstSentTime_us = time_us;
+            DeliveredTime_us = time_us;
+        }
+        segment->Delivered        = Delivered;
+        segment->DeliveredTime_us = DeliveredTime_us;
+        segment->FirstSentTime_us = FirstSentTime_us;
+        segment->AppLimited       = (AppLimitedUntil != 0);
+        if (segment->Flags != 0)
+        {
+            segment->EndSequence++; // SYN and FIN consume a sequence number
+        }
+
+        if (RetransmitTail != 0)
+        {
+            RetransmitTail->Next = segment;
+        }
+        else
+        {
+            RetransmitHead    = segment;
+            RetransmitTime_us = time_us;
+        }
+        RetransmitTail = segment;
     }
-    connection    = NewConnection;
-    NewConnection = 0;
 
-    return connection;
+    return segment;
 }
 
 //============================================================================
 //
 //============================================================================
 
-int TCPConnection::Read()
+DataBuffer* TCPConnection::GetTxBuffer()
 {
-    int rc = -1;
+    DataBuffer* rc;
 
-    while (RxBufferEmpty)
+    // Never wait for a tx buffer, output is retried on the next ACK or Tick
+    rc = IP->GetTxBuffer(MAC, false);
+    if (rc)
     {
-        if (LastAck != AcknowledgementNumber)
-        {
-            SendFlags(FLAG_ACK);
-        }
-        Event.Wait(__FILE__, __LINE__);
+        rc->Packet += TCP_HEADER_SIZE;
+        rc->Remainder -= TCP_HEADER_SIZE;
+        // Connections share the MAC's round robin flows by slot
+        rc->Flow = TX_FLOW_PRIORITY +
+                   (this - TCP->ConnectionList) % (TX_FLOW_COUNT - TX_FLOW_PRIORITY);
     }
 
-    rc = RxBuffer[RxOutOffset++];
-    if (RxOutOffset >= TCP_RX_WINDOW_SIZE)
-    {
-        RxOutOffset = 0;
-    }
-    AcknowledgementNumber++;
-    CurrentWindow++;
+    return rc;
+}
 
-    if (RxOutOffset == RxInOffset)
+//============================================================================
+// Gives the connection a set of buffers, anything left in the receive state
+// belonged to the slot's previous connection
+//============================================================================
+
+void TCPConnection::AttachBuffers(Buffers* buffers)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Storage             = buffers;
+    Storage->RxPages[0] = Storage->Rx;
+    RxInOffset          = 0;
+    RxOutOffset         = 0;
+    RxSize              = TCP_RX_WINDOW_SIZE;
+    CurrentWindow       = RxSize;
+    RxBufferEmpty       = true;
+    RxSpaceTime_us      = (uint32_t)osTime::GetTime();
+    RxSpaceBytes        = 0;
+    RxShrinking         = false;
+    OutOfOrderStart     = 0;
+    OutOfOrderEnd       = 0;
+    PostIn              = 0;
+    PostFill            = 0;
+    PostOut             = 0;
+    TxLock.Give();
+}
+
+//============================================================================
+// Takes the buffers back from a connection that no longer carries data.
+// Unread data and unacknowledged segments are dropped with them.
+//============================================================================
+
+TCPConnection::Buffers* TCPConnection::DetachBuffers()
+{
+    Buffers* rc;
+
+    TxLock.Take(__FILE__, __LINE__);
+    RxBufferEmpty = true;
+    OutOfOrderEnd = OutOfOrderStart;
+    if (Storage != 0)
     {
-        RxBufferEmpty = true;
+        DropRxPages(TCP_RX_WINDOW_SIZE);
     }
-
-    //if( CurrentWindow == TCP_RX_WINDOW_SIZE && LastAck != AcknowledgementNumber )
-    //{
-    //   // The Rx buffer is empty, might as well ack
-    //   Send( FLAG_ACK );
-    //}
+    rc             = Storage;
+    Storage        = 0;
+    FreeSegments   = 0;
+    RetransmitHead = 0;
+    RetransmitTail = 0;
+    TxCount        = 0;
+    TxLock.Give();
 
     return rc;
 }
 
 //============================================================================
-//
+// Once the RTT is up, grows the receive buffer to twice what arrived in it.
+// A sender that filled more than half the buffer in an RTT would soon be
+// held back by the window, one that did not needs no more room.
 //============================================================================
 
-int TCPConnection::ReadLine(char* buffer, int size)
+void TCPConnection::TuneReceiveBuffer(uint32_t time_us)
 {
-    int  i;
-    char c;
-    bool done           = false;
-    int  bytesProcessed = 0;
+    uint32_t interval_us = (RTT_us > TCP_RX_TUNE_MIN_US ? RTT_us : TCP_RX_TUNE_MIN_US);
 
-    while (!done)
+    if (time_us - RxSpaceTime_us >= interval_us)
     {
-        i = Read();
-        if (i == -1)
-        {
-            *buffer = 0;
-            break;
-        }
-        c = (char)i;
-        bytesProcessed++;
-        switch (c)
-        {
-        case '\r': *buffer++ = 0; break;
-        case '\n':
-            *buffer++ = 0;
-            done      = true;
-            break;
-        default: *buffer++ = c; break;
-        }
-
-        if (bytesProcessed == size)
+        if (RxSpaceBytes * 2 > RxSize)
         {
-            break;
+            GrowReceiveBuffer(RxSpaceBytes * 2, time_us);
         }
+        RxSpaceTime_us = time_us;
+        RxSpaceBytes   = 0;
     }
-
-    *buffer = 0;
-    return bytesProcessed;
 }
 
 //============================================================================
-//
+// Adds pages to the end of the receive ring until it holds 'size' bytes or
+// TCP_RX_BUFFER_MAX. Returns true if the buffer grew. TxLock is not held
+// while a page is fetched because the pool may take pages back from another
+// connection under that connection's TxLock.
 //============================================================================
 
-void TCPConnection::Tick()
+bool TCPConnection::GrowReceiveBuffer(uint32_t size, uint32_t time_us)
 {
-    int         count;
-    int         i;
-    DataBuffer* buffer;
-    uint32_t    currentTime_us;
-    uint32_t    timeoutTime_us;
+    uint8_t* page;
+    bool     rc = false;
 
-    HoldingQueueLock.Take(__FILE__, __LINE__);
-    count          = HoldingQueue.GetCount();
-    currentTime_us = (int32_t)osTime::GetTime();
-
-    // Check for retransmit timeout
-    timeoutTime_us = currentTime_us - TCP_RETRANSMIT_TIMEOUT_US;
-    for (i = 0; i < count; i++)
+    TxLock.Take(__FILE__, __LINE__);
+    while (ReceiveBufferCanGrow(size))
     {
-        buffer = (DataBuffer*)HoldingQueue.Get();
-        if ((int32_t)(buffer->Time_us - timeoutTime_us) <= 0)
+        TxLock.Give();
+        page = TCP->GetRxPage(this, time_us);
+        TxLock.Take(__FILE__, __LINE__);
+        if (page == 0)
         {
-            printf("TCP retransmit timeout %u, %u, delta %d\n",
-                   buffer->Time_us,
-                   timeoutTime_us,
-                   (int32_t)(buffer->Time_us - timeoutTime_us));
-            buffer->Time_us = currentTime_us;
-            IP->Retransmit(buffer);
+            break;
         }
-
-        HoldingQueue.Put(buffer);
-    }
-    HoldingQueueLock.Give();
-
-    // Check for TIMED_WAIT timeouts
-    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
-    {
-        if (TCP->ConnectionList[i].State == TIMED_WAIT)
+        if (!ReceiveBufferCanGrow(size))
         {
-            if (currentTime_us - TCP->ConnectionList[i].Time_us >= TCP_TIMED_WAIT_TIMEOUT_US)
-            {
-                TCP->ConnectionList[i].State = CLOSED;
-            }
+            // The reader or a detach got in while the lock was released
+            TCP->FreeRxPage(page);
+            break;
+        }
+        if (RxBufferEmpty)
+        {
+            RxInOffset  = 0;
+            RxOutOffset = 0;
+        }
+        else if (RxInOffset == 0)
+        {
+            // Full, the data runs from the start of the ring to its end
+            RxInOffset = RxSize;
         }
+        Storage->RxPages[RxSize / TCP_RX_WINDOW_SIZE] = page;
+        RxSize += TCP_RX_WINDOW_SIZE;
+        CurrentWindow += TCP_RX_WINDOW_SIZE;
+        rc = true;
     }
+    TxLock.Give();
 
-    // Check for delayed ACK
-    if (LastAck != AcknowledgementNumber)
-    {
-        SendFlags(FLAG_ACK);
-    }
+    return rc;
 }
 
 //============================================================================
-//
+// Adding a page keeps the data in order only while it does not wrap around
+// the ring and nothing is held out of order past it, otherwise growing waits
+// for a later RTT. Called with TxLock held.
 //============================================================================
 
-void TCPConnection::CalculateRTT(int32_t M)
+bool TCPConnection::ReceiveBufferCanGrow(uint32_t size)
 {
-    int32_t err;
+    return Storage != 0 && !RxShrinking && RxSize < size && RxSize < TCP_RX_BUFFER_MAX &&
+           OutOfOrderStart == OutOfOrderEnd &&
+           (RxBufferEmpty || RxInOffset > RxOutOffset || (RxInOffset == 0 && RxOutOffset == 0));
+}
 
-    err = M - RTT_us;
+//============================================================================
+// Shrinks an empty receive buffer towards its first page and returns the
+// number of pages given back to the pool. A window once offered is not taken
+// back (RFC 1122 4.2.2.16), so only pages past the advertised right edge go
+// at once. The rest are no longer offered and are freed when the next ACK
+// goes out after the peer is back within the first page.
+//============================================================================
 
-    // Gain is 0.125
-    RTT_us = RTT_us + (125 * err) / 1000;
+uint16_t TCPConnection::ReleaseRxPages()
+{
+    uint16_t rc = 0;
 
-    if (err < 0)
+    TxLock.Take(__FILE__, __LINE__);
+    if (Storage != 0 && RxBufferEmpty && OutOfOrderStart == OutOfOrderEnd)
     {
-        err = -err;
+        rc          = DropRxPages(OfferedWindow());
+        RxShrinking = (RxSize > TCP_RX_WINDOW_SIZE);
     }
+    TxLock.Give();
 
-    // Gain is 0.250
-    RTTDeviation = RTTDeviation + (250 * (err - RTTDeviation)) / 1000;
+    return rc;
+}
+
+//============================================================================
+// Frees the pages of an empty receive ring down to the fewest that still
+// hold 'keep' bytes, at least one. Returns the number of pages freed.
+// Called with TxLock held.
+//============================================================================
+
+uint16_t TCPConnection::DropRxPages(uint16_t keep)
+{
+    uint16_t rc = 0;
+
+    RxInOffset  = 0;
+    RxOutOffset = 0;
+    while (RxSize > TCP_RX_WINDOW_SIZE && RxSize - TCP_RX_WINDOW_SIZE >= keep)
+    {
+        RxSize -= TCP_RX_WINDOW_SIZE;
+        TCP->FreeRxPage(Storage->RxPages[RxSize / TCP_RX_WINDOW_SIZE]);
+        rc++;
+    }
+    CurrentWindow = RxSize;
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::InitializeTx(uint32_t initialSequence)
+{
+    int i;
+
+    TxLock.Take(__FILE__, __LINE__);
+    FreeSegments = 0;
+    for (i = 0; i < TCP_TX_SEGMENT_COUNT && Storage != 0; i++)
+    {
+        Storage->Segments[i].Next = FreeSegments;
+        FreeSegments              = &Storage->Segments[i];
+    }
+    RetransmitHead = 0;
+    RetransmitTail = 0;
+
+    SequenceNumber         = initialSequence;
+    UnacknowledgedSequence = initialSequence;
+    TxSequence             = initialSequence + 1; // Data follows our SYN
+    TxOutOffset            = 0;
+    TxCount                = 0;
+    TxPushPending          = false;
+    FinPending             = false;
+    FinSent                = false;
+    WritableWanted         = false;
+    MaxSendWindow          = 0;
+    NextSendTime_us        = (uint32_t)osTime::GetTime();
+    MaximumSegmentSize =
+        DATA_BUFFER_PAYLOAD_SIZE - MAC->HeaderSize() - IP_HEADER_SIZE - TCP_HEADER_SIZE;
+    CongestionWindow   = TCP_INITIAL_WINDOW_SEGMENTS * MaximumSegmentSize;
+    SlowStartThreshold = 0xFFFFFFFF;
+    RTT_us             = 0;
+    RTTDeviation       = 0;
+    Delivered          = 0;
+    DeliveredTime_us   = NextSendTime_us;
+    FirstSentTime_us   = NextSendTime_us;
+    AppLimitedUntil    = 0;
+    ZeroWindowStart_us = 0;
+    PersistBackoff_us  = TCP_PERSIST_MIN_US;
+    AdvertisedEdge     = 0;
+    SackEnabled        = false;
+    MinRTT_us          = 0;
+    RackTime_us        = NextSendTime_us;
+    RackEndSequence    = initialSequence;
+    RackRTT_us         = 0;
+    RecoverySequence   = initialSequence;
+    InRecovery         = false;
+    ProbeSent          = false;
+    EcnEchoPending     = false;
+    CwrPending         = false;
+    FastOpenOption     = false;
+    memset(&Stats, 0, sizeof(Stats));
+    BBR.Initialize(MaximumSegmentSize, CongestionWindow, NextSendTime_us);
+    StopTimers();
+    TxLock.Give();
+}
+
+//============================================================================
+// Receiver side silly window avoidance. The right edge of the offered window
+// only moves when the window can open by at least
+// min(half the receive buffer, MSS), smaller openings are held back.
+//============================================================================
+
+uint16_t TCPConnection::ReceiveWindow()
+{
+    uint16_t offered;
+
+    if (RxShrinking && RxBufferEmpty && OutOfOrderStart == OutOfOrderEnd &&
+        OfferedWindow() <= TCP_RX_WINDOW_SIZE)
+    {
+        // The peer is inside the first page, the pages held back can go
+        DropRxPages(TCP_RX_WINDOW_SIZE);
+        RxShrinking = false;
+    }
+    offered = OfferedWindow();
+
+    if (CurrentWindow - offered >= WindowUpdateThreshold())
+    {
+        offered = CurrentWindow;
+    }
+    if (RxShrinking && offered > TCP_RX_WINDOW_SIZE)
+    {
+        // Let the edge come back to one page so the rest can be released
+        offered = OfferedWindow();
+        if (offered < TCP_RX_WINDOW_SIZE)
+        {
+            offered = TCP_RX_WINDOW_SIZE;
+        }
+    }
+
+    AdvertisedEdge = AcknowledgementNumber + offered;
+    return offered;
+}
+
+//============================================================================
+// Part of the last offered window the peer may still fill
+//============================================================================
+
+uint16_t TCPConnection::OfferedWindow()
+{
+    uint32_t offered = 0;
+
+    if ((int32_t)(AdvertisedEdge - AcknowledgementNumber) > 0)
+    {
+        offered = AdvertisedEdge - AcknowledgementNumber;
+    }
+    if (offered > CurrentWindow)
+    {
+        offered = CurrentWindow;
+    }
+    return (uint16_t)offered;
 }
 
 //============================================================================
 //
 //============================================================================
 
-void TCPConnection::StoreRxData(DataBuffer* buffer)
+uint16_t TCPConnection::WindowUpdateThreshold()
+{
+    uint16_t rc = RxSize / 2;
+
+    if (rc > MaximumSegmentSize)
+    {
+        rc = MaximumSegmentSize;
+    }
+    return rc;
+}
+
+//============================================================================
+// True once reading has opened the window enough to be worth announcing
+//============================================================================
+
+bool TCPConnection::WindowUpdateRequired()
+{
+    return CurrentWindow - OfferedWindow() >= WindowUpdateThreshold();
+}
+
+//============================================================================
+// Copies as much as fits into the send buffer, returns the number of bytes
+// copied
+//============================================================================
+
+uint16_t TCPConnection::StoreTxData(const uint8_t* data, uint16_t length)
 {
+    uint16_t offset;
     uint16_t i;
 
-    if (buffer->Length > CurrentWindow)
+    if (length > TCP_TX_BUFFER_SIZE - TxCount)
     {
-        printf("Rx window overrun, buffer %d, window %d\n", buffer->Length, CurrentWindow);
-        return;
+        length = TCP_TX_BUFFER_SIZE - TxCount;
     }
 
-    for (i = 0; i < buffer->Length; i++)
+    offset = TxOutOffset + TxCount;
+    if (offset >= TCP_TX_BUFFER_SIZE)
+    {
+        offset -= TCP_TX_BUFFER_SIZE;
+    }
+    for (i = 0; i < length; i++)
     {
-        RxBuffer[RxInOffset++] = buffer->Packet[i];
-        if (RxInOffset >= TCP_RX_WINDOW_SIZE)
+        Storage->Tx[offset++] = data[i];
+        if (offset >= TCP_TX_BUFFER_SIZE)
         {
-            RxInOffset = 0;
+            offset = 0;
+        }
+    }
+    TxCount += length;
+
+    return length;
+}
+
+//============================================================================
+// Sends as much unsent data as the peer window, congestion window, Nagle and
+// cork allow, followed by a pending FIN. Never blocks so it can run on the
+// write, receive and tick paths. Segments due together are built first and
+// handed to IP as one batch of up to TX_BATCH_SIZE frames.
+//============================================================================
+
+void TCPConnection::Output()
+{
+    DataBuffer* batch[TX_BATCH_SIZE];
+    DataBuffer* buffer;
+    uint32_t    unsent;
+    uint32_t    inFlight;
+    uint32_t    window;
+    uint32_t    length;
+    uint32_t    time_us;
+    uint8_t     flags;
+    uint8_t     count = 0;
+    uint8_t     tos   = 0;
+    bool        sent  = false;
+    bool        done  = false;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (State != ESTABLISHED && State != CLOSE_WAIT && State != FIN_WAIT_1 && State != LAST_ACK &&
+        State != SYN_RECEIVED)
+    {
+        // SYN_RECEIVED connections only have data to send when they were
+        // handed over early by fast open
+        done = true;
+    }
+
+    time_us = (uint32_t)osTime::GetTime();
+    while (!done && !FinSent)
+    {
+        unsent   = TxCount - (SequenceNumber - TxSequence);
+        inFlight = SequenceNumber - UnacknowledgedSequence;
+        window   = 0;
+        if ((int32_t)(MaxSequenceTx - SequenceNumber) > 0)
+        {
+            window = MaxSequenceTx - SequenceNumber;
+        }
+        if (inFlight >= CongestionWindow)
+        {
+            window = 0;
+        }
+        else if (window > CongestionWindow - inFlight)
+        {
+            window = CongestionWindow - inFlight;
+        }
+
+        length = unsent;
+        if (length > MaximumSegmentSize)
+        {
+            length = MaximumSegmentSize;
+        }
+        if (length > window)
+        {
+            length = window;
+        }
+
+        if (unsent == 0)
+        {
+            if (inFlight < CongestionWindow)
+            {
+                // Rate samples until this data is delivered reflect the
+                // application, not the network
+                AppLimitedUntil = (Delivered + inFlight) | 1;
+            }
+            if (FinPending && AddSegment(0, FLAG_FIN, time_us) != 0)
+            {
+                // The FIN follows the data batched ahead of it
+                SendBatch(batch, count, tos);
+                count = 0;
+                SendSegment(SequenceNumber, 0, FLAG_FIN);
+                SequenceNumber++;
+                FinSent = true;
+            }
+            TxPushPending = false;
+            done          = true;
+        }
+        else if (length == 0)
+        {
+            // Peer or congestion window is closed. With nothing in flight no
+            // ACK will reopen it, so probe the peer until it does.
+            if (inFlight == 0 && !PersistTimer.Active)
+            {
+                TCP->StartTimer(PersistTimer, time_us + PersistBackoff_us);
+            }
+            done = true;
+        }
+        else if (length < MaximumSegmentSize && length < unsent &&
+                 length < MaxSendWindow / 2 && inFlight > 0)
+        {
+            // Sender side silly window avoidance, wait for the ACKs of the
+            // data in flight to open the window further
+            done = true;
+        }
+        else if (length == unsent && length < MaximumSegmentSize &&
+                 (!TxPushPending || Corked || (NagleEnabled && inFlight > 0)))
+        {
+            // Partial segment held for more data, uncork or Nagle
+            done = true;
+        }
+        else if (PacingEnabled && (int32_t)(NextSendTime_us - time_us) > 0)
+        {
+            // Not yet due, the pace timer resumes output
+            TCP->StartTimer(PaceTimer, NextSendTime_us);
+            done = true;
+        }
+        else if (!Shaper.Conforms(length + TCP_HEADER_SIZE + IP_HEADER_SIZE, time_us))
+        {
+            // Over the shaped rate, the pace timer resumes output once the
+            // bucket holds the segment
+            TCP->StartTimer(
+                PaceTimer,
+                time_us + Shaper.Delay(length + TCP_HEADER_SIZE + IP_HEADER_SIZE, time_us));
+            done = true;
+        }
+        else
+        {
+            flags  = (length == unsent ? FLAG_PSH : 0);
+            buffer = (FreeSegments == 0 ? 0 : BuildSegment(SequenceNumber, length, flags, tos));
+            if (buffer == 0)
+            {
+                // Out of segment records or tx buffers, retry on ACK or Tick
+                done = true;
+            }
+            else
+            {
+                batch[count++] = buffer;
+                if (count == TX_BATCH_SIZE)
+                {
+                    SendBatch(batch, count, tos);
+                    count = 0;
+                }
+                AddSegment(length, flags, time_us);
+                SequenceNumber += length;
+                PaceSegment(length + TCP_HEADER_SIZE + IP_HEADER_SIZE, time_us);
+                Shaper.Consume(length + TCP_HEADER_SIZE + IP_HEADER_SIZE, time_us);
+                sent = true;
+            }
+        }
+    }
+    SendBatch(batch, count, tos);
+    if (sent)
+    {
+        StartProbeTimer(time_us);
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint16_t TCPConnection::TryWrite(const uint8_t* data, uint16_t length)
+{
+    uint16_t count = 0;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (State == ESTABLISHED || State == CLOSE_WAIT || State == SYN_RECEIVED)
+    {
+        count = StoreTxData(data, length);
+        Output();
+        WritableWanted = count < length;
+    }
+    TxLock.Give();
+
+    return count;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::RegisterWritableHandler(WritableHandler handler)
+{
+    Writable = handler;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetEcn(bool enable)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    if (!enable || State == CLOSED || State == LISTEN)
+    {
+        // Only turned on before the SYNs have been exchanged
+        EcnEnabled = enable;
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetFastOpen(bool enable)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    FastOpenEnabled = enable;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetShaper(uint32_t rate, uint32_t burst)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Shaper.Configure(rate, burst);
+    Output();
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetDscp(uint8_t dscp)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Dscp = dscp & (0xFF >> IP_DSCP_SHIFT);
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::SetKeepAlive(uint32_t idle_us, uint32_t interval_us, uint8_t probes)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    KeepAliveIdle_us     = idle_us;
+    KeepAliveInterval_us = interval_us;
+    KeepAliveProbes      = probes;
+    if (State != CLOSED && State != LISTEN && State != SYN_SENT && !KeepAliveTimer.Active)
+    {
+        StartKeepAlive();
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// The timer is not restarted for every segment received. Receiving only
+// records the time and the timer re-arms itself from that when it expires,
+// so busy connections cost one expiry per idle period.
+//============================================================================
+
+void TCPConnection::StartKeepAlive()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    LastReceive_us = (uint32_t)osTime::GetTime();
+    KeepAliveSent  = 0;
+    if (KeepAliveIdle_us != 0)
+    {
+        TCP->StartTimer(KeepAliveTimer, LastReceive_us + KeepAliveIdle_us);
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Decided under TxLock so the state and probe count cannot change while a
+// probe is sent or the connection aborted
+//============================================================================
+
+void TCPConnection::KeepAliveTimeout()
+{
+    uint32_t time_us;
+    uint32_t idle_us;
+
+    TxLock.Take(__FILE__, __LINE__);
+    time_us = (uint32_t)osTime::GetTime();
+    idle_us = time_us - LastReceive_us;
+    if (State == CLOSED || State == LISTEN || State == TIMED_WAIT || KeepAliveIdle_us == 0)
+    {
+        // Nothing to keep alive, the timer stays stopped
+        KeepAliveSent = 0;
+    }
+    else if (idle_us < KeepAliveIdle_us)
+    {
+        // Heard from the peer since the timer was set
+        KeepAliveSent = 0;
+        TCP->StartTimer(KeepAliveTimer, LastReceive_us + KeepAliveIdle_us);
+    }
+    else if (KeepAliveSent >= KeepAliveProbes)
+    {
+        printf("TCP keepalive, no reply from peer for %u us\n", idle_us);
+        Abort();
+    }
+    else
+    {
+        // SND.NXT - 1 is outside the peer's window, so it answers with an
+        // ACK (RFC 1122 4.2.3.6)
+        SendSegment(SequenceNumber - 1, 0, 0);
+        KeepAliveSent++;
+        Stats.KeepAliveProbes++;
+        TCP->StartTimer(KeepAliveTimer, time_us + KeepAliveInterval_us);
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Resets the connection and wakes any reader or writer waiting on it
+//============================================================================
+
+void TCPConnection::Abort()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    if (State != CLOSED && State != LISTEN)
+    {
+        SendFlags(FLAG_RST);
+        Terminate();
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Closes the connection without a word to the peer, for when the peer has
+// reset it, and wakes any reader or writer waiting on it
+//============================================================================
+
+void TCPConnection::Terminate()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    State = CLOSED;
+    StopTimers();
+    RxEvent.Notify();
+    TxEvent.Notify();
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::StopTimers()
+{
+    TCP->StopTimer(PaceTimer);
+    TCP->StopTimer(PersistTimer);
+    TCP->StopTimer(KeepAliveTimer);
+    TCP->StopTimer(ReorderTimer);
+    TCP->StopTimer(ProbeTimer);
+}
+
+//============================================================================
+// Persist timer, sends a zero window probe and backs off exponentially. The
+// probe repeats the last acknowledged sequence number so the peer answers
+// with an ACK carrying its current window.
+//============================================================================
+
+void TCPConnection::PersistTimeout()
+{
+    uint32_t time_us = (uint32_t)osTime::GetTime();
+
+    TxLock.Take(__FILE__, __LINE__);
+    if ((State == ESTABLISHED || State == CLOSE_WAIT || State == FIN_WAIT_1 ||
+         State == LAST_ACK) &&
+        SequenceNumber == UnacknowledgedSequence &&
+        TxCount != SequenceNumber - TxSequence &&
+        (int32_t)(MaxSequenceTx - SequenceNumber) <= 0)
+    {
+        SendSegment(SequenceNumber - 1, 0, 0);
+        Stats.ZeroWindowProbes++;
+
+        PersistBackoff_us *= 2;
+        if (PersistBackoff_us > TCP_PERSIST_MAX_US)
+        {
+            PersistBackoff_us = TCP_PERSIST_MAX_US;
+        }
+        TCP->StartTimer(PersistTimer, time_us + PersistBackoff_us);
+    }
+    else
+    {
+        Output();
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::Write(const uint8_t* data, uint16_t length)
+{
+    uint16_t count;
+
+    TxLock.Take(__FILE__, __LINE__);
+    while (length > 0 && (State == ESTABLISHED || State == CLOSE_WAIT || State == SYN_RECEIVED))
+    {
+        count = TryWrite(data, length);
+        data += count;
+        length -= count;
+
+        if (length > 0)
+        {
+            // Send buffer is full, wait for the peer to acknowledge some of it
+            TxLock.Give();
+            TxEvent.Wait(__FILE__, __LINE__);
+            TxLock.Take(__FILE__, __LINE__);
         }
     }
-    CurrentWindow -= buffer->Length;
-    RxBufferEmpty = false;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::Flush()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    TxPushPending = true;
+    Output();
+    TxLock.Give();
+}
+
+//============================================================================
+// Queues a FIN after everything written so far, regardless of Nagle and cork
+//============================================================================
+
+void TCPConnection::SendFin()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    Corked        = false;
+    TxPushPending = true;
+    FinPending    = true;
+    Output();
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::Close()
+{
+    switch (State)
+    {
+    case LISTEN:
+    case SYN_SENT: State = CLOSED; break;
+    case SYN_RECEIVED:
+    case ESTABLISHED:
+        State = FIN_WAIT_1;
+        SendFin();
+        break;
+    case CLOSE_WAIT:
+        State = LAST_ACK;
+        SendFin();
+        break;
+    default: break;
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* TCPConnection::Listen()
+{
+    TCPConnection* connection = TCP->Accept(this);
+
+    while (connection == 0)
+    {
+        RxEvent.Wait(__FILE__, __LINE__);
+        connection = TCP->Accept(this);
+    }
+
+    return connection;
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TCPConnection::Connect(const uint8_t* data, uint16_t length)
+{
+    uint64_t start = osTime::GetTime();
+    uint64_t elapsed;
+    uint16_t stored = 0;
+    uint16_t synLength = 0;
+    bool     rc;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (State == SYN_SENT && SequenceNumber == UnacknowledgedSequence)
+    {
+        // Offer SACK, the SYN-ACK says whether the peer agrees
+        SackEnabled          = true;
+        FastOpenOption       = FastOpenEnabled;
+        FastOpenCookieLength = 0;
+        if (FastOpenEnabled && TCP->FindFastOpenCookie(RemoteAddress, FastOpenCookie))
+        {
+            FastOpenCookieLength = TCP_FAST_OPEN_COOKIE_SIZE;
+        }
+        if (length > 0)
+        {
+            stored        = StoreTxData(data, length);
+            TxPushPending = true;
+        }
+        if (FastOpenCookieLength != 0)
+        {
+            synLength = MaximumSegmentSize - TCP_SYN_OPTIONS_SIZE;
+            if (synLength > TxCount)
+            {
+                synLength = TxCount;
+            }
+        }
+
+        if (AddSegment(synLength, FLAG_SYN, (uint32_t)start) != 0)
+        {
+            // If no tx buffer is available the retransmit timer sends it later
+            SendSegment(SequenceNumber, synLength, FLAG_SYN);
+            SequenceNumber += synLength + 1;
+        }
+    }
+    TxLock.Give();
+
+    elapsed = 0;
+    while (State == SYN_SENT && elapsed < TCP_CONNECT_TIMEOUT_US)
+    {
+        RxEvent.Wait(__FILE__, __LINE__, (int)((TCP_CONNECT_TIMEOUT_US - elapsed + 999) / 1000));
+        elapsed = osTime::GetTime() - start;
+    }
+    if (State == SYN_SENT)
+    {
+        printf("TCP connect, no answer from peer\n");
+        Abort();
+    }
+
+    rc = (State == ESTABLISHED || State == CLOSE_WAIT);
+    if (rc && stored < length)
+    {
+        Write(data + stored, length - stored);
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+int TCPConnection::Read()
+{
+    int rc = -1;
+
+    TxLock.Take(__FILE__, __LINE__);
+    // Once the peer's FIN is in, or the connection is gone, nothing more
+    // arrives and an empty buffer is the end of the stream
+    while (RxBufferEmpty && (State == SYN_SENT || State == SYN_RECEIVED || State == ESTABLISHED ||
+                             State == FIN_WAIT_1 || State == FIN_WAIT_2))
+    {
+        if (LastAck != AcknowledgementNumber)
+        {
+            SendFlags(FLAG_ACK);
+        }
+        TxLock.Give();
+        RxEvent.Wait(__FILE__, __LINE__);
+        TxLock.Take(__FILE__, __LINE__);
+    }
+
+    // An empty buffer here means the stream ended or was reset
+    if (!RxBufferEmpty)
+    {
+        rc = TakeRxByte();
+
+        if (WindowUpdateRequired())
+        {
+            // Tell the peer now rather than when the next segment or tick
+            // happens to carry the larger window
+            SendFlags(FLAG_ACK);
+        }
+    }
+    TxLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+// Removes the oldest byte from the receive buffer, which must not be empty.
+// Called with TxLock held.
+//============================================================================
+
+uint8_t TCPConnection::TakeRxByte()
+{
+    uint8_t rc;
+
+    rc = Storage->RxPages[RxOutOffset / TCP_RX_WINDOW_SIZE][RxOutOffset % TCP_RX_WINDOW_SIZE];
+    RxOutOffset++;
+    if (RxOutOffset >= RxSize)
+    {
+        RxOutOffset = 0;
+    }
+    CurrentWindow++;
+
+    if (RxOutOffset == RxInOffset)
+    {
+        RxBufferEmpty = true;
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TCPConnection::PostReceive(uint8_t* data, uint16_t size)
+{
+    PostedBuffer* posted;
+    uint8_t       next;
+    bool          rc = false;
+
+    TxLock.Take(__FILE__, __LINE__);
+    next = (PostIn + 1) % TCP_RX_POST_COUNT;
+    if (next != PostOut && size > 0 && Storage != 0)
+    {
+        posted           = &Posted[PostIn];
+        posted->Data     = data;
+        posted->Size     = size;
+        posted->Length   = 0;
+        posted->Complete = false;
+        PostIn           = next;
+        rc               = true;
+
+        // Data that arrived before the buffer was posted comes first
+        FillPosted(false);
+
+        if (WindowUpdateRequired())
+        {
+            SendFlags(FLAG_ACK);
+        }
+    }
+    TxLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint16_t TCPConnection::WaitReceive(uint8_t** data)
+{
+    PostedBuffer* posted;
+    uint16_t      rc = 0;
+
+    *data = 0;
+    TxLock.Take(__FILE__, __LINE__);
+    if (PostOut != PostIn)
+    {
+        posted = &Posted[PostOut];
+        while (!posted->Complete && (State == SYN_SENT || State == SYN_RECEIVED ||
+                                     State == ESTABLISHED || State == FIN_WAIT_1 ||
+                                     State == FIN_WAIT_2))
+        {
+            if (LastAck != AcknowledgementNumber)
+            {
+                SendFlags(FLAG_ACK);
+            }
+            TxLock.Give();
+            RxEvent.Wait(__FILE__, __LINE__);
+            TxLock.Take(__FILE__, __LINE__);
+        }
+        if (!posted->Complete && PostFill == PostOut)
+        {
+            // The peer has stopped sending, hand back what there is
+            posted->Complete = true;
+            PostFill         = (PostFill + 1) % TCP_RX_POST_COUNT;
+        }
+        *data   = posted->Data;
+        rc      = posted->Length;
+        PostOut = (PostOut + 1) % TCP_RX_POST_COUNT;
+    }
+    TxLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+int TCPConnection::ReadLine(char* buffer, int size)
+{
+    int  i;
+    char c;
+    bool done           = false;
+    int  bytesProcessed = 0;
+
+    while (!done)
+    {
+        i = Read();
+        if (i == -1)
+        {
+            *buffer = 0;
+            break;
+        }
+        c = (char)i;
+        bytesProcessed++;
+        switch (c)
+        {
+        case '\r': *buffer++ = 0; break;
+        case '\n':
+            *buffer++ = 0;
+            done      = true;
+            break;
+        default: *buffer++ = c; break;
+        }
+
+        if (bytesProcessed == size)
+        {
+            break;
+        }
+    }
+
+    *buffer = 0;
+    return bytesProcessed;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::Tick()
+{
+    int      i;
+    Segment* segment;
+    uint32_t currentTime_us;
+
+    currentTime_us = (int32_t)osTime::GetTime();
+
+    // Check for retransmit timeout, only the oldest segment is resent
+    TxLock.Take(__FILE__, __LINE__);
+    segment = RetransmitHead;
+    if (segment != 0 && currentTime_us - RetransmitTime_us >= TCP_RETRANSMIT_TIMEOUT_US)
+    {
+        printf("TCP retransmit timeout, segment end %u, waited %u us\n",
+               segment->EndSequence,
+               currentTime_us - RetransmitTime_us);
+        RetransmitTime_us = currentTime_us;
+        if (!InRecovery)
+        {
+            // RACK losses found in this flight are already counted
+            InRecovery       = true;
+            RecoverySequence = SequenceNumber;
+        }
+        CongestionTimeout();
+        RetransmitSegment(segment, currentTime_us);
+    }
+    TxLock.Give();
+
+    // Check for TIMED_WAIT timeouts
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        if (TCP->ConnectionList[i].State == TIMED_WAIT)
+        {
+            if (currentTime_us - TCP->ConnectionList[i].Time_us >= TCP_TIMED_WAIT_TIMEOUT_US)
+            {
+                TCP->ConnectionList[i].State = CLOSED;
+            }
+        }
+    }
+
+    Output();
+
+    // Check for delayed ACK
+    if (LastAck != AcknowledgementNumber &&
+        currentTime_us - DelayedAckTime_us >= DelayedAckTimeout_us)
+    {
+        SendFlags(FLAG_ACK);
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::CalculateRTT(int32_t M)
+{
+    int32_t err;
+
+    if (MinRTT_us == 0 || (uint32_t)M < MinRTT_us)
+    {
+        MinRTT_us = M;
+    }
+
+    if (RTT_us == 0)
+    {
+        // First sample
+        RTT_us       = M;
+        RTTDeviation = M / 2;
+    }
+    else
+    {
+        err = M - RTT_us;
+
+        // Gain is 0.125
+        RTT_us = RTT_us + (125 * err) / 1000;
+
+        if (err < 0)
+        {
+            err = -err;
+        }
+
+        // Gain is 0.250
+        RTTDeviation = RTTDeviation + (250 * (err - (int32_t)RTTDeviation)) / 1000;
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TCPConnection::StoreRxData(DataBuffer* buffer, bool push)
+{
+    uint16_t i = 0;
+    uint32_t count;
+
+    // Read changes the window from the application thread
+    TxLock.Take(__FILE__, __LINE__);
+    if (buffer->Length > CurrentWindow)
+    {
+        printf("Rx window overrun, buffer %d, window %d\n", buffer->Length, CurrentWindow);
+        TxLock.Give();
+        return false;
+    }
+
+    if (RxBufferEmpty && OutOfOrderStart == OutOfOrderEnd)
+    {
+        // Nothing is waiting ahead of this data, posted buffers take it
+        // directly and only what they have no room for goes to the ring
+        i = PlaceRxData(buffer->Packet, buffer->Length, push);
+    }
+    if (i < buffer->Length)
+    {
+        CurrentWindow -= buffer->Length - i;
+        RxBufferEmpty = false;
+    }
+    for (; i < buffer->Length; i++)
+    {
+        Storage->RxPages[RxInOffset / TCP_RX_WINDOW_SIZE][RxInOffset % TCP_RX_WINDOW_SIZE] =
+            buffer->Packet[i];
+        RxInOffset++;
+        if (RxInOffset >= RxSize)
+        {
+            RxInOffset = 0;
+        }
+    }
+    RxSpaceBytes += buffer->Length;
+    AcknowledgementNumber += buffer->Length;
+
+    if (OutOfOrderStart != OutOfOrderEnd &&
+        (int32_t)(AcknowledgementNumber - OutOfOrderStart) >= 0)
+    {
+        // The hole is filled, the held data follows in the ring already
+        if ((int32_t)(OutOfOrderEnd - AcknowledgementNumber) > 0)
+        {
+            count      = OutOfOrderEnd - AcknowledgementNumber;
+            RxInOffset = (RxInOffset + count) % RxSize;
+            CurrentWindow -= count;
+            RxSpaceBytes += count;
+            AcknowledgementNumber = OutOfOrderEnd;
+        }
+        OutOfOrderStart = OutOfOrderEnd;
+        FillPosted(push);
+    }
+    TxLock.Give();
+
+    return true;
+}
+
+//============================================================================
+// Holds data that arrived ahead of a missing segment at its place in the
+// receive ring, where the in order data will reach it. Only one range is
+// held, data that neither overlaps nor adjoins it is dropped for the peer to
+// send again, as is any that falls outside the window. Returns true if the
+// data was held.
+//============================================================================
+
+bool TCPConnection::StoreOutOfOrder(DataBuffer* buffer, uint32_t sequence)
+{
+    uint32_t offset = sequence - AcknowledgementNumber;
+    uint32_t end    = sequence + buffer->Length;
+    uint32_t position;
+    uint16_t i;
+    bool     rc = false;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (Storage != 0 && (int32_t)offset > 0 && offset + buffer->Length <= CurrentWindow &&
+        (OutOfOrderStart == OutOfOrderEnd || ((int32_t)(sequence - OutOfOrderEnd) <= 0 &&
+                                              (int32_t)(end - OutOfOrderStart) >= 0)))
+    {
+        position = (RxInOffset + offset) % RxSize;
+        for (i = 0; i < buffer->Length; i++)
+        {
+            Storage->RxPages[position / TCP_RX_WINDOW_SIZE][position % TCP_RX_WINDOW_SIZE] =
+                buffer->Packet[i];
+            position++;
+            if (position >= RxSize)
+            {
+                position = 0;
+            }
+        }
+        if (OutOfOrderStart == OutOfOrderEnd)
+        {
+            OutOfOrderStart = sequence;
+            OutOfOrderEnd   = end;
+        }
+        else
+        {
+            if ((int32_t)(sequence - OutOfOrderStart) < 0)
+            {
+                OutOfOrderStart = sequence;
+            }
+            if ((int32_t)(end - OutOfOrderEnd) > 0)
+            {
+                OutOfOrderEnd = end;
+            }
+        }
+        rc = true;
+    }
+    TxLock.Give();
+
+    return rc;
+}
+
+//============================================================================
+// Moves data waiting in the receive ring into the posted buffers, completing
+// each one that fills up and, if 'push' is set, the one the data ends in.
+// Called with TxLock held.
+//============================================================================
+
+void TCPConnection::FillPosted(bool push)
+{
+    PostedBuffer* posted;
+
+    while (!RxBufferEmpty && PostFill != PostIn)
+    {
+        posted = &Posted[PostFill];
+        while (!RxBufferEmpty && posted->Length < posted->Size)
+        {
+            posted->Data[posted->Length++] = TakeRxByte();
+        }
+        if (posted->Length == posted->Size || push)
+        {
+            posted->Complete = true;
+            PostFill         = (PostFill + 1) % TCP_RX_POST_COUNT;
+        }
+    }
+}
+
+//============================================================================
+// Copies received data into the posted buffers, completing each one that
+// fills up and, for a segment with PSH or FIN, the one holding its last byte.
+// Returns the number of bytes placed.
+//============================================================================
+
+uint16_t TCPConnection::PlaceRxData(const uint8_t* data, uint16_t length, bool push)
+{
+    PostedBuffer* posted;
+    uint16_t      count;
+    uint16_t      rc = 0;
+
+    while (rc < length && PostFill != PostIn)
+    {
+        posted = &Posted[PostFill];
+        count  = posted->Size - posted->Length;
+        if (count > length - rc)
+        {
+            count = length - rc;
+        }
+        memcpy(posted->Data + posted->Length, data + rc, count);
+        posted->Length += count;
+        rc += count;
+        if (posted->Length == posted->Size || (push && rc == length))
+        {
+            posted->Complete = true;
+            PostFill         = (PostFill + 1) % TCP_RX_POST_COUNT;
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// Releases send buffer space and segment records covered by the peer's
+// cumulative acknowledgement, marks segments covered by SACK blocks in the
+// options and runs RACK loss detection over what is left
+//============================================================================
+
+void TCPConnection::AcknowledgeData(uint32_t       acknowledgementNumber,
+                                    const uint8_t* options,
+                                    uint8_t        optionLength,
+                                    uint32_t       time_us)
+{
+    Segment*      segment;
+    Segment*      newest = 0;
+    TCPRateSample sample;
+    uint32_t      acked  = 0;
+    uint32_t      trimmed;
+    bool          writable  = false;
+    bool          delivered = false;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if ((int32_t)(acknowledgementNumber - UnacknowledgedSequence) > 0 &&
+        (int32_t)(acknowledgementNumber - SequenceNumber) <= 0)
+    {
+        acked                  = acknowledgementNumber - UnacknowledgedSequence;
+        UnacknowledgedSequence = acknowledgementNumber;
+        Delivered += acked;
+        DeliveredTime_us = time_us;
+        if (AppLimitedUntil != 0 && (int32_t)(Delivered - AppLimitedUntil) > 0)
+        {
+            AppLimitedUntil = 0;
+        }
+
+        // New data acked, restart the retransmit timer for what remains
+        RetransmitTime_us = time_us;
+        ProbeSent         = false;
+        if (InRecovery && (int32_t)(acknowledgementNumber - RecoverySequence) >= 0)
+        {
+            InRecovery = false;
+        }
+
+        if ((int32_t)(acknowledgementNumber - TxSequence) > 0)
+        {
+            // Acknowledged SYN and FIN take no space in the send buffer
+            trimmed = acknowledgementNumber - TxSequence;
+            if (trimmed > TxCount)
+            {
+                trimmed = TxCount;
+            }
+            TxOutOffset += trimmed;
+            if (TxOutOffset >= TCP_TX_BUFFER_SIZE)
+            {
+                TxOutOffset -= TCP_TX_BUFFER_SIZE;
+            }
+            TxCount -= trimmed;
+            TxSequence += trimmed;
+        }
+        if (WritableWanted && TxCount <= TCP_TX_BUFFER_SIZE / 2)
+        {
+            WritableWanted = false;
+            writable       = (Writable != 0);
+        }
+        TxEvent.Notify();
+    }
+    while ((segment = RetransmitHead) != 0 &&
+           (int32_t)(acknowledgementNumber - segment->EndSequence) >= 0)
+    {
+        RetransmitHead = segment->Next;
+        if (!segment->Retransmitted)
+        {
+            // Karn's algorithm, a retransmitted segment gives no RTT sample
+            CalculateRTT((int32_t)(time_us - segment->Time_us));
+        }
+        if (!segment->Sacked && RackUpdate(segment, time_us))
+        {
+            delivered = true;
+        }
+        segment->Next = FreeSegments;
+        FreeSegments  = segment;
+        newest        = segment;
+    }
+    if (RetransmitHead == 0)
+    {
+        RetransmitTail = 0;
+    }
+
+    if (acked != 0)
+    {
+        // Delivery rate sample from the most recently sent segment acked, the
+        // interval is the longer of its send and ack phases
+        sample.Delivered      = 0;
+        sample.Interval_us    = 0;
+        sample.PriorDelivered = Delivered - acked;
+        sample.RTT_us         = 0;
+        sample.AppLimited     = false;
+        if (newest != 0)
+        {
+            sample.Delivered      = Delivered - newest->Delivered;
+            sample.Interval_us    = newest->Time_us - newest->FirstSentTime_us;
+            sample.PriorDelivered = newest->Delivered;
+            sample.AppLimited     = newest->AppLimited;
+            if (time_us - newest->DeliveredTime_us > sample.Interval_us)
+            {
+                sample.Interval_us = time_us - newest->DeliveredTime_us;
+            }
+            if (!newest->Retransmitted)
+            {
+                sample.RTT_us = time_us - newest->Time_us;
+            }
+            if (newest->Retransmitted || newest->Length == 0)
+            {
+                // Ambiguous, or a lone SYN or FIN that says nothing about rate
+                sample.Interval_us = 0;
+            }
+            FirstSentTime_us = newest->Time_us;
+        }
+        CongestionAck(acked, sample, time_us);
+    }
+
+    if (SackEnabled && ReceiveSack(options, optionLength, time_us))
+    {
+        delivered = true;
+    }
+    if (delivered)
+    {
+        DetectLoss(time_us);
+    }
+    if (acked != 0)
+    {
+        StartProbeTimer(time_us);
+    }
+    TxLock.Give();
+
+    if (writable)
+    {
+        // Called without TxLock so the handler is free to write
+        Writable(this);
+    }
+}
+
+//============================================================================
+// Takes the peer's MSS and SACK permitted options and its ECN setup flags
+// from its SYN
+//============================================================================
+
+void TCPConnection::ReceiveSynOptions(uint8_t flags, const uint8_t* options, uint8_t length)
+{
+    const uint8_t* option;
+    uint16_t       mss;
+
+    TxLock.Take(__FILE__, __LINE__);
+    option = ProtocolTCP::FindOption(options, length, TCP_OPTION_MSS);
+    if (option != 0 && option[1] == 4)
+    {
+        mss = Unpack16(option, 2);
+        if (mss != 0 && mss < MaximumSegmentSize)
+        {
+            MaximumSegmentSize = mss;
+            CongestionWindow   = TCP_INITIAL_WINDOW_SEGMENTS * MaximumSegmentSize;
+            BBR.Initialize(MaximumSegmentSize, CongestionWindow, (uint32_t)osTime::GetTime());
+        }
+    }
+    SackEnabled = (ProtocolTCP::FindOption(options, length, TCP_OPTION_SACK_PERMITTED) != 0);
+    if ((flags & FLAG_ACK) != 0)
+    {
+        EcnEnabled = EcnEnabled && (flags & (FLAG_ECE | FLAG_CWR)) == FLAG_ECE;
+    }
+    else
+    {
+        EcnEnabled = EcnEnabled && (flags & (FLAG_ECE | FLAG_CWR)) == (FLAG_ECE | FLAG_CWR);
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Writes the options for an outgoing SYN and returns their length. SACK
+// permitted is only offered back to a peer that offered it. A client's fast
+// open option carries its cached cookie or asks for one, a server's carries
+// the cookie for the client.
+//============================================================================
+
+uint8_t TCPConnection::BuildSynOptions(uint8_t* options)
+{
+    uint8_t length = 0;
+
+    length = Pack8(options, length, TCP_OPTION_MSS);
+    length = Pack8(options, length, 4);
+    length = Pack16(options, length, MaximumSegmentSize);
+    if (SackEnabled)
+    {
+        length = Pack8(options, length, TCP_OPTION_NOP);
+        length = Pack8(options, length, TCP_OPTION_NOP);
+        length = Pack8(options, length, TCP_OPTION_SACK_PERMITTED);
+        length = Pack8(options, length, 2);
+    }
+    if (FastOpenOption)
+    {
+        length = Pack8(options, length, TCP_OPTION_NOP);
+        length = Pack8(options, length, TCP_OPTION_NOP);
+        length = Pack8(options, length, TCP_OPTION_FAST_OPEN);
+        length = Pack8(options, length, 2 + FastOpenCookieLength);
+        length = PackBytes(options, length, FastOpenCookie, FastOpenCookieLength);
+    }
+
+    return length;
+}
+
+//============================================================================
+// Marks segments covered by the SACK blocks in an ACK's options. Returns true
+// if any segment was newly delivered.
+//============================================================================
+
+bool TCPConnection::ReceiveSack(const uint8_t* options, uint8_t length, uint32_t time_us)
+{
+    const uint8_t* option = ProtocolTCP::FindOption(options, length, TCP_OPTION_SACK);
+    Segment*       segment;
+    uint32_t       left;
+    uint32_t       right;
+    uint8_t        i;
+    bool           rc = false;
+
+    if (option != 0)
+    {
+        for (i = 2; i + 8 <= option[1]; i += 8)
+        {
+            left  = Unpack32(option, i);
+            right = Unpack32(option, i + 4);
+            for (segment = RetransmitHead; segment != 0; segment = segment->Next)
+            {
+                if (!segment->Sacked && (int32_t)(segment->Sequence - left) >= 0 &&
+                    (int32_t)(right - segment->EndSequence) >= 0)
+                {
+                    segment->Sacked = true;
+                    if (RackUpdate(segment, time_us))
+                    {
+                        rc = true;
+                    }
+                }
+            }
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// Records a delivered segment if it was sent after the one RACK knows of.
+// The ACK of a retransmission arriving sooner than the minimum RTT is taken
+// to be for the original and ignored.
+//============================================================================
+
+bool TCPConnection::RackUpdate(Segment* segment, uint32_t time_us)
+{
+    uint32_t rtt = time_us - segment->Time_us;
+    bool     rc  = false;
+
+    if (!segment->Retransmitted || rtt >= MinRTT_us)
+    {
+        if ((int32_t)(segment->Time_us - RackTime_us) > 0 ||
+            (segment->Time_us == RackTime_us &&
+             (int32_t)(segment->EndSequence - RackEndSequence) > 0))
+        {
+            RackTime_us     = segment->Time_us;
+            RackEndSequence = segment->EndSequence;
+            RackRTT_us      = rtt;
+            rc              = true;
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// RACK loss detection. Segments sent before the most recently delivered one
+// are lost once its RTT plus a reordering window of a quarter of the minimum
+// RTT has passed since they were sent. Those not yet due set the reorder
+// timer. The first loss in a flight reduces the congestion window.
+//============================================================================
+
+void TCPConnection::DetectLoss(uint32_t time_us)
+{
+    Segment* segment;
+    uint32_t reorderWindow = MinRTT_us / 4;
+    int32_t  remaining;
+    int32_t  timeout = 0;
+
+    if (reorderWindow > RTT_us)
+    {
+        reorderWindow = RTT_us;
+    }
+
+    for (segment = RetransmitHead; segment != 0; segment = segment->Next)
+    {
+        if (!segment->Sacked &&
+            ((int32_t)(RackTime_us - segment->Time_us) > 0 ||
+             (segment->Time_us == RackTime_us &&
+              (int32_t)(RackEndSequence - segment->EndSequence) > 0)))
+        {
+            remaining = (int32_t)(segment->Time_us + RackRTT_us + reorderWindow - time_us);
+            if (remaining <= 0)
+            {
+                if (!InRecovery)
+                {
+                    InRecovery       = true;
+                    RecoverySequence = SequenceNumber;
+                    CongestionLoss();
+                }
+                Stats.FastRetransmits++;
+                RetransmitSegment(segment, time_us);
+            }
+            else if (remaining > timeout)
+            {
+                timeout = remaining;
+            }
+        }
+    }
+
+    if (timeout != 0)
+    {
+        TCP->StartTimer(ReorderTimer, time_us + timeout);
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::ReorderTimeout()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    DetectLoss((uint32_t)osTime::GetTime());
+    TxLock.Give();
+}
+
+//============================================================================
+// Arms the tail loss probe two smoothed RTTs out, plus the peer's delayed ACK
+// when only one segment is in flight. The retransmit timer is left to act if
+// it would fire first.
+//============================================================================
+
+void TCPConnection::StartProbeTimer(uint32_t time_us)
+{
+    uint32_t timeout;
+    uint32_t retransmit;
+
+    if (RetransmitHead == 0 || ProbeSent || RTT_us == 0)
+    {
+        TCP->StopTimer(ProbeTimer);
+    }
+    else
+    {
+        timeout = 2 * RTT_us;
+        if (RetransmitHead == RetransmitTail)
+        {
+            timeout += TCP_LOSS_PROBE_ACK_DELAY_US;
+        }
+        retransmit = RetransmitTime_us + TCP_RETRANSMIT_TIMEOUT_US - time_us;
+        if ((int32_t)retransmit <= 0 || timeout >= retransmit)
+        {
+            TCP->StopTimer(ProbeTimer);
+        }
+        else
+        {
+            TCP->StartTimer(ProbeTimer, time_us + timeout);
+        }
+    }
+}
+
+//============================================================================
+// Tail loss probe. Sends one new segment if the peer window has room, else
+// the last segment sent again, so the peer's ACK or SACK shows RACK what at
+// the end of the flight was lost.
+//============================================================================
+
+void TCPConnection::ProbeTimeout()
+{
+    uint32_t time_us = (uint32_t)osTime::GetTime();
+    uint32_t unsent;
+    uint32_t length = 0;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (RetransmitHead != 0 && !ProbeSent && State != CLOSED)
+    {
+        unsent = TxCount - (SequenceNumber - TxSequence);
+        if (!FinSent && (int32_t)(MaxSequenceTx - SequenceNumber) > 0)
+        {
+            length = MaxSequenceTx - SequenceNumber;
+        }
+        if (length > unsent)
+        {
+            length = unsent;
+        }
+        if (length > MaximumSegmentSize)
+        {
+            length = MaximumSegmentSize;
+        }
+
+        if (length != 0 && FreeSegments != 0 && SendSegment(SequenceNumber, length, FLAG_PSH))
+        {
+            AddSegment(length, FLAG_PSH, time_us);
+            SequenceNumber += length;
+        }
+        else
+        {
+            RetransmitSegment(RetransmitTail, time_us);
+        }
+        ProbeSent = true;
+        Stats.LossProbes++;
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Records the peer's advertised window from a segment with ACK set
+//============================================================================
+
+void TCPConnection::UpdateSendWindow(uint32_t acknowledgementNumber, uint16_t window)
+{
+    MaxSequenceTx = acknowledgementNumber + window;
+    if (window > MaxSendWindow)
+    {
+        MaxSendWindow = window;
+    }
+
+    if (window != 0 && PersistBackoff_us != TCP_PERSIST_MIN_US)
+    {
+        // Window is open again, Output stops any running probes
+        PersistBackoff_us = TCP_PERSIST_MIN_US;
+        TCP->StopTimer(PersistTimer);
+    }
+
+    if (window == 0 && ZeroWindowStart_us == 0)
+    {
+        ZeroWindowStart_us = (uint32_t)osTime::GetTime() | 1;
+    }
+    else if (window != 0 && ZeroWindowStart_us != 0)
+    {
+        Stats.ZeroWindowTime_us += (uint32_t)osTime::GetTime() - ZeroWindowStart_us;
+        ZeroWindowStart_us = 0;
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TCPConnection::FinAcknowledged(uint32_t acknowledgementNumber)
+{
+    return FinSent && acknowledgementNumber == SequenceNumber;
+}
+
+//============================================================================
+// Reno style window growth, slow start below the threshold and one segment
+// per round trip above it
+//============================================================================
+
+void TCPConnection::CongestionAck(uint32_t bytes, const TCPRateSample& sample, uint32_t time_us)
+{
+    if (CongestionControl == CONGESTION_BBR)
+    {
+        BBR.OnAck(sample, bytes, Delivered, SequenceNumber - UnacknowledgedSequence, time_us);
+        CongestionWindow = BBR.GetCongestionWindow();
+    }
+    else if (CongestionWindow < SlowStartThreshold)
+    {
+        CongestionWindow += (bytes < MaximumSegmentSize ? bytes : MaximumSegmentSize);
+    }
+    else
+    {
+        CongestionWindow += (MaximumSegmentSize * MaximumSegmentSize) / CongestionWindow;
+    }
+}
+
+//============================================================================
+// Pacing rate in bytes per second, 0 if there is nothing to pace at yet
+//============================================================================
+
+uint32_t TCPConnection::GetPacingRate()
+{
+    uint64_t rate = PacingRate;
+
+    if (rate == 0 && CongestionControl == CONGESTION_BBR)
+    {
+        rate = BBR.GetPacingRate();
+    }
+    if (rate == 0 && RTT_us != 0)
+    {
+        rate = ((uint64_t)CongestionWindow * 1000000) / RTT_us;
+        if (CongestionWindow < SlowStartThreshold)
+        {
+            rate = rate * TCP_PACING_SS_GAIN / 100;
+        }
+        else
+        {
+            rate = rate * TCP_PACING_CA_GAIN / 100;
+        }
+    }
+
+    return rate > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)rate;
+}
+
+//============================================================================
+// Schedules the next transmission one segment time at the pacing rate after
+// this one. Credit left over from an idle period is limited to the slack.
+//============================================================================
+
+void TCPConnection::PaceSegment(uint32_t length, uint32_t time_us)
+{
+    uint32_t rate = GetPacingRate();
+
+    if (rate == 0)
+    {
+        NextSendTime_us = time_us;
+    }
+    else
+    {
+        if ((int32_t)(time_us - NextSendTime_us) > TCP_PACING_SLACK_US)
+        {
+            NextSendTime_us = time_us - TCP_PACING_SLACK_US;
+        }
+        NextSendTime_us += (uint32_t)(((uint64_t)length * 1000000) / rate);
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::CongestionTimeout()
+{
+    uint32_t inFlight = SequenceNumber - UnacknowledgedSequence;
+
+    if (CongestionControl == CONGESTION_BBR)
+    {
+        BBR.OnTimeout();
+        CongestionWindow = BBR.GetCongestionWindow();
+    }
+    else
+    {
+        SlowStartThreshold = inFlight / 2;
+        if (SlowStartThreshold < 2 * MaximumSegmentSize)
+        {
+            SlowStartThreshold = 2 * MaximumSegmentSize;
+        }
+        CongestionWindow = MaximumSegmentSize;
+    }
+}
+
+//============================================================================
+// Client side of the SYN-ACK. Caches any fast open cookie the server gave.
+// If the server did not take the data sent on the SYN, that data is sent
+// again as ordinary data once the connection is up.
+//============================================================================
+
+void TCPConnection::ReceiveSynAck(uint32_t       acknowledgementNumber,
+                                  const uint8_t* options,
+                                  uint8_t        length)
+{
+    const uint8_t* option = ProtocolTCP::FindOption(options, length, TCP_OPTION_FAST_OPEN);
+    Segment*       syn;
+
+    TxLock.Take(__FILE__, __LINE__);
+    if (FastOpenOption && option != 0 && option[1] == 2 + TCP_FAST_OPEN_COOKIE_SIZE)
+    {
+        TCP->SaveFastOpenCookie(RemoteAddress, option + 2);
+    }
+
+    syn = RetransmitHead;
+    if (syn != 0 && (syn->Flags & FLAG_SYN) != 0 && syn->Length != 0 &&
+        (int32_t)(acknowledgementNumber - syn->EndSequence) < 0)
+    {
+        if (option == 0)
+        {
+            // Cookie no longer accepted and no new one given
+            TCP->SaveFastOpenCookie(RemoteAddress, 0);
+        }
+        syn->Length      = 0;
+        syn->EndSequence = syn->Sequence + 1;
+        SequenceNumber   = syn->EndSequence;
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Receiver side ECN. A CE mark is echoed with ECE on every ACK until the peer
+// sends CWR to say it has reduced its window. Returns true for a new mark so
+// the caller acknowledges it straight away.
+//============================================================================
+
+bool TCPConnection::ReceiveEcn(uint8_t flags, uint8_t ecn)
+{
+    bool rc = false;
+
+    if (EcnEnabled)
+    {
+        if ((flags & FLAG_CWR) != 0)
+        {
+            EcnEchoPending = false;
+        }
+        if (ecn == IP_ECN_CE)
+        {
+            Stats.EcnMarks++;
+            rc             = !EcnEchoPending;
+            EcnEchoPending = true;
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+// The peer echoed a CE mark. The window is reduced as for a loss, once per
+// window of data, and CWR goes out on the next new segment.
+//============================================================================
+
+void TCPConnection::EcnEcho()
+{
+    TxLock.Take(__FILE__, __LINE__);
+    if (EcnEnabled && !InRecovery)
+    {
+        InRecovery       = true;
+        RecoverySequence = SequenceNumber;
+        CwrPending       = true;
+        Stats.EcnReductions++;
+        CongestionLoss();
+    }
+    TxLock.Give();
+}
+
+//============================================================================
+// Loss found by RACK or a CE mark echoed by the peer. Reno halves the window
+// once per flight, BBR keeps the rate its model measured.
+//============================================================================
+
+void TCPConnection::CongestionLoss()
+{
+    uint32_t inFlight = SequenceNumber - UnacknowledgedSequence;
+
+    if (CongestionControl != CONGESTION_BBR)
+    {
+        SlowStartThreshold = inFlight / 2;
+        if (SlowStartThreshold < 2 * MaximumSegmentSize)
+        {
+            SlowStartThreshold = 2 * MaximumSegmentSize;
+        }
+        CongestionWindow = SlowStartThreshold;
+    }
+}
+
+//============================================================================
+// Counts in order segments toward the next ACK, a coalesced segment counts
+// for each one merged into it
+//============================================================================
+
+void TCPConnection::ReceivedSegment(uint32_t time_us, uint8_t segments)
+{
+    if (UnackedSegments == 0)
+    {
+        DelayedAckTime_us = time_us;
+    }
+    if (UnackedSegments < 0xFF - segments)
+    {
+        UnackedSegments += segments;
+    }
+    else
+    {
+        UnackedSegments = 0xFF;
+    }
+    TuneReceiveBuffer(time_us);
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TCPConnection::AckRequired()
+{
+    return DelayedAckTimeout_us == 0 ||
+           (DelayedAckSegments != 0 && UnackedSegments >= DelayedAckSegments);
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::GetStatistics(Statistics& stats)
+{
+    TxLock.Take(__FILE__, __LINE__);
+    stats = Stats;
+    if (ZeroWindowStart_us != 0)
+    {
+        stats.ZeroWindowTime_us += (uint32_t)osTime::GetTime() - ZeroWindowStart_us;
+    }
+    stats.RTT_us             = RTT_us;
+    stats.RTTVariance_us     = RTTDeviation;
+    stats.CongestionWindow   = CongestionWindow;
+    stats.SlowStartThreshold = SlowStartThreshold;
+    stats.PacingRate         = PacingEnabled ? GetPacingRate() : 0;
+    stats.PeerWindow         = MaxSequenceTx - UnacknowledgedSequence;
+    stats.BytesInFlight      = SequenceNumber - UnacknowledgedSequence;
+    stats.MaximumSegmentSize = MaximumSegmentSize;
+    stats.ReceiveBuffer      = RxSize;
+    TxLock.Give();
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TCPConnection::ShowStatistics(osPrintfInterface* out)
+{
+    Statistics stats;
+
+    GetStatistics(stats);
+    out->Printf("   in  %10" PRIu64 " bytes %8u segments %6u out of order\n",
+                stats.BytesIn,
+                stats.SegmentsIn,
+                stats.OutOfOrder);
+    out->Printf("   out %10" PRIu64 " bytes %8u segments %6u retransmits %" PRIu64 " bytes\n",
+                stats.BytesOut,
+                stats.SegmentsOut,
+                stats.Retransmits,
+                stats.BytesRetransmitted);
+    out->Printf("   %u fast retransmits  %u loss probes\n",
+                stats.FastRetransmits,
+                stats.LossProbes);
+    out->Printf("   ecn %s  %u marks received  %u window reductions\n",
+                EcnEnabled ? "on" : "off",
+                stats.EcnMarks,
+                stats.EcnReductions);
+    out->Printf("   rtt %u us  rttvar %u us  mss %u  cwnd %u  ssthresh %u  pacing %u B/s\n",
+                stats.RTT_us,
+                stats.RTTVariance_us,
+                stats.MaximumSegmentSize,
+                stats.CongestionWindow,
+                stats.SlowStartThreshold,
+                stats.PacingRate);
+    out->Printf("   peer window %u  in flight %u  zero window %u us %u probes\n",
+                stats.PeerWindow,
+                stats.BytesInFlight,
+                stats.ZeroWindowTime_us,
+                stats.ZeroWindowProbes);
+    out->Printf("   receive buffer %u  keepalive %u probes\n",
+                stats.ReceiveBuffer,
+                stats.KeepAliveProbes);
 }
 
 //============================================================================
@@ -33,8 +33,10 @@
 #define TCPCONNECTION_H
 
 #include <inttypes.h>
+#include "CongestionBBR.hpp"
 #include "Config.hpp"
 #include "ProtocolIPv4.hpp"
+#include "TokenBucket.hpp"
 #include "osEvent.hpp"
 #include "osMutex.hpp"
 #include "osQueue.hpp"
@@ -61,42 +63,376 @@ public:
 
     friend class ProtocolTCP;
 
+    typedef void (*WritableHandler)(TCPConnection*);
+
+    // Per connection counters, kept in one block with the four every
+    // segment updates first. The fields after ZeroWindowTime_us are a
+    // snapshot of live state filled in by GetStatistics.
+    struct Statistics
+    {
+        uint64_t BytesIn;
+        uint64_t BytesOut;
+        uint32_t SegmentsIn;
+        uint32_t SegmentsOut;
+        uint64_t BytesRetransmitted;
+        uint32_t Retransmits;
+        uint32_t FastRetransmits; // Losses found by RACK rather than the retransmit timer
+        uint32_t LossProbes;
+        uint32_t EcnMarks;      // Congestion experienced marks received
+        uint32_t EcnReductions; // Window reductions for the peer's ECN echoes
+        uint32_t OutOfOrder;
+        uint32_t ZeroWindowProbes;
+        uint32_t KeepAliveProbes;
+        uint32_t ZeroWindowTime_us; // Time the peer has advertised a zero window
+
+        uint32_t RTT_us;
+        uint32_t RTTVariance_us;
+        uint32_t CongestionWindow;
+        uint32_t SlowStartThreshold;
+        uint32_t PacingRate;
+        uint32_t PeerWindow;
+        uint32_t BytesInFlight;
+        uint16_t MaximumSegmentSize;
+        uint16_t ReceiveBuffer; // Current size, autotuning grows it from the page pool
+    };
+
+    typedef enum CongestionAlgorithm {
+        CONGESTION_RENO = 0,
+        CONGESTION_BBR
+    } CONGESTION_ALGORITHM;
+
+    // State every segment touches fills the first two cache lines, TxLock
+    // and the counters at the head of Stats the next two. Options, timers
+    // and the rest come after.
     States   State;
     uint16_t LocalPort;
     uint16_t RemotePort;
     uint8_t  RemoteAddress[ProtocolIPv4::ADDRESS_SIZE];
     uint32_t SequenceNumber;
     uint32_t AcknowledgementNumber;
-    uint32_t LastAck;
+    uint32_t UnacknowledgedSequence; // Oldest sequence number not yet acked by the peer
     uint32_t MaxSequenceTx;
+    uint32_t MaxSendWindow;    // Largest window the peer has offered
+    uint32_t CongestionWindow; // Bytes allowed in flight by congestion control
+    uint16_t MaximumSegmentSize;
+
+private:
+    struct Segment;
+    struct Buffers;
+    uint16_t RxInOffset;
+    uint16_t CurrentWindow;
+    uint16_t RxSize;      // Receive buffer size, a multiple of TCP_RX_WINDOW_SIZE
+    uint16_t TxOutOffset; // Offset of TxSequence in the send buffer
+    uint16_t TxCount;     // Bytes in the send buffer
+    bool     RxBufferEmpty;
+    uint8_t  UnackedSegments;
+    uint8_t  DelayedAckSegments;
+    bool     NagleEnabled;
+    bool     Corked;
+    bool     TxPushPending; // Flush was called, partial segments may be sent
+    bool     FinPending;    // Close was called, FIN follows the last byte written
+    bool     FinSent;
+    bool     WritableWanted; // TryWrite came up short, call Writable when space frees
+    bool     PacingEnabled;
+    bool     InRecovery;
+    bool     SackEnabled;       // SACK permitted was exchanged in the SYNs
+    uint32_t AdvertisedEdge;    // Right edge of the last window offered to the peer
+    uint32_t TxSequence;        // Sequence number of the oldest byte in the send buffer
+    uint32_t DelayedAckTime_us; // Arrival time of the oldest unacknowledged segment
+    uint32_t LastReceive_us;    // Only stored on receive, the keepalive timer checks it
+    uint32_t RetransmitTime_us; // Start of the retransmit timer for RetransmitHead
+    uint32_t Delivered;         // Bytes acknowledged over the connection's life
+
+    // Sequence range of out of order data held in the receive ring past the
+    // in order data, nothing is held while the two are equal
+    uint32_t OutOfOrderStart;
+    uint32_t OutOfOrderEnd;
+
+    Segment* FreeSegments;
+    Segment* RetransmitHead;
+    Segment* RetransmitTail;
+    Buffers* Storage;
+
+    osMutex    TxLock;
+    Statistics Stats;
+
+public:
+    uint32_t LastAck;
+    uint32_t SlowStartThreshold;
     uint32_t RTT_us;
     uint32_t RTTDeviation;
     uint32_t Time_us;
 
+public:
     ~TCPConnection();
     void SendFlags(uint8_t flags);
     void           Close();
     TCPConnection* Listen();
+    /// Connect sends a SYN to the peer given to ProtocolTCP::NewClient and
+    /// waits for the connection to be established. With fast open on and a
+    /// cookie cached for the peer, the first part of data rides on the SYN,
+    /// the rest follows once the connection is up. Returns false if the peer
+    /// refused or did not answer within TCP_CONNECT_TIMEOUT_US.
+    bool Connect(const uint8_t* data = 0, uint16_t length = 0);
 
     int Read();
     int ReadLine(char* buffer, int size);
+    /// PostReceive queues an application buffer for data still to come.
+    /// Data already received is moved into it first, after that in-order
+    /// data is copied from the segment straight into posted buffers rather
+    /// than through the receive buffer and Read. Returns false when
+    /// TCP_RX_POST_COUNT buffers are already posted.
+    bool PostReceive(uint8_t* data, uint16_t size);
+    /// WaitReceive waits for the oldest posted buffer to complete, when it is
+    /// full, a segment with PSH or FIN filled part of it or the peer stopped
+    /// sending, and returns the buffer and the number of bytes placed in it.
+    /// Returns 0 and sets data to 0 if no buffer is posted.
+    uint16_t WaitReceive(uint8_t** data);
     void Write(const uint8_t* data, uint16_t length);
+    /// TryWrite queues as much of data as the send buffer has room for and
+    /// returns the number of bytes accepted without waiting. When it accepts
+    /// less than length the writable handler is called from the network
+    /// thread once half the send buffer is free again.
+    uint16_t    TryWrite(const uint8_t* data, uint16_t length);
+    void        RegisterWritableHandler(WritableHandler handler);
     void        Flush();
     const char* GetStateString();
+    void        GetStatistics(Statistics& stats);
+    void        ShowStatistics(osPrintfInterface* out);
+
+    // Per connection transmit and acknowledge policy. Listening connections
+    // pass their options on to the connections they accept.
+
+    /// SetNagle holds back a partial segment while sent data is unacknowledged
+    void SetNagle(bool enable);
+    /// SetCork holds back partial segments until uncorked, uncorking sends them
+    void SetCork(bool enable);
+    /// SetDelayedAckTimeout sets the longest time received data goes unacknowledged.
+    /// The timeout is checked from Tick so its resolution is the Tick interval,
+    /// a timeout of 0 acknowledges every segment immediately.
+    void SetDelayedAckTimeout(uint32_t timeout_us);
+    /// SetAckFrequency acknowledges at least every 'segments' in-order segments,
+    /// 0 leaves acknowledgement to the delayed ACK timeout
+    void SetAckFrequency(uint8_t segments);
+    /// SetPacing spreads segments out at the pacing rate instead of sending
+    /// each window as a back to back burst. Off by default, the timers only
+    /// wake every millisecond so faster links see bursts of a millisecond's
+    /// worth anyway. BBR sets its rate for pacing and works best with it on.
+    void SetPacing(bool enable);
+    /// SetPacingRate fixes the pacing rate in bytes per second, 0 derives it
+    /// from the congestion window and smoothed RTT
+    void SetPacingRate(uint32_t bytesPerSecond);
+    /// SetCongestionControl picks loss based Reno or model based BBR, which
+    /// keeps its rate through random loss
+    void SetCongestionControl(CongestionAlgorithm algorithm);
+    /// SetKeepAlive probes a peer that has sent nothing for idle_us, every
+    /// interval_us, and resets the connection after 'probes' go unanswered.
+    /// An idle_us of 0 disables keepalive.
+    void SetKeepAlive(uint32_t idle_us, uint32_t interval_us, uint8_t probes);
+    /// SetEcn offers ECN when the connection is set up. When the peer agrees,
+    /// routers mark congestion instead of dropping and the window is reduced
+    /// as it would be for a loss.
+    void SetEcn(bool enable);
+    /// SetFastOpen lets a listener accept data on the SYN of clients holding
+    /// a valid cookie and hand them over before the handshake completes, and
+    /// lets a client send data on its SYN to servers it has a cookie for.
+    /// Only use it where repeating the first request would be harmless.
+    void SetFastOpen(bool enable);
+    /// SetShaper caps the connection's send rate at 'rate' bytes per second
+    /// with bursts of up to 'burst' bytes, a rate of 0 removes the cap. Data
+    /// over the rate stays in the send buffer and the pace timer sends it
+    /// when the bucket allows, writers are not held up beyond a full send
+    /// buffer. Retransmissions are counted but never held back.
+    void SetShaper(uint32_t rate, uint32_t burst);
+    /// SetDscp marks the connection's segments with a DSCP, IP_DSCP_EF for
+    /// example. Expedited and network control classes also go ahead of other
+    /// connections in the MAC's transmit queues.
+    void SetDscp(uint8_t dscp);
 
 private:
-    uint16_t RxInOffset;
-    uint16_t RxOutOffset;
-    uint16_t TxOffset; // Offset into Data used by Write() method
-    uint16_t CurrentWindow;
+    // An entry in ProtocolTCP's timer list. Handler runs on the thread that
+    // calls ProtocolTCP::Tick.
+    struct Timer
+    {
+        Timer*         Next;
+        Timer*         Prev;
+        TCPConnection* Connection;
+        void (TCPConnection::*Handler)();
+        uint32_t Expire_us;
+        bool     Active;
+    };
+
+    // A sent segment waiting to be acknowledged. Data segments are rebuilt
+    // from the send buffer when retransmitted so no DataBuffer is held while
+    // in flight.
+    struct Segment
+    {
+        Segment* Next;
+        uint32_t Sequence;
+        uint32_t EndSequence; // Sequence number following the segment
+        uint32_t Time_us;     // Time of the latest transmission
+        uint16_t Length; // Bytes of data, SYN and FIN are in Flags
+        uint8_t  Flags;
+        bool     Retransmitted;
+        bool     Sacked;
+        bool     AppLimited;
+
+        // Connection delivery state when sent, for delivery rate samples
+        uint32_t Delivered;
+        uint32_t DeliveredTime_us;
+        uint32_t FirstSentTime_us;
+    };
+
+    // Buffers and segment records of a connection carrying data. ProtocolTCP
+    // lends them out of a pool as connections open, so listeners and
+    // connections in TIMED_WAIT do without.
+    struct Buffers
+    {
+        Buffers* Next; // Pool free list
+        // The receive buffer is a ring over RxSize bytes of pages, Rx first
+        // and then those taken from ProtocolTCP's page pool as it grew
+        uint8_t  Rx[TCP_RX_WINDOW_SIZE];
+        uint8_t* RxPages[TCP_RX_PAGES_MAX];
+        // Bytes written by the application and not yet acknowledged by the
+        // peer. Packets are only built from here when the peer and congestion
+        // windows allow, so a slow peer holds send buffer space rather than
+        // MAC tx buffers.
+        uint8_t Tx[TCP_TX_BUFFER_SIZE];
+        // Sent segments waiting to be acknowledged, linked in sequence order
+        // so cumulative ACKs trim from the head and the retransmit timer only
+        // looks at the oldest segment
+        Segment Segments[TCP_TX_SEGMENT_COUNT];
+    };
+    void     AttachBuffers(Buffers*);
+    Buffers* DetachBuffers();
+    uint16_t RxOutOffset; // Next byte Read takes from the receive ring
+
+    // Receive buffer autotuning. Once an RTT the bytes received in that time
+    // are compared with the buffer, which grows to twice that amount so the
+    // window never holds the sender back.
+    void     TuneReceiveBuffer(uint32_t time_us);
+    bool     GrowReceiveBuffer(uint32_t size, uint32_t time_us);
+    bool     ReceiveBufferCanGrow(uint32_t size);
+    uint16_t ReleaseRxPages();
+    uint16_t DropRxPages(uint16_t keep);
+    uint32_t RxSpaceTime_us; // Start of the current measurement
+    uint32_t RxSpaceBytes;   // Bytes received since RxSpaceTime_us
+    bool     RxShrinking;    // Pages are wanted back, the offered window may not grow past one
+
+    // Buffers posted by the application. PostIn is where the next one is
+    // posted, PostFill the one data is placed in and PostOut the oldest not
+    // yet handed back by WaitReceive. Changed only with TxLock held.
+    struct PostedBuffer
+    {
+        uint8_t* Data;
+        uint16_t Size;
+        uint16_t Length;
+        bool     Complete;
+    };
+    PostedBuffer Posted[TCP_RX_POST_COUNT];
+    uint8_t      PostIn;
+    uint8_t      PostFill;
+    uint8_t      PostOut;
+
+    uint16_t ReceiveWindow();
+    uint16_t OfferedWindow();
+    uint16_t WindowUpdateThreshold();
+    bool     WindowUpdateRequired();
+    bool     StoreRxData(DataBuffer* buffer, bool push);
+    uint16_t PlaceRxData(const uint8_t* data, uint16_t length, bool push);
+    bool     StoreOutOfOrder(DataBuffer* buffer, uint32_t sequence);
+    void     FillPosted(bool push);
+    uint8_t  TakeRxByte();
+    void AcknowledgeData(uint32_t       acknowledgementNumber,
+                         const uint8_t* options,
+                         uint8_t        optionLength,
+                         uint32_t       time_us);
+    void UpdateSendWindow(uint32_t acknowledgementNumber, uint16_t window);
+    bool FinAcknowledged(uint32_t acknowledgementNumber);
+
+    uint32_t DelayedAckTimeout_us;
+    uint32_t NextSendTime_us; // Earliest time the pacer lets the next segment go
+    uint32_t PacingRate; // Bytes per second, 0 derives the rate from cwnd and RTT
+    Timer    PaceTimer;
+    Timer    PersistTimer;
+    uint32_t PersistBackoff_us;
+    Timer    KeepAliveTimer;
+    uint32_t KeepAliveIdle_us;
+    uint32_t KeepAliveInterval_us;
+    uint8_t  KeepAliveProbes;
+    uint8_t  KeepAliveSent; // Probes sent since the peer was last heard from
+
+    TokenBucket Shaper; // Send rate cap, the pace timer releases held data
+
+    // RACK loss detection, a segment is lost once one sent after it has been
+    // delivered and a reordering window has passed. The tail loss probe
+    // gets an ACK out of the peer when the end of a flight is lost.
+    uint32_t MinRTT_us;        // Smallest RTT seen, sets the reordering window
+    uint32_t RackTime_us;      // Send time of the most recently sent segment delivered
+    uint32_t RackEndSequence;  // and its end, breaking ties between equal send times
+    uint32_t RackRTT_us;       // RTT measured on that segment
+    uint32_t RecoverySequence; // Recovery ends when this is acknowledged
+    bool     ProbeSent; // A loss probe is out, no more until new data is acked
+    Timer    ReorderTimer;
+    Timer    ProbeTimer;
+    bool     EcnEnabled;     // Set by SetEcn, cleared if the peer does not negotiate it
+    bool     EcnEchoPending; // Received CE, set ECE on ACKs until the peer sends CWR
+    bool     CwrPending;     // Reduced the window for ECE, set CWR on the next data
+    uint8_t  Dscp;           // Set by SetDscp, the high bits of every segment's ToS
+    bool     FastOpenEnabled;
+    bool     FastOpenOption;       // Put a fast open option on the SYN
+    uint8_t  FastOpenCookieLength; // 0 asks the server for a cookie
+    uint8_t  FastOpenCookie[TCP_FAST_OPEN_COOKIE_SIZE];
+
+    CongestionAlgorithm CongestionControl;
+    CongestionBBR       BBR;
+    uint32_t            DeliveredTime_us; // Time Delivered last advanced
+    uint32_t            FirstSentTime_us; // Send time of the segment starting the current interval
+    uint32_t            AppLimitedUntil;  // Non zero while rate samples are application limited
+
+    uint32_t ZeroWindowStart_us; // Non zero while the peer window is closed
+
+    WritableHandler Writable;
+
+    void SetDefaultOptions();
+    void CopyOptions(const TCPConnection&);
+    void ReceivedSegment(uint32_t time_us, uint8_t segments);
+    bool AckRequired();
 
-    DataBuffer* TxBuffer;
-    uint8_t     RxBuffer[TCP_RX_WINDOW_SIZE];
-    bool        RxBufferEmpty;
-    void StoreRxData(DataBuffer* buffer);
+    void     InitializeTx(uint32_t initialSequence);
+    uint16_t StoreTxData(const uint8_t* data, uint16_t length);
+    void     Output();
+    void     PersistTimeout();
+    void     StartKeepAlive();
+    void     KeepAliveTimeout();
+    void     Abort();
+    void     Terminate();
+    void     StopTimers();
+    void     SendFin();
+    bool     SendSegment(uint32_t sequence, uint16_t length, uint8_t flags);
+    void     RetransmitSegment(Segment* segment, uint32_t time_us);
+    Segment* AddSegment(uint16_t length, uint8_t flags, uint32_t time_us);
+    void     CongestionAck(uint32_t bytes, const TCPRateSample& sample, uint32_t time_us);
+    void     CongestionTimeout();
+    void     CongestionLoss();
+    void     ReceiveSynOptions(uint8_t flags, const uint8_t* options, uint8_t length);
+    bool     ReceiveEcn(uint8_t flags, uint8_t ecn);
+    void     ReceiveSynAck(uint32_t acknowledgementNumber, const uint8_t* options, uint8_t length);
+    void     EcnEcho();
+    uint8_t  BuildSynOptions(uint8_t* options);
+    bool     ReceiveSack(const uint8_t* options, uint8_t length, uint32_t time_us);
+    bool     RackUpdate(Segment* segment, uint32_t time_us);
+    void     DetectLoss(uint32_t time_us);
+    void     ReorderTimeout();
+    void     StartProbeTimer(uint32_t time_us);
+    void     ProbeTimeout();
+    uint32_t GetPacingRate();
+    void     PaceSegment(uint32_t length, uint32_t time_us);
 
     DataBuffer* GetTxBuffer();
-    void BuildPacket(DataBuffer*, uint8_t flags);
+    DataBuffer* BuildSegment(uint32_t sequence, uint16_t length, uint8_t flags, uint8_t& tos);
+    uint8_t     BuildHeader(DataBuffer*, uint32_t sequence, uint8_t flags, uint8_t optionLength);
+    void        SendBatch(DataBuffer** batch, uint8_t count, uint8_t tos);
     void CalculateRTT(int32_t msRTT);
     void SetMAC(InterfaceMAC* mac);
 
@@ -104,10 +440,8 @@ private:
     TCPConnection* NewConnection;
     TCPConnection* Parent;
 
-    osEvent Event;
-    osQueue HoldingQueue;
-    osMutex HoldingQueueLock;
-    void*   ConnectionHoldingBuffer[TX_BUFFER_COUNT];
+    osEvent RxEvent; // Readers, WaitReceive, Listen and Connect wait on it
+    osEvent TxEvent; // Writers waiting for send buffer space wait on it
 
     InterfaceMAC* MAC;
     ProtocolIPv4* IP;
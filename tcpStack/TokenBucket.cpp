@@ -0,0 +1,147 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include "TokenBucket.hpp"
+
+// Largest frame the bucket must be able to pass, smaller bursts would hold
+// it back forever
+#define TOKEN_BUCKET_MIN_BURST 1514
+
+//============================================================================
+//
+//============================================================================
+
+TokenBucket::TokenBucket()
+    : Rate(0)
+    , Burst(0)
+    , Tokens(0)
+    , Time_us(0)
+{
+}
+
+//============================================================================
+// The bucket starts full
+//============================================================================
+
+void TokenBucket::Configure(uint32_t rate, uint32_t burst)
+{
+    if (burst < TOKEN_BUCKET_MIN_BURST)
+    {
+        burst = TOKEN_BUCKET_MIN_BURST;
+    }
+    Rate   = rate;
+    Burst  = burst;
+    Tokens = (int32_t)burst;
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TokenBucket::IsEnabled() const
+{
+    return Rate != 0;
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool TokenBucket::Conforms(uint16_t length, uint32_t time_us)
+{
+    bool rc = true;
+
+    if (Rate != 0)
+    {
+        Refill(time_us);
+        rc = Tokens >= (int32_t)length;
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TokenBucket::Consume(uint16_t length, uint32_t time_us)
+{
+    if (Rate != 0)
+    {
+        Refill(time_us);
+        Tokens -= length;
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+uint32_t TokenBucket::Delay(uint16_t length, uint32_t time_us)
+{
+    uint32_t rc = 0;
+
+    if (Rate != 0)
+    {
+        Refill(time_us);
+        if (Tokens < (int32_t)length)
+        {
+            // Rounded up so the bucket holds enough once the delay is over
+            rc = (uint32_t)(((uint64_t)(length - Tokens) * 1000000 + Rate - 1) / Rate);
+        }
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void TokenBucket::Refill(uint32_t time_us)
+{
+    uint64_t added = (uint64_t)(time_us - Time_us) * Rate / 1000000;
+
+    if (added > 0)
+    {
+        if ((int64_t)Tokens + (int64_t)added >= (int64_t)Burst)
+        {
+            Tokens  = (int32_t)Burst;
+            Time_us = time_us;
+        }
+        else
+        {
+            // Only whole bytes move Time_us on, the remainder keeps accruing
+            Tokens += (int32_t)added;
+            Time_us += (uint32_t)(added * 1000000 / Rate);
+        }
+    }
+}
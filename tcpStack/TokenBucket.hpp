@@ -0,0 +1,63 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <inttypes.h>
+
+// Token bucket rate limiter. Tokens are bytes, they accumulate at the rate
+// up to the burst size and each byte sent takes one. Consume may run the
+// bucket into debt so a send that could not be held back, a retransmission
+// say, still counts against the rate.
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    /// Configure sets the rate in bytes per second and the most the bucket
+    /// holds, which is at least one full frame. A rate of 0 removes the limit.
+    void Configure(uint32_t rate, uint32_t burst);
+    bool IsEnabled() const;
+
+    /// Conforms returns true if 'length' bytes may be sent now
+    bool Conforms(uint16_t length, uint32_t time_us);
+    void Consume(uint16_t length, uint32_t time_us);
+    /// Delay returns the microseconds until 'length' bytes conform
+    uint32_t Delay(uint16_t length, uint32_t time_us);
+
+private:
+    void Refill(uint32_t time_us);
+
+    uint32_t Rate;  // Bytes per second, 0 when disabled
+    uint32_t Burst; // Bytes
+    int32_t  Tokens;
+    uint32_t Time_us; // Last refill
+};
@@ -336,3 +336,83 @@ bool AddressCompare(const uint8_t* a1, const uint8_t* a2, int length)
 //============================================================================
 //
 //============================================================================
+
+static uint64_t Unpack64LE(const uint8_t* p)
+{
+    uint64_t rc = 0;
+
+    for (int i = 7; i >= 0; i--)
+    {
+        rc = (rc << 8) | p[i];
+    }
+
+    return rc;
+}
+
+//============================================================================
+//
+//============================================================================
+
+static void SipRound(uint64_t* v)
+{
+    v[0] += v[1];
+    v[1] = (v[1] << 13) | (v[1] >> 51);
+    v[1] ^= v[0];
+    v[0] = (v[0] << 32) | (v[0] >> 32);
+    v[2] += v[3];
+    v[3] = (v[3] << 16) | (v[3] >> 48);
+    v[3] ^= v[2];
+    v[0] += v[3];
+    v[3] = (v[3] << 21) | (v[3] >> 43);
+    v[3] ^= v[0];
+    v[2] += v[1];
+    v[1] = (v[1] << 17) | (v[1] >> 47);
+    v[1] ^= v[2];
+    v[2] = (v[2] << 32) | (v[2] >> 32);
+}
+
+//============================================================================
+// SipHash-2-4, two rounds per 8 byte block and four to finish
+//============================================================================
+
+uint64_t SipHash(const uint8_t* key, const uint8_t* data, size_t length)
+{
+    uint64_t k0 = Unpack64LE(key);
+    uint64_t k1 = Unpack64LE(key + 8);
+    uint64_t v[4];
+    uint64_t m;
+    size_t   i;
+
+    v[0] = k0 ^ 0x736f6d6570736575ULL;
+    v[1] = k1 ^ 0x646f72616e646f6dULL;
+    v[2] = k0 ^ 0x6c7967656e657261ULL;
+    v[3] = k1 ^ 0x7465646279746573ULL;
+
+    for (i = 0; i + 8 <= length; i += 8)
+    {
+        m = Unpack64LE(data + i);
+        v[3] ^= m;
+        SipRound(v);
+        SipRound(v);
+        v[0] ^= m;
+    }
+
+    // Last block holds the remaining bytes and the length in its top byte
+    m = (uint64_t)length << 56;
+    for (; i < length; i++)
+    {
+        m |= (uint64_t)data[i] << (8 * (i & 7));
+    }
+    v[3] ^= m;
+    SipRound(v);
+    SipRound(v);
+    v[0] ^= m;
+
+    v[2] ^= 0xFF;
+    SipRound(v);
+    SipRound(v);
+    SipRound(v);
+    SipRound(v);
+
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
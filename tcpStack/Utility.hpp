@@ -60,4 +60,8 @@ int ReadLine(char* buffer, size_t size, int (*ReadFunction)());
 
 bool AddressCompare(const uint8_t* a1, const uint8_t* a2, int length);
 
+// SipHash-2-4 of data under a 16 byte key, for short keyed digests like
+// TCP Fast Open cookies
+uint64_t SipHash(const uint8_t* key, const uint8_t* data, size_t length);
+
 #endif
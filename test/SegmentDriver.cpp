@@ -0,0 +1,269 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "FCS.hpp"
+#include "SegmentDriver.hpp"
+#include "Utility.hpp"
+#include "osThread.hpp"
+#include "osTime.hpp"
+
+static uint8_t LocalMAC[] = {0x10, 0xBF, 0x48, 0x44, 0x55, 0x66};
+static uint8_t PeerMAC[]  = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+static uint8_t LocalIP[]  = {10, 0, 0, 1};
+static uint8_t PeerIP[]   = {10, 0, 0, 2};
+
+SegmentDriver* SegmentDriver::Current = 0;
+
+//============================================================================
+// Each driver gets its own stack, it is never freed because the stack's
+// events and mutexes stay on the os lists
+//============================================================================
+
+SegmentDriver::SegmentDriver()
+    : Stack(*new DefaultStack())
+    , PeerSequence(1000)
+    , LocalSequence(0)
+    , PeerPort(SEGMENT_PEER_PORT)
+    , PeerWindow(SEGMENT_PEER_WINDOW)
+    , SentCount(0)
+{
+    ProtocolIPv4::AddressInfo info;
+
+    Current = this;
+
+    Stack.SetMACAddress(LocalMAC);
+    Stack.RegisterDataTransmitHandler(TxData);
+    memset(&info, 0, sizeof(info));
+    info.DataValid = true;
+    PackBytes(info.Address, 0, LocalIP, 4);
+    memset(info.SubnetMask, 0xFF, 3);
+    Stack.IP.SetAddressInfo(info);
+    Stack.ARP.Add(PeerIP, PeerMAC);
+}
+
+//============================================================================
+// Records every TCP segment the stack sends
+//============================================================================
+
+void SegmentDriver::TxData(void* data, size_t length)
+{
+    uint8_t* frame = (uint8_t*)data;
+    uint8_t* ip    = frame + 14;
+    uint8_t* tcp;
+    Sent*    sent;
+    uint16_t headerSize;
+
+    if (Current == 0 || Current->SentCount >= SEGMENT_SENT_MAX || length < 54 ||
+        Unpack16(frame, 12) != 0x0800 || ip[9] != 6)
+    {
+        return;
+    }
+
+    tcp        = ip + (ip[0] & 0x0F) * 4;
+    headerSize = (tcp[12] >> 4) * 4;
+    sent       = &Current->SentList[Current->SentCount];
+
+    sent->Flags           = tcp[13];
+    sent->Sequence        = Unpack32(tcp, 4);
+    sent->Acknowledgement = Unpack32(tcp, 8);
+    sent->Window          = Unpack16(tcp, 14);
+    sent->Length          = Unpack16(ip, 2) - (ip[0] & 0x0F) * 4 - headerSize;
+    sent->OptionsLength   = headerSize - 20;
+    memcpy(sent->Options, tcp + 20, sent->OptionsLength);
+    Current->SentCount++;
+}
+
+//============================================================================
+//
+//============================================================================
+
+size_t SegmentDriver::Build(uint8_t*       frame,
+                            uint8_t        flags,
+                            uint32_t       sequence,
+                            uint32_t       acknowledgement,
+                            const uint8_t* data,
+                            uint16_t       length,
+                            const uint8_t* options,
+                            uint8_t        optionsLength)
+{
+    uint8_t* ip         = frame + 14;
+    uint8_t* tcp        = ip + 20;
+    uint16_t headerSize = 20 + ((optionsLength + 3) & ~3);
+    uint16_t tcpSize    = headerSize + length;
+    uint16_t ipLength   = 20 + tcpSize;
+    uint32_t checksum;
+
+    memset(frame, 0, 14 + ipLength < 60 ? 60 : 14 + ipLength);
+    PackBytes(frame, 0, LocalMAC, 6);
+    PackBytes(frame, 6, PeerMAC, 6);
+    Pack16(frame, 12, 0x0800);
+
+    ip[0] = 0x45;
+    Pack16(ip, 2, ipLength);
+    ip[8] = 64;
+    ip[9] = 6;
+    PackBytes(ip, 12, PeerIP, 4);
+    PackBytes(ip, 16, LocalIP, 4);
+    Pack16(ip, 10, FCS::Checksum(ip, 20));
+
+    Pack16(tcp, 0, PeerPort);
+    Pack16(tcp, 2, SEGMENT_LOCAL_PORT);
+    Pack32(tcp, 4, sequence);
+    Pack32(tcp, 8, acknowledgement);
+    tcp[12] = (headerSize / 4) << 4;
+    tcp[13] = flags;
+    Pack16(tcp, 14, PeerWindow);
+    if (optionsLength > 0)
+    {
+        memcpy(tcp + 20, options, optionsLength);
+    }
+    if (length > 0)
+    {
+        memcpy(tcp + headerSize, data, length);
+    }
+    if ((tcpSize & 1) != 0)
+    {
+        // Pad byte for the checksum, the frame is one byte longer than sent
+        tcp[tcpSize] = 0;
+    }
+
+    checksum = FCS::ChecksumAdd(PeerIP, 4, 0);
+    checksum = FCS::ChecksumAdd(LocalIP, 4, checksum);
+    checksum += 6 + tcpSize;
+    checksum = FCS::ChecksumAdd(tcp, tcpSize + (tcpSize & 1), checksum);
+    while ((checksum >> 16) != 0)
+    {
+        checksum = (checksum & 0xFFFF) + (checksum >> 16);
+    }
+    Pack16(tcp, 16, (uint16_t)~checksum);
+
+    return (14 + ipLength < 60 ? 60 : 14 + ipLength);
+}
+
+//============================================================================
+//
+//============================================================================
+
+void SegmentDriver::Inject(uint8_t        flags,
+                           uint32_t       sequence,
+                           uint32_t       acknowledgement,
+                           const uint8_t* data,
+                           uint16_t       length,
+                           const uint8_t* options,
+                           uint8_t        optionsLength)
+{
+    uint8_t frame[14 + 20 + 60 + 1500 + 1];
+    size_t  size;
+
+    size = Build(frame, flags, sequence, acknowledgement, data, length, options, optionsLength);
+    Stack.ProcessRx(frame, size);
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* SegmentDriver::NewServer()
+{
+    return Stack.TCP.NewServer(&Stack.MAC, SEGMENT_LOCAL_PORT);
+}
+
+//============================================================================
+//
+//============================================================================
+
+bool SegmentDriver::Handshake(const uint8_t* options, uint8_t optionsLength)
+{
+    ClearSent();
+    Inject(FLAG_SYN, PeerSequence, 0, 0, 0, options, optionsLength);
+    if (SentCount == 0 || LastSent().Flags != (FLAG_SYN | FLAG_ACK))
+    {
+        return false;
+    }
+    PeerSequence++;
+    LocalSequence = LastSent().Sequence + 1;
+    Inject(FLAG_ACK, PeerSequence, LocalSequence);
+
+    return true;
+}
+
+//============================================================================
+//
+//============================================================================
+
+TCPConnection* SegmentDriver::Accept(TCPConnection* listener,
+                                     const uint8_t* options,
+                                     uint8_t        optionsLength)
+{
+    TCPConnection* connection = 0;
+
+    if (Handshake(options, optionsLength))
+    {
+        connection = listener->Listen();
+    }
+
+    return connection;
+}
+
+//============================================================================
+//
+//============================================================================
+
+void SegmentDriver::Run(uint32_t time_us)
+{
+    uint64_t end = osTime::GetTime() + time_us;
+
+    while (osTime::GetTime() < end)
+    {
+        osThread::USleep(250, __FILE__, __LINE__);
+        Stack.Tick();
+    }
+}
+
+//============================================================================
+//
+//============================================================================
+
+void SegmentDriver::ClearSent()
+{
+    SentCount = 0;
+}
+
+//============================================================================
+//
+//============================================================================
+
+const SegmentDriver::Sent& SegmentDriver::LastSent()
+{
+    return SentList[SentCount > 0 ? SentCount - 1 : 0];
+}
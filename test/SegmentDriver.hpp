@@ -0,0 +1,108 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include "DefaultStack.hpp"
+
+#define SEGMENT_LOCAL_PORT (80)
+#define SEGMENT_PEER_PORT (5000)
+#define SEGMENT_PEER_WINDOW (8192)
+#define SEGMENT_SENT_MAX (64)
+
+// Feeds hand built segments from a peer into a fresh stack and records the
+// segments the stack sends back, so tests can drive the state machine one
+// segment at a time without a network
+class SegmentDriver
+{
+public:
+    struct Sent
+    {
+        uint8_t  Flags;
+        uint32_t Sequence;
+        uint32_t Acknowledgement;
+        uint16_t Window;
+        uint16_t Length;
+        uint8_t  OptionsLength;
+        uint8_t  Options[40];
+    };
+
+    SegmentDriver();
+
+    /// Inject builds a segment from the peer and hands it to the stack
+    void Inject(uint8_t        flags,
+                uint32_t       sequence,
+                uint32_t       acknowledgement,
+                const uint8_t* data          = 0,
+                uint16_t       length        = 0,
+                const uint8_t* options       = 0,
+                uint8_t        optionsLength = 0);
+    /// Build only builds the frame and returns its length, for ProcessRxBatch.
+    /// The frame needs a spare byte past the end for the checksum pad.
+    size_t Build(uint8_t*       frame,
+                 uint8_t        flags,
+                 uint32_t       sequence,
+                 uint32_t       acknowledgement,
+                 const uint8_t* data          = 0,
+                 uint16_t       length        = 0,
+                 const uint8_t* options       = 0,
+                 uint8_t        optionsLength = 0);
+
+    /// NewServer opens a listener on SEGMENT_LOCAL_PORT
+    TCPConnection* NewServer();
+    /// Handshake opens a connection from PeerPort to SEGMENT_LOCAL_PORT,
+    /// PeerSequence and LocalSequence are left at the next sequence numbers
+    /// of each side. Returns false if no SYN|ACK came back.
+    bool Handshake(const uint8_t* options = 0, uint8_t optionsLength = 0);
+    /// Accept does the handshake and returns the listener's new connection
+    TCPConnection* Accept(TCPConnection* listener,
+                          const uint8_t* options       = 0,
+                          uint8_t        optionsLength = 0);
+
+    /// Run ticks the stack's timers for time_us
+    void Run(uint32_t time_us);
+
+    void        ClearSent();
+    const Sent& LastSent();
+
+    DefaultStack&  Stack;
+    uint32_t       PeerSequence;
+    uint32_t       LocalSequence;
+    uint16_t       PeerPort;
+    uint16_t       PeerWindow;
+    volatile int   SentCount;
+    Sent           SentList[SEGMENT_SENT_MAX];
+
+private:
+    static void TxData(void* data, size_t length);
+
+    static SegmentDriver* Current;
+};
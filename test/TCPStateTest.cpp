@@ -0,0 +1,709 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include "SegmentDriver.hpp"
+#include "Utility.hpp"
+#include "osThread.hpp"
+#include "osTime.hpp"
+
+static uint8_t PeerIP[] = {10, 0, 0, 2};
+
+// MSS 1460, SACK permitted, the options a Linux peer's SYN leads with
+static const uint8_t SackSynOptions[] = {2, 4, 0x05, 0xB4, 1, 1, 4, 2};
+
+struct ConnectJob
+{
+    TCPConnection* Connection;
+    bool           Result;
+    volatile bool  Done;
+};
+
+static void ThreadEntry_connect(void* param)
+{
+    ConnectJob* job = (ConnectJob*)param;
+
+    job->Result = job->Connection->Connect();
+    job->Done   = true;
+}
+
+// Starts Connect on a thread and returns once its SYN is out
+static bool StartConnect(SegmentDriver& driver, osThread& thread, ConnectJob& job)
+{
+    uint64_t start = osTime::GetTime();
+
+    driver.ClearSent();
+    job.Connection = driver.Stack.TCP.NewClient(
+        &driver.Stack.MAC, PeerIP, SEGMENT_PEER_PORT, SEGMENT_LOCAL_PORT);
+    job.Result = false;
+    job.Done   = false;
+    if (job.Connection == 0 || thread.Create(ThreadEntry_connect, "connect", 1024, 1, &job) != 0)
+    {
+        return false;
+    }
+    while (driver.SentCount == 0 && osTime::GetTime() - start < 1000000)
+    {
+        osThread::USleep(100, __FILE__, __LINE__);
+    }
+    driver.LocalSequence = driver.LastSent().Sequence + 1;
+
+    return driver.SentCount != 0 && (driver.LastSent().Flags & FLAG_SYN) != 0;
+}
+
+static bool WaitConnect(ConnectJob& job)
+{
+    uint64_t start = osTime::GetTime();
+
+    while (!job.Done && osTime::GetTime() - start < 1000000)
+    {
+        osThread::USleep(100, __FILE__, __LINE__);
+    }
+
+    return job.Done;
+}
+
+// Sums the data the driver saw sent from sequence on
+static uint32_t SentData(SegmentDriver& driver, uint32_t sequence)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i < driver.SentCount; i++)
+    {
+        if ((int32_t)(driver.SentList[i].Sequence - sequence) >= 0)
+        {
+            total += driver.SentList[i].Length;
+        }
+    }
+
+    return total;
+}
+
+static int CountAcks(SegmentDriver& driver)
+{
+    int count = 0;
+
+    for (int i = 0; i < driver.SentCount; i++)
+    {
+        if (driver.SentList[i].Length == 0 && driver.SentList[i].Flags == FLAG_ACK)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+//============================================================================
+// Handshakes
+//============================================================================
+
+TEST(TCPState, PassiveOpen)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+
+    driver.Inject(FLAG_SYN, driver.PeerSequence, 0);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_SYN | FLAG_ACK, driver.LastSent().Flags);
+    EXPECT_EQ(driver.PeerSequence + 1, driver.LastSent().Acknowledgement);
+
+    driver.PeerSequence++;
+    driver.LocalSequence = driver.LastSent().Sequence + 1;
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence);
+    connection = listener->Listen();
+    ASSERT_NE(nullptr, connection);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+    EXPECT_EQ(driver.PeerSequence, connection->AcknowledgementNumber);
+    EXPECT_EQ(driver.LocalSequence, connection->SequenceNumber);
+}
+
+TEST(TCPState, ClosedAnsweredWithReset)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[] = "data";
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    driver.Inject(FLAG_RST, driver.PeerSequence, 0);
+    ASSERT_EQ(TCPConnection::CLOSED, connection->State);
+
+    // Without an ACK to take the sequence from the RST acknowledges the
+    // segment, its data and FIN included
+    driver.ClearSent();
+    driver.Inject(FLAG_FIN, driver.PeerSequence, 0, data, 4);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_RST | FLAG_ACK, driver.LastSent().Flags);
+    EXPECT_EQ(0u, driver.LastSent().Sequence);
+    EXPECT_EQ(driver.PeerSequence + 4 + 1, driver.LastSent().Acknowledgement);
+
+    driver.ClearSent();
+    driver.Inject(FLAG_ACK, driver.PeerSequence, 12345);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_RST, driver.LastSent().Flags);
+    EXPECT_EQ(12345u, driver.LastSent().Sequence);
+
+    // Never a RST for a RST
+    driver.ClearSent();
+    driver.Inject(FLAG_RST, driver.PeerSequence, 0);
+    EXPECT_EQ(0, driver.SentCount);
+}
+
+TEST(TCPState, SynReceivedBadAck)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint32_t       badAck;
+
+    driver.Inject(FLAG_SYN, driver.PeerSequence++, 0);
+    ASSERT_EQ(1, driver.SentCount);
+    driver.LocalSequence = driver.LastSent().Sequence + 1;
+
+    // An ACK of something never sent gets a reset at the ACK's sequence,
+    // the half open connection stays
+    badAck = driver.LocalSequence + 100;
+    driver.ClearSent();
+    driver.Inject(FLAG_ACK, driver.PeerSequence, badAck);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_RST, driver.LastSent().Flags);
+    EXPECT_EQ(badAck, driver.LastSent().Sequence);
+
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence);
+    connection = listener->Listen();
+    ASSERT_NE(nullptr, connection);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+}
+
+TEST(TCPState, SynReceivedReset)
+{
+    SegmentDriver driver;
+
+    driver.NewServer();
+    driver.Inject(FLAG_SYN, driver.PeerSequence++, 0);
+    ASSERT_EQ(1, driver.SentCount);
+    driver.LocalSequence = driver.LastSent().Sequence + 1;
+
+    // After the reset the handshake's ACK finds no connection
+    driver.Inject(FLAG_RST, driver.PeerSequence, 0);
+    driver.ClearSent();
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_RST, driver.LastSent().Flags);
+    EXPECT_EQ(driver.LocalSequence, driver.LastSent().Sequence);
+}
+
+TEST(TCPState, SynSentBadAck)
+{
+    SegmentDriver driver;
+    osThread      thread;
+    ConnectJob    job;
+    uint32_t      badAck;
+
+    ASSERT_TRUE(StartConnect(driver, thread, job));
+
+    badAck = driver.LocalSequence + 1;
+    driver.ClearSent();
+    driver.Inject(FLAG_SYN | FLAG_ACK, driver.PeerSequence, badAck);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_RST, driver.LastSent().Flags);
+    EXPECT_EQ(badAck, driver.LastSent().Sequence);
+    EXPECT_EQ(TCPConnection::SYN_SENT, job.Connection->State);
+
+    driver.ClearSent();
+    driver.Inject(FLAG_SYN | FLAG_ACK, driver.PeerSequence, driver.LocalSequence);
+    ASSERT_TRUE(WaitConnect(job));
+    EXPECT_TRUE(job.Result);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, job.Connection->State);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_ACK, driver.LastSent().Flags);
+    EXPECT_EQ(driver.PeerSequence + 1, driver.LastSent().Acknowledgement);
+}
+
+TEST(TCPState, SynSentRefused)
+{
+    SegmentDriver driver;
+    osThread      thread;
+    ConnectJob    job;
+
+    ASSERT_TRUE(StartConnect(driver, thread, job));
+
+    // A reset that does not acknowledge the SYN is ignored
+    driver.Inject(FLAG_RST | FLAG_ACK, 0, driver.LocalSequence + 1);
+    EXPECT_EQ(TCPConnection::SYN_SENT, job.Connection->State);
+
+    driver.Inject(FLAG_RST | FLAG_ACK, 0, driver.LocalSequence);
+    ASSERT_TRUE(WaitConnect(job));
+    EXPECT_FALSE(job.Result);
+    EXPECT_EQ(TCPConnection::CLOSED, job.Connection->State);
+}
+
+//============================================================================
+// FIN and RST on an open connection
+//============================================================================
+
+TEST(TCPState, FinAfterData)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[] = "hello";
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    driver.ClearSent();
+    driver.Inject(
+        FLAG_ACK | FLAG_PSH | FLAG_FIN, driver.PeerSequence, driver.LocalSequence, data, 5);
+    EXPECT_EQ(TCPConnection::CLOSE_WAIT, connection->State);
+    ASSERT_LE(1, driver.SentCount);
+    EXPECT_EQ(driver.PeerSequence + 5 + 1, driver.LastSent().Acknowledgement);
+
+    for (int i = 0; i < 5; i++)
+    {
+        EXPECT_EQ(data[i], connection->Read());
+    }
+    EXPECT_EQ(-1, connection->Read());
+}
+
+TEST(TCPState, FinBeforeItsData)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[] = "abcdefgh";
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    // The FIN past the hole is dropped with the duplicate ACK, its data is
+    // held until the hole fills
+    driver.ClearSent();
+    driver.Inject(FLAG_ACK | FLAG_FIN, driver.PeerSequence + 4, driver.LocalSequence, data + 4, 4);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(driver.PeerSequence, driver.LastSent().Acknowledgement);
+
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence, data, 4);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+    EXPECT_EQ(driver.PeerSequence + 8, connection->AcknowledgementNumber);
+
+    // The retransmitted FIN closes it
+    driver.Inject(FLAG_ACK | FLAG_FIN, driver.PeerSequence + 8, driver.LocalSequence);
+    EXPECT_EQ(TCPConnection::CLOSE_WAIT, connection->State);
+    for (int i = 0; i < 8; i++)
+    {
+        EXPECT_EQ(data[i], connection->Read());
+    }
+    EXPECT_EQ(-1, connection->Read());
+}
+
+TEST(TCPState, ResetExactSequence)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    driver.ClearSent();
+    driver.Inject(FLAG_RST, driver.PeerSequence, 0);
+    EXPECT_EQ(TCPConnection::CLOSED, connection->State);
+    EXPECT_EQ(0, driver.SentCount);
+    EXPECT_EQ(-1, connection->Read());
+}
+
+TEST(TCPState, ResetInWindowChallenged)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    // In the window but not at RCV.NXT, a blind reset gets a challenge ACK
+    driver.ClearSent();
+    driver.Inject(FLAG_RST, driver.PeerSequence + 10, 0);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(FLAG_ACK, driver.LastSent().Flags);
+    EXPECT_EQ(driver.PeerSequence, driver.LastSent().Acknowledgement);
+
+    // Outside the window it is dropped
+    driver.ClearSent();
+    driver.Inject(FLAG_RST, driver.PeerSequence + 0x10000, 0);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, connection->State);
+    EXPECT_EQ(0, driver.SentCount);
+}
+
+//============================================================================
+// Nagle and delayed ACKs
+//============================================================================
+
+TEST(TCPOptions, NagleHoldsSmallWrite)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[10];
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    connection->SetNagle(true);
+    memset(data, 'n', sizeof(data));
+
+    driver.ClearSent();
+    connection->Write(data, sizeof(data));
+    connection->Flush();
+    connection->Write(data, sizeof(data));
+    connection->Flush();
+    ASSERT_EQ(1, driver.SentCount);
+    EXPECT_EQ(sizeof(data), driver.LastSent().Length);
+
+    // The ACK releases the held write
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence + sizeof(data));
+    ASSERT_EQ(2, driver.SentCount);
+    EXPECT_EQ(driver.LocalSequence + sizeof(data), driver.LastSent().Sequence);
+    EXPECT_EQ(sizeof(data), driver.LastSent().Length);
+}
+
+TEST(TCPOptions, AckFrequency)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[20];
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    connection->SetAckFrequency(3);
+    memset(data, 'f', sizeof(data));
+
+    driver.ClearSent();
+    for (int i = 0; i < 3; i++)
+    {
+        driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence, data, sizeof(data));
+        driver.PeerSequence += sizeof(data);
+        EXPECT_EQ(i < 2 ? 0 : 1, CountAcks(driver));
+    }
+    EXPECT_EQ(driver.PeerSequence, driver.LastSent().Acknowledgement);
+}
+
+TEST(TCPOptions, DelayedAckTimeoutZero)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[20];
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    connection->SetDelayedAckTimeout(0);
+    memset(data, 'z', sizeof(data));
+
+    driver.ClearSent();
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence, data, sizeof(data));
+    ASSERT_EQ(1, CountAcks(driver));
+    EXPECT_EQ(driver.PeerSequence + sizeof(data), driver.LastSent().Acknowledgement);
+}
+
+//============================================================================
+// Send ring
+//============================================================================
+
+TEST(TCPSend, PeerWindowLimitsOutput)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    uint8_t        data[1000];
+
+    driver.PeerWindow = 300;
+    connection        = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    memset(data, 'w', sizeof(data));
+
+    // The whole write is taken, only the peer's window of it is sent
+    driver.ClearSent();
+    EXPECT_EQ(sizeof(data), connection->TryWrite(data, sizeof(data)));
+    connection->Flush();
+    EXPECT_EQ(300u, SentData(driver, driver.LocalSequence));
+
+    driver.PeerWindow = SEGMENT_PEER_WINDOW;
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence + 300);
+    EXPECT_EQ(sizeof(data), SentData(driver, driver.LocalSequence));
+}
+
+TEST(TCPSend, TryWriteTakesWhatFits)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    static uint8_t data[TCP_TX_BUFFER_SIZE + 500];
+    uint16_t       count;
+
+    driver.PeerWindow = 100;
+    connection        = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    count = connection->TryWrite(data, sizeof(data));
+    EXPECT_EQ(TCP_TX_BUFFER_SIZE, count);
+    EXPECT_EQ(0, connection->TryWrite(data, sizeof(data)));
+
+    // Acknowledged data frees ring space for the next write
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence + 100);
+    EXPECT_EQ(100, connection->TryWrite(data, sizeof(data)));
+}
+
+//============================================================================
+// SACK, RACK and tail loss probes
+//============================================================================
+
+static void SackAck(SegmentDriver& driver, uint32_t acknowledgement, uint32_t left, uint32_t right)
+{
+    uint8_t options[12] = {1, 1, 5, 10};
+
+    Pack32(options, 4, left);
+    Pack32(options, 8, right);
+    driver.Inject(FLAG_ACK, driver.PeerSequence, acknowledgement, 0, 0, options, sizeof(options));
+}
+
+TEST(TCPLoss, SackNegotiated)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener  = driver.NewServer();
+    bool           permitted = false;
+
+    ASSERT_TRUE(driver.Handshake(SackSynOptions, sizeof(SackSynOptions)));
+    for (int i = 0; i < driver.SentList[0].OptionsLength; i++)
+    {
+        permitted |= driver.SentList[0].Options[i] == 4 && driver.SentList[0].Options[i + 1] == 2;
+    }
+    EXPECT_TRUE(permitted);
+    EXPECT_NE(nullptr, listener->Listen());
+}
+
+TEST(TCPLoss, RackRepairsHole)
+{
+    SegmentDriver             driver;
+    TCPConnection*            listener = driver.NewServer();
+    TCPConnection*            connection;
+    TCPConnection::Statistics stats;
+    uint8_t                   data[1200];
+    uint32_t                  start;
+    uint16_t                  first;
+
+    connection = driver.Accept(listener, SackSynOptions, sizeof(SackSynOptions));
+    ASSERT_NE(nullptr, connection);
+    memset(data, 'r', sizeof(data));
+
+    // An RTT sample first
+    connection->Write(data, 100);
+    connection->Flush();
+    osThread::USleep(5000, __FILE__, __LINE__);
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence + 100);
+    start = driver.LocalSequence + 100;
+
+    // The first segment is lost, the peer SACKs the rest
+    driver.ClearSent();
+    connection->Write(data, sizeof(data));
+    connection->Flush();
+    ASSERT_LE(2, driver.SentCount);
+    ASSERT_EQ(start, driver.SentList[0].Sequence);
+    first = driver.SentList[0].Length;
+    osThread::USleep(3000, __FILE__, __LINE__);
+    driver.ClearSent();
+    SackAck(driver, start, start + first, start + sizeof(data));
+    driver.Run(20000);
+
+    // Repaired well before the retransmit timeout
+    ASSERT_LE(1, driver.SentCount);
+    EXPECT_EQ(start, driver.SentList[0].Sequence);
+    EXPECT_EQ(first, driver.SentList[0].Length);
+    driver.Inject(FLAG_ACK, driver.PeerSequence, start + sizeof(data));
+    connection->GetStatistics(stats);
+    EXPECT_EQ(1u, stats.FastRetransmits);
+    EXPECT_EQ(start + sizeof(data), connection->UnacknowledgedSequence);
+}
+
+TEST(TCPLoss, TailLossProbe)
+{
+    SegmentDriver             driver;
+    TCPConnection*            listener = driver.NewServer();
+    TCPConnection*            connection;
+    TCPConnection::Statistics stats;
+    uint8_t                   data[1200];
+    uint32_t                  start;
+    uint32_t                  last;
+    uint64_t                  lost;
+    uint64_t                  probed = 0;
+
+    connection = driver.Accept(listener, SackSynOptions, sizeof(SackSynOptions));
+    ASSERT_NE(nullptr, connection);
+    memset(data, 't', sizeof(data));
+
+    connection->Write(data, 100);
+    connection->Flush();
+    osThread::USleep(5000, __FILE__, __LINE__);
+    driver.Inject(FLAG_ACK, driver.PeerSequence, driver.LocalSequence + 100);
+    start = driver.LocalSequence + 100;
+
+    // Everything but the last segment arrives
+    driver.ClearSent();
+    connection->Write(data, sizeof(data));
+    connection->Flush();
+    ASSERT_LE(2, driver.SentCount);
+    last = driver.LastSent().Sequence;
+    driver.Inject(FLAG_ACK, driver.PeerSequence, last);
+    lost = osTime::GetTime();
+
+    driver.ClearSent();
+    while (probed == 0 && osTime::GetTime() - lost < 500000)
+    {
+        driver.Run(500);
+        if (driver.SentCount > 0)
+        {
+            probed = osTime::GetTime() - lost;
+        }
+    }
+    ASSERT_LE(1, driver.SentCount);
+    EXPECT_EQ(last, driver.SentList[0].Sequence);
+    EXPECT_EQ(start + sizeof(data), driver.SentList[0].Sequence + driver.SentList[0].Length);
+    connection->GetStatistics(stats);
+    EXPECT_EQ(1u, stats.LossProbes);
+    EXPECT_GT(300000u, probed);
+}
+
+//============================================================================
+// Receive coalescing
+//============================================================================
+
+TEST(TCPReceive, BatchCoalesced)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    static uint8_t frames[3][1600];
+    uint8_t*       list[3];
+    size_t         length[3];
+    uint8_t        data[60];
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+
+    for (int i = 0; i < 3; i++)
+    {
+        memset(data, 'a' + i, sizeof(data));
+        list[i]   = frames[i];
+        length[i] = driver.Build(frames[i],
+                                 FLAG_ACK,
+                                 driver.PeerSequence + i * sizeof(data),
+                                 driver.LocalSequence,
+                                 data,
+                                 sizeof(data));
+    }
+    driver.ClearSent();
+    driver.Stack.ProcessRxBatch(list, length, 3);
+
+    // One ACK for the three segments
+    EXPECT_EQ(driver.PeerSequence + 3 * sizeof(data), connection->AcknowledgementNumber);
+    EXPECT_GE(1, CountAcks(driver));
+    for (int i = 0; i < 3 * (int)sizeof(data); i++)
+    {
+        ASSERT_EQ('a' + i / (int)sizeof(data), connection->Read());
+    }
+}
+
+TEST(TCPReceive, CorruptFrameNotMerged)
+{
+    SegmentDriver  driver;
+    TCPConnection* listener = driver.NewServer();
+    TCPConnection* connection;
+    static uint8_t frames[2][1600];
+    uint8_t*       list[2];
+    size_t         length[2];
+    uint8_t        data[50];
+
+    connection = driver.Accept(listener);
+    ASSERT_NE(nullptr, connection);
+    memset(data, 'd', sizeof(data));
+
+    for (int i = 0; i < 2; i++)
+    {
+        list[i]   = frames[i];
+        length[i] = driver.Build(frames[i],
+                                 FLAG_ACK,
+                                 driver.PeerSequence + i * sizeof(data),
+                                 driver.LocalSequence,
+                                 data,
+                                 sizeof(data));
+    }
+    frames[1][60] ^= 1;
+    driver.Stack.ProcessRxBatch(list, length, 2);
+    EXPECT_EQ(driver.PeerSequence + sizeof(data), connection->AcknowledgementNumber);
+}
+
+//============================================================================
+// Listeners sharing a port
+//============================================================================
+
+TEST(TCPListen, SharedPort)
+{
+    SegmentDriver  driver;
+    TCPConnection* first  = driver.NewServer();
+    TCPConnection* second = driver.NewServer();
+    TCPConnection* a;
+    TCPConnection* b;
+
+    ASSERT_NE(nullptr, first);
+    ASSERT_NE(nullptr, second);
+    ASSERT_NE(first, second);
+
+    // A listener holding an unaccepted connection passes the next one on,
+    // so each listener ends up with one
+    ASSERT_TRUE(driver.Handshake());
+    driver.PeerPort++;
+    ASSERT_TRUE(driver.Handshake());
+
+    a = first->Listen();
+    b = second->Listen();
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, a->State);
+    EXPECT_EQ(TCPConnection::ESTABLISHED, b->State);
+}
@@ -49,6 +49,7 @@
 #include <cstring>
 #include <stdio.h>
 
+#include "Config.hpp"
 #include "InterfaceMAC.hpp"
 #include "PacketIO.hpp"
 #include "Utility.hpp"
@@ -318,6 +319,18 @@ void PacketIO::TxData(void* packet, size_t length)
         fprintf(stderr, "\nError sending the packet: %s\n", pcap_geterr(adhandle));
     }
 }
+
+//============================================================================
+//
+//============================================================================
+
+void PacketIO::TxBatch(void** packets, size_t* lengths, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        TxData(packets[i], lengths[i]);
+    }
+}
 #elif __linux__
 
 PacketIO::PacketIO()
@@ -378,7 +391,7 @@ void PacketIO::GetInterface(char* name)
 //
 //============================================================================
 
-void PacketIO::Start(RxDataHandler rxData)
+void PacketIO::Start(RxBatchHandler rxBatch)
 {
     m_RawSocket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
     if (m_RawSocket == -1)
@@ -417,11 +430,33 @@ void PacketIO::Start(RxDataHandler rxData)
             printf("promiscuous membership error %s", strerror(errno));
         }
 
-        void* pkt_data = (void*)malloc(ETH_FRAME_LEN);
+        // Read whatever frames are waiting, up to a batch, in one call so
+        // the stack can coalesce them
+        uint8_t*       pkt_data = (uint8_t*)malloc(ETH_FRAME_LEN * RX_BATCH_SIZE);
+        uint8_t*       frames[RX_BATCH_SIZE];
+        size_t         lengths[RX_BATCH_SIZE];
+        struct mmsghdr messages[RX_BATCH_SIZE];
+        struct iovec   vectors[RX_BATCH_SIZE];
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < RX_BATCH_SIZE; i++)
+        {
+            frames[i]                      = &pkt_data[i * ETH_FRAME_LEN];
+            vectors[i].iov_base            = frames[i];
+            vectors[i].iov_len             = ETH_FRAME_LEN;
+            messages[i].msg_hdr.msg_iov    = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
         while (1)
         {
-            int length = recvfrom(m_RawSocket, pkt_data, ETH_FRAME_LEN, 0, NULL, NULL);
-            rxData((uint8_t*)pkt_data, length);
+            int count = recvmmsg(m_RawSocket, messages, RX_BATCH_SIZE, MSG_WAITFORONE, NULL);
+            for (int i = 0; i < count; i++)
+            {
+                lengths[i] = messages[i].msg_len;
+            }
+            if (count > 0)
+            {
+                rxBatch(frames, lengths, count);
+            }
         }
         free(pkt_data); // no way to get here, but ...
     }
@@ -457,4 +492,48 @@ void PacketIO::TxData(void* packet, size_t length)
     }
 }
 
+//============================================================================
+// Sends a batch of frames with a single system call
+//============================================================================
+
+void PacketIO::TxBatch(void** packets, size_t* lengths, int count)
+{
+    struct sockaddr_ll dest;
+    struct mmsghdr     messages[TX_BATCH_SIZE];
+    struct iovec       vectors[TX_BATCH_SIZE];
+    int                sent = 0;
+    int                i;
+
+    if (count > TX_BATCH_SIZE)
+    {
+        count = TX_BATCH_SIZE;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sll_family  = AF_PACKET;
+    dest.sll_ifindex = m_IfIndex;
+
+    memset(messages, 0, sizeof(messages));
+    for (i = 0; i < count; i++)
+    {
+        vectors[i].iov_base             = packets[i];
+        vectors[i].iov_len              = lengths[i];
+        messages[i].msg_hdr.msg_name    = &dest;
+        messages[i].msg_hdr.msg_namelen = sizeof(dest);
+        messages[i].msg_hdr.msg_iov     = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    while (sent < count)
+    {
+        int rc = sendmmsg(m_RawSocket, &messages[sent], count - sent, 0);
+        if (rc < 0)
+        {
+            printf("tx error %s\n", strerror(errno));
+            break;
+        }
+        sent += rc;
+    }
+}
+
 #endif
@@ -44,14 +44,16 @@ public:
     PacketIO(const char* name);
 
     typedef void (*RxDataHandler)(uint8_t* data, size_t length);
+    typedef void (*RxBatchHandler)(uint8_t** data, size_t* length, int count);
 #ifdef _WIN32
     void Start(pcap_handler handler);
 #elif __linux__
-    void Start(RxDataHandler);
+    void Start(RxBatchHandler);
     void Entry(void* param);
 #endif
     void Stop();
     void TxData(void* data, size_t length);
+    void TxBatch(void** data, size_t* length, int count);
     static void GetDevice(int interfaceNumber, char* buffer, size_t buffer_size);
     static int GetMACAddress(const char* adapter, uint8_t* mac);
     static void DisplayDevices();
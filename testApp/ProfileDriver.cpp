@@ -0,0 +1,210 @@
+//----------------------------------------------------------------------------
+// Copyright( c ) 2015, Robert Kimball
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//----------------------------------------------------------------------------
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FCS.hpp"
+#include "ProfileDriver.hpp"
+#include "Utility.hpp"
+#include "osPrintfInterface.hpp"
+
+#define PROFILE_PORT (7)
+#define PROFILE_PEER_PORT (5000)
+#define PROFILE_REQUEST_SIZE (100)
+#define PROFILE_RESPONSE_SIZE (100)
+
+static uint8_t  LocalMAC[]  = {0x10, 0xBF, 0x48, 0x44, 0x55, 0x66};
+static uint8_t  PeerMAC[]   = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+static uint8_t  LocalIP[]   = {10, 0, 0, 1};
+static uint8_t  PeerIP[]    = {10, 0, 0, 2};
+static uint32_t SynSequence = 0;
+
+class ConsolePrintf : public osPrintfInterface
+{
+public:
+    int Printf(const char* format, ...)
+    {
+        va_list args;
+        int     rc;
+
+        va_start(args, format);
+        rc = vprintf(format, args);
+        va_end(args);
+
+        return rc;
+    }
+};
+
+//============================================================================
+// The stack's SYN|ACK gives its initial sequence number, everything else it
+// sends is only counted by the exchange loop
+//============================================================================
+
+void ProfileDriver::TxData(void* data, size_t length)
+{
+    uint8_t* frame = (uint8_t*)data;
+    uint8_t* tcp;
+
+    if (length >= 54 && Unpack16(frame, 12) == 0x0800 && frame[23] == 6)
+    {
+        tcp = frame + 14 + (frame[14] & 0x0F) * 4;
+        if ((tcp[13] & 0x12) == 0x12)
+        {
+            SynSequence = Unpack32(tcp, 4);
+        }
+    }
+}
+
+//============================================================================
+// Builds a segment from the peer and hands it to the stack
+//============================================================================
+
+void ProfileDriver::Inject(DefaultStack&  stack,
+                           uint8_t        flags,
+                           uint32_t       sequence,
+                           uint32_t       acknowledgement,
+                           const uint8_t* data,
+                           uint16_t       length)
+{
+    uint8_t  frame[14 + 20 + 20 + PROFILE_REQUEST_SIZE + 1];
+    uint8_t* ip       = frame + 14;
+    uint8_t* tcp      = ip + 20;
+    uint16_t tcpSize  = 20 + length;
+    uint16_t ipLength = 20 + tcpSize;
+    uint32_t checksum;
+
+    memset(frame, 0, sizeof(frame));
+    PackBytes(frame, 0, LocalMAC, 6);
+    PackBytes(frame, 6, PeerMAC, 6);
+    Pack16(frame, 12, 0x0800);
+
+    ip[0] = 0x45;
+    Pack16(ip, 2, ipLength);
+    ip[8] = 64;
+    ip[9] = 6;
+    PackBytes(ip, 12, PeerIP, 4);
+    PackBytes(ip, 16, LocalIP, 4);
+    Pack16(ip, 10, FCS::Checksum(ip, 20));
+
+    Pack16(tcp, 0, PROFILE_PEER_PORT);
+    Pack16(tcp, 2, PROFILE_PORT);
+    Pack32(tcp, 4, sequence);
+    Pack32(tcp, 8, acknowledgement);
+    tcp[12] = (20 / 4) << 4;
+    tcp[13] = flags;
+    Pack16(tcp, 14, 8192);
+    if (length > 0)
+    {
+        memcpy(tcp + 20, data, length);
+    }
+
+    checksum = FCS::ChecksumAdd(PeerIP, 4, 0);
+    checksum = FCS::ChecksumAdd(LocalIP, 4, checksum);
+    checksum += 6 + tcpSize;
+    checksum = FCS::ChecksumAdd(tcp, tcpSize + (tcpSize & 1), checksum);
+    while ((checksum >> 16) != 0)
+    {
+        checksum = (checksum & 0xFFFF) + (checksum >> 16);
+    }
+    Pack16(tcp, 16, (uint16_t)~checksum);
+
+    stack.ProcessRx(frame, (14 + ipLength < 60 ? 60 : 14 + ipLength));
+}
+
+//============================================================================
+// Opens a connection to a listener on PROFILE_PORT, then per exchange sends
+// a request the application reads and answers and ACKs the answer. The
+// requests take the fast data path and the ACKs the fast ACK path unless
+// something sends them down the slow path.
+//============================================================================
+
+void ProfileDriver::Run(DefaultStack& stack, int exchanges)
+{
+    ProtocolIPv4::AddressInfo info;
+    ConsolePrintf             out;
+    TCPConnection*            listener;
+    TCPConnection*            connection;
+    uint8_t                   request[PROFILE_REQUEST_SIZE];
+    uint8_t                   response[PROFILE_RESPONSE_SIZE];
+    uint32_t                  peerSequence = 1000;
+    uint32_t                  sequence;
+    int                       i;
+    int                       j;
+
+    stack.SetMACAddress(LocalMAC);
+    stack.RegisterDataTransmitHandler(TxData);
+    memset(&info, 0, sizeof(info));
+    info.DataValid = true;
+    PackBytes(info.Address, 0, LocalIP, 4);
+    memset(info.SubnetMask, 0xFF, 3);
+    stack.IP.SetAddressInfo(info);
+    stack.ARP.Add(PeerIP, PeerMAC);
+
+    memset(request, 'q', sizeof(request));
+    memset(response, 'r', sizeof(response));
+
+    listener = stack.TCP.NewServer(&stack.MAC, PROFILE_PORT);
+    Inject(stack, FLAG_SYN, peerSequence++, 0, 0, 0);
+    sequence = SynSequence + 1;
+    Inject(stack, FLAG_ACK, peerSequence, sequence, 0, 0);
+    connection = (listener != 0 ? listener->Listen() : 0);
+    if (connection == 0)
+    {
+        printf("Profile connection failed\n");
+        return;
+    }
+
+    // Nothing runs the stack's timers here, so paced responses would wait
+    connection->SetPacing(false);
+
+    for (i = 0; i < exchanges; i++)
+    {
+        Inject(stack, FLAG_ACK | FLAG_PSH, peerSequence, sequence, request, sizeof(request));
+        peerSequence += sizeof(request);
+        for (j = 0; j < (int)sizeof(request); j++)
+        {
+            connection->Read();
+        }
+        connection->Write(response, sizeof(response));
+        connection->Flush();
+        sequence += sizeof(response);
+        Inject(stack, FLAG_ACK, peerSequence, sequence, 0, 0);
+    }
+
+    printf("%d exchanges of %d byte requests and %d byte responses\n",
+           exchanges,
+           PROFILE_REQUEST_SIZE,
+           PROFILE_RESPONSE_SIZE);
+    stack.TCP.Show(&out);
+}
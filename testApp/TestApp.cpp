@@ -43,6 +43,7 @@
 #include "HTTPPage.hpp"
 #include "InterfaceMAC.hpp"
 #include "PacketIO.hpp"
+#include "ProfileDriver.hpp"
 #include "ProtocolARP.hpp"
 #include "ProtocolDHCP.hpp"
 #include "ProtocolTCP.hpp"
@@ -85,9 +86,9 @@ void packet_handler(u_char* param, const struct pcap_pkthdr* header, const u_cha
 //
 //============================================================================
 
-void RxData(uint8_t* data, size_t length)
+void RxData(uint8_t** data, size_t* length, int count)
 {
-    tcpStack.ProcessRx(data, length);
+    tcpStack.ProcessRxBatch(data, length, count);
 }
 
 //============================================================================
@@ -103,6 +104,15 @@ void TxData(void* data, size_t length)
 //
 //============================================================================
 
+void TxBatch(void** data, size_t* length, int count)
+{
+    PIO->TxBatch(data, length, count);
+}
+
+//============================================================================
+//
+//============================================================================
+
 void NetworkEntry(void* param)
 {
     // This is just a made-up MAC address to user for testing
@@ -133,6 +143,7 @@ void NetworkEntry(void* param)
 #elif __linux__
     PIO = new PacketIO();
     tcpStack.RegisterDataTransmitHandler(TxData);
+    tcpStack.RegisterDataTransmitBatchHandler(TxBatch);
     StartEvent.Notify();
     PIO->Start(RxData);
 #endif
@@ -410,6 +421,11 @@ int main(int argc, char* argv[])
         {
             config.interfaceNumber = atoi(argv[++i]);
         }
+        else if (!strcmp(argv[i], "-profile") && i + 1 < argc)
+        {
+            ProfileDriver::Run(tcpStack, atoi(argv[++i]));
+            return 0;
+        }
         else
         {
             printf("unknown option '%s'\n", argv[i]);
@@ -433,11 +449,7 @@ int main(int argc, char* argv[])
 
     while (1)
     {
-#ifdef _WIN32
-        Sleep(100);
-#elif __linux__
-        usleep(100000);
-#endif
+        tcpStack.WaitForTick();
         tcpStack.Tick();
     }
 
@@ -55,8 +55,6 @@
 
 http::Server::Server()
     : PagePool("HTTPPage Pool", MAX_ACTIVE_CONNECTIONS, PagePoolBuffer)
-    , Thread()
-    , ListenerConnection(0)
     , CurrentConnection(0)
     , PageHandler(0)
     , ErrorHandler(0)
@@ -253,8 +251,12 @@ void http::Server::Initialize(InterfaceMAC& mac, ProtocolTCP& tcp, uint16_t port
         PagePool.Put(&PagePoolPages[i]);
     }
 
-    ListenerConnection = tcp.NewServer(&mac, port);
-    Thread.Create(http::Server::TaskEntry, "HTTPD", 1024 * 32, 100, this);
+    for (i = 0; i < HTTPD_LISTENER_COUNT; i++)
+    {
+        Listeners[i].Owner      = this;
+        Listeners[i].Connection = tcp.NewServer(&mac, port);
+        Listeners[i].Thread.Create(http::Server::TaskEntry, "HTTPD", 1024 * 32, 100, &Listeners[i]);
+    }
 }
 
 //============================================================================
@@ -276,22 +278,22 @@ void http::Server::ConnectionHandlerEntry(void* param)
 
 void http::Server::TaskEntry(void* param)
 {
-    Server* s = (Server*)param;
-    s->Task();
+    Listener* listener = (Listener*)param;
+    listener->Owner->Task(listener->Connection);
 }
 
 //============================================================================
 //
 //============================================================================
 
-void http::Server::Task()
+void http::Server::Task(TCPConnection* listener)
 {
     TCPConnection* connection;
     Page*          page;
 
     while (1)
     {
-        connection = ListenerConnection->Listen();
+        connection = listener->Listen();
 
         // Spawn off a thread to handle this connection
         page = (Page*)PagePool.Get();
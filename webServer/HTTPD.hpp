@@ -35,6 +35,9 @@
 #include "HTTPPage.hpp"
 
 #define MAX_ACTIVE_CONNECTIONS 3
+// Listening connections sharing the port, each accepted on its own thread.
+// Every listener takes one of the stack's TCP_MAX_CONNECTIONS.
+#define HTTPD_LISTENER_COUNT 2
 #define HTTPD_PATH_LENGTH_MAX 256
 
 class ProtocolTCP;
@@ -68,16 +71,22 @@ private:
     static void ConnectionHandlerEntry(void*);
     void        ConnectionHandler(void*);
 
+    struct Listener
+    {
+        Server*        Owner;
+        TCPConnection* Connection;
+        osThread       Thread;
+    };
+
     static void TaskEntry(void* param);
-    void Task();
+    void Task(TCPConnection* listener);
 
     Page    PagePoolPages[MAX_ACTIVE_CONNECTIONS];
     void*   PagePoolBuffer[MAX_ACTIVE_CONNECTIONS];
     osQueue PagePool;
 
-    osThread Thread;
+    Listener Listeners[HTTPD_LISTENER_COUNT];
 
-    TCPConnection* ListenerConnection;
     TCPConnection* CurrentConnection;
 
     PageRequestHandler   PageHandler;